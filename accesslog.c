@@ -0,0 +1,216 @@
+#include "accesslog.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+// The log file is mapped into one reserved address range that never moves,
+// so writers only reserve an offset with a single atomic add and memcpy the
+// record. The lock is taken only when the mapping has to be extended.
+// Closing clears log_base and waits for the writers that read it before.
+#define ACCESSLOG_RESERVE (16UL << 30)
+#define ACCESSLOG_CHUNK   (4UL << 20)
+
+_Static_assert(sizeof(access_header_t) == 64, "access_header_t must be 64 bytes");
+_Static_assert(sizeof(access_record_t) == 128, "access_record_t must be 128 bytes");
+
+static int log_fd = -1;
+static char* _Atomic log_base = NULL;
+static _Atomic size_t log_writers = 0;
+static _Atomic size_t log_next = 0;
+static _Atomic size_t log_mapped = 0;
+static _Atomic size_t log_dropped = 0;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool grow__(size_t need) {
+    size_t mapped = atomic_load_explicit(&log_mapped, memory_order_relaxed);
+
+    while (mapped < need) {
+        if (mapped + ACCESSLOG_CHUNK > ACCESSLOG_RESERVE) {
+            return false;
+        }
+
+        if (ftruncate(log_fd, mapped + ACCESSLOG_CHUNK) != 0) {
+            return false;
+        }
+
+        void* p = mmap(log_base + mapped, ACCESSLOG_CHUNK, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, log_fd, mapped);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+
+        mapped += ACCESSLOG_CHUNK;
+        atomic_store_explicit(&log_mapped, mapped, memory_order_release);
+    }
+
+    return true;
+}
+
+bool accesslog_open(const char* path) {
+    access_header_t header;
+
+    if ((log_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        log_error("ACCESSLOG", "Failed to open %s\n", path);
+        return false;
+    }
+
+    log_base = mmap(NULL, ACCESSLOG_RESERVE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (log_base == MAP_FAILED) {
+        log_error("ACCESSLOG", "Failed to reserve address space\n");
+        log_base = NULL;
+        close(log_fd);
+        return false;
+    }
+
+    if (!grow__(ACCESSLOG_CHUNK)) {
+        log_error("ACCESSLOG", "Failed to map %s\n", path);
+        munmap(log_base, ACCESSLOG_RESERVE);
+        log_base = NULL;
+        close(log_fd);
+        return false;
+    }
+
+    memset(&header, 0x00, sizeof(header));
+    header.magic = ACCESSLOG_MAGIC;
+    header.version = ACCESSLOG_VERSION;
+    header.record_size = sizeof(access_record_t);
+    header.created_ns = accesslog_now();
+    memcpy(log_base, &header, sizeof(header));
+    atomic_store(&log_next, sizeof(header));
+    return true;
+}
+
+void accesslog_close(void) {
+    if (log_base == NULL) {
+        return;
+    }
+
+    // new writes see NULL, the ones in flight still have the mapping
+    char* base = atomic_exchange(&log_base, NULL);
+    while (atomic_load(&log_writers) > 0) {
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    size_t used = atomic_load(&log_next);
+    size_t mapped = atomic_load(&log_mapped);
+
+    if (used > mapped) {
+        used = mapped;
+    }
+    msync(base, used, MS_SYNC);
+    munmap(base, ACCESSLOG_RESERVE);
+    if (ftruncate(log_fd, used) != 0) {
+        log_error("ACCESSLOG", "Failed to truncate access log\n");
+    }
+    close(log_fd);
+    log_fd = -1;
+    pthread_mutex_unlock(&log_mutex);
+
+    if (atomic_load(&log_dropped) > 0) {
+        log_warn("ACCESSLOG", "%zu records were dropped\n", atomic_load(&log_dropped));
+    }
+}
+
+bool accesslog_enabled(void) { return log_base != NULL; }
+
+void accesslog_write(const access_record_t* record) {
+    // counted before log_base is read, accesslog_close() waits for it
+    atomic_fetch_add(&log_writers, 1);
+    char* base = log_base;
+    if (base == NULL) {
+        atomic_fetch_sub(&log_writers, 1);
+        return;
+    }
+
+    size_t off = atomic_fetch_add_explicit(&log_next, sizeof(*record), memory_order_relaxed);
+    size_t end = off + sizeof(*record);
+    if (end > atomic_load_explicit(&log_mapped, memory_order_acquire)) {
+        pthread_mutex_lock(&log_mutex);
+        bool grown = log_base != NULL && grow__(end);
+        pthread_mutex_unlock(&log_mutex);
+        if (!grown) {
+            atomic_fetch_add(&log_dropped, 1);
+            atomic_fetch_sub(&log_writers, 1);
+            return;
+        }
+    }
+
+    memcpy(base + off, record, sizeof(*record));
+    atomic_fetch_sub(&log_writers, 1);
+}
+
+uint64_t accesslog_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t accesslog_since(uint64_t start_ns) {
+    uint64_t now = accesslog_now();
+    if (start_ns == 0 || now <= start_ns) {
+        return 1;
+    }
+
+    // 0 is reserved for "phase not reached"
+    uint64_t us = (now - start_ns) / 1000;
+    if (us == 0) {
+        return 1;
+    }
+    return us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+method_t accesslog_method(const char* method) {
+    static const char* names[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(method, names[i]) == 0) {
+            return (method_t)(i + 1);
+        }
+    }
+    return METHOD_OTHER;
+}
+
+const char* accesslog_method_name(method_t method) {
+    switch (method) {
+        case METHOD_GET:
+            return "GET";
+        case METHOD_HEAD:
+            return "HEAD";
+        case METHOD_POST:
+            return "POST";
+        case METHOD_PUT:
+            return "PUT";
+        case METHOD_DELETE:
+            return "DELETE";
+        case METHOD_CONNECT:
+            return "CONNECT";
+        case METHOD_OPTIONS:
+            return "OPTIONS";
+        default:
+            return "OTHER";
+    }
+}
+
+const char* accesslog_cache_name(cache_status_t status) {
+    switch (status) {
+        case CACHE_MISS:
+            return "MISS";
+        case CACHE_HIT:
+            return "HIT";
+        case CACHE_COLLAPSED:
+            return "COLLAPSED";
+        case CACHE_DISK:
+            return "DISK";
+        default:
+            return "NONE";
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ACCESSLOG_MAGIC   0x4c415850 /* "PXAL" */
+#define ACCESSLOG_VERSION 1
+#define ACCESSLOG_URL_LEN 76
+
+typedef enum {
+    CACHE_NONE = 0,
+    CACHE_MISS = 1,
+    CACHE_HIT = 2,
+    CACHE_COLLAPSED = 3,
+    CACHE_DISK = 4,
+} cache_status_t;
+
+typedef enum {
+    METHOD_OTHER = 0,
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_CONNECT,
+    METHOD_OPTIONS,
+} method_t;
+
+// file header, followed by fixed size records
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t created_ns;
+    char reserved[48];
+} access_header_t;
+
+// one record per request. phase timestamps are microseconds since accept_ns,
+// 0 means the request never reached that phase.
+typedef struct {
+    uint64_t accept_ns;
+    uint32_t headers_us;
+    uint32_t lookup_us;
+    uint32_t connect_us;
+    uint32_t first_byte_us;
+    uint32_t last_byte_us;
+    uint32_t client_addr;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint16_t status;
+    uint8_t cache;
+    uint8_t method;
+    char url[ACCESSLOG_URL_LEN];
+} access_record_t;
+
+bool accesslog_open(const char* path);
+void accesslog_close(void);
+bool accesslog_enabled(void);
+void accesslog_write(const access_record_t* record);
+uint64_t accesslog_now(void);
+uint32_t accesslog_since(uint64_t start_ns);
+method_t accesslog_method(const char* method);
+const char* accesslog_method_name(method_t method);
+const char* accesslog_cache_name(cache_status_t status);
+
+#endif
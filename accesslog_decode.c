@@ -0,0 +1,140 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+static void print_usage(char* program) {
+    fprintf(stderr, "Usage: %s <ACCESS_LOG> [OPTIONS]\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s, --summary        Print only per cache status totals\n");
+    fprintf(stderr, "  -?, --help           Show this help message\n");
+}
+
+static void print_phase(uint32_t us) {
+    if (us == 0) {
+        printf("\t-");
+    } else {
+        printf("\t%u", us);
+    }
+}
+
+static void print_record(const access_record_t* r) {
+    char time_buf[64], addr_buf[INET_ADDRSTRLEN];
+    time_t sec = r->accept_ns / 1000000000ULL;
+    struct tm tm;
+
+    gmtime_r(&sec, &tm);
+    strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    printf("%s.%09lluZ", time_buf, (unsigned long long)(r->accept_ns % 1000000000ULL));
+
+    if (inet_ntop(AF_INET, &r->client_addr, addr_buf, sizeof(addr_buf)) == NULL) {
+        strcpy(addr_buf, "-");
+    }
+    printf("\t%s\t%s\t%u\t%s", addr_buf, accesslog_method_name(r->method), r->status,
+           accesslog_cache_name(r->cache));
+    print_phase(r->headers_us);
+    print_phase(r->lookup_us);
+    print_phase(r->connect_us);
+    print_phase(r->first_byte_us);
+    print_phase(r->last_byte_us);
+    printf("\t%llu\t%llu\t%.*s\n", (unsigned long long)r->bytes_in,
+           (unsigned long long)r->bytes_out, (int)strnlen(r->url, ACCESSLOG_URL_LEN), r->url);
+}
+
+int main(int argc, char** argv) {
+    int c, option_index = 0;
+    bool summary = false;
+    struct stat st;
+
+    static struct option long_options[] = {{"summary", no_argument, 0, 's'},
+                                           {"help", no_argument, 0, '?'},
+                                           {0, 0, 0, 0}};
+
+    while ((c = getopt_long(argc, argv, "s?", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 's':
+                summary = true;
+                break;
+            case '?':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind >= argc) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open %s\n", argv[optind]);
+        exit(1);
+    }
+
+    if ((size_t)st.st_size < sizeof(access_header_t)) {
+        fprintf(stderr, "%s is too short to be an access log\n", argv[optind]);
+        exit(1);
+    }
+
+    char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s\n", argv[optind]);
+        exit(1);
+    }
+
+    const access_header_t* header = (const access_header_t*)base;
+    if (header->magic != ACCESSLOG_MAGIC || header->version != ACCESSLOG_VERSION ||
+        header->record_size != sizeof(access_record_t)) {
+        fprintf(stderr, "%s is not a version %d access log\n", argv[optind], ACCESSLOG_VERSION);
+        exit(1);
+    }
+
+    size_t count = (st.st_size - sizeof(*header)) / sizeof(access_record_t);
+    const access_record_t* records = (const access_record_t*)(base + sizeof(*header));
+    size_t totals[CACHE_DISK + 1] = {0};
+    unsigned long long bytes_out = 0;
+
+    if (!summary) {
+        printf("#accept\tclient\tmethod\tstatus\tcache\theaders_us\tlookup_us\tconnect_us"
+               "\tfirst_byte_us\tlast_byte_us\tbytes_in\tbytes_out\turl\n");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        // reserved but never written (crash or unclean shutdown)
+        if (records[i].accept_ns == 0) {
+            continue;
+        }
+
+        if (records[i].cache <= CACHE_DISK) {
+            totals[records[i].cache]++;
+        }
+        bytes_out += records[i].bytes_out;
+
+        if (!summary) {
+            print_record(&records[i]);
+        }
+    }
+
+    if (summary) {
+        for (int s = CACHE_NONE; s <= CACHE_DISK; s++) {
+            printf("%s\t%zu\n", accesslog_cache_name(s), totals[s]);
+        }
+        printf("bytes_out\t%llu\n", bytes_out);
+    }
+
+    munmap(base, st.st_size);
+    close(fd);
+    return 0;
+}
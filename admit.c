@@ -0,0 +1,121 @@
+#include "admit.h"
+
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "accesslog.h"
+#include "logger.h"
+
+// Admission control. Connections are counted in total and per client
+// address, fetches from the origin in total; past a limit the client gets
+// the 503 below and nothing else is spent on it.
+//
+// Overload is told from a burst the CoDel way: by the time requests wait
+// for a worker. Once that stayed above SHED_TARGET for a whole
+// SHED_INTERVAL, requests that need the origin are shed until a wait drops
+// below the target again. Cache hits are cheap and always served.
+
+static const char reject_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static size_t max_conns;
+static size_t max_per_client;
+static size_t max_fetches;
+static _Atomic size_t n_conns;
+static _Atomic size_t n_fetches;
+// counts per hashed address, lock free. addresses sharing a slot share a
+// limit, which can only make it stricter
+static _Atomic uint32_t per_client[ADMIT_SLOTS];
+// when the wait first went above the target, 0 while it is below
+static _Atomic uint64_t above_since;
+static _Atomic bool dropping;
+
+static _Atomic uint32_t* slot__(uint32_t client_addr) {
+    return &per_client[(client_addr * 2654435761u) >> (32 - ADMIT_BITS)];
+}
+
+void admit_init(size_t conns, size_t per_client_conns, size_t fetches) {
+    max_conns = conns;
+    max_per_client = per_client_conns;
+    max_fetches = fetches;
+}
+
+// counts a new connection, false when it is over a limit. addresses that
+// are not IPv4 (0) only count towards the total
+bool admit_conn(uint32_t client_addr) {
+    if (atomic_fetch_add(&n_conns, 1) >= max_conns && max_conns > 0) {
+        atomic_fetch_sub(&n_conns, 1);
+        return false;
+    }
+    if (client_addr != 0 && max_per_client > 0 &&
+        atomic_fetch_add(slot__(client_addr), 1) >= max_per_client) {
+        atomic_fetch_sub(slot__(client_addr), 1);
+        atomic_fetch_sub(&n_conns, 1);
+        return false;
+    }
+    return true;
+}
+
+// for every connection admit_conn() let in, once it is closed
+void admit_release(uint32_t client_addr) {
+    atomic_fetch_sub(&n_conns, 1);
+    if (client_addr != 0 && max_per_client > 0) {
+        atomic_fetch_sub(slot__(client_addr), 1);
+    }
+}
+
+// false when a request that needs the origin has to be shed, otherwise
+// admit_fetch_done() follows once the fetch ended
+bool admit_fetch(void) {
+    if (atomic_load_explicit(&dropping, memory_order_relaxed)) {
+        return false;
+    }
+    if (atomic_fetch_add(&n_fetches, 1) >= max_fetches && max_fetches > 0) {
+        atomic_fetch_sub(&n_fetches, 1);
+        return false;
+    }
+    return true;
+}
+
+void admit_fetch_done(void) {
+    atomic_fetch_sub(&n_fetches, 1);
+}
+
+// how long a request waited for its worker
+void admit_queued(uint64_t wait_ns) {
+    uint64_t now = accesslog_now();
+    uint64_t since = 0;
+
+    if (wait_ns < (uint64_t)SHED_TARGET * 1000000) {
+        atomic_store_explicit(&above_since, 0, memory_order_relaxed);
+        if (atomic_exchange(&dropping, false)) {
+            log_info("ADMIT", "Workers caught up, no longer shedding\n");
+        }
+        return;
+    }
+    if (atomic_compare_exchange_strong(&above_since, &since, now)) {
+        return;
+    }
+    if (since != 0 && now - since >= (uint64_t)SHED_INTERVAL * 1000000 &&
+        !atomic_exchange(&dropping, true)) {
+        log_warn("ADMIT", "Requests waited over %dms for %dms, shedding origin fetches\n",
+                 SHED_TARGET, SHED_INTERVAL);
+    }
+}
+
+bool admit_overloaded(void) {
+    return atomic_load(&dropping);
+}
+
+size_t admit_fetches(void) {
+    return atomic_load(&n_fetches);
+}
+
+// one send that never blocks, the caller closes the connection after it
+void admit_reject(int fd) {
+    send(fd, reject_response, sizeof(reject_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
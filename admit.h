@@ -0,0 +1,24 @@
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ADMIT_BITS    12
+#define ADMIT_SLOTS   (1 << ADMIT_BITS)
+#define SHED_TARGET   5 /* ms */
+#define SHED_INTERVAL 100 /* ms */
+
+// 0 leaves a limit off
+void admit_init(size_t max_conns, size_t max_per_client, size_t max_fetches);
+bool admit_conn(uint32_t client_addr);
+void admit_release(uint32_t client_addr);
+bool admit_fetch(void);
+void admit_fetch_done(void);
+void admit_queued(uint64_t wait_ns);
+bool admit_overloaded(void);
+size_t admit_fetches(void);
+void admit_reject(int fd);
+
+#endif
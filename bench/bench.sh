@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# bench.sh - throughput and tail latency of the proxy against the bundled
+#     tiny server and against the built-in origin of loadgen.
+#
+#     usage: ./bench.sh [DURATION]
+#
+#     PROXY_ARGS is passed to the proxy, e.g. PROXY_ARGS="-b uring" to
+#     measure the io_uring backend.
+#
+
+DURATION=${1:-5}
+HOME_DIR=`cd $(dirname $0)/.. && pwd`
+LOADGEN=${HOME_DIR}/bench/loadgen
+TINY_FILES="/home.html /csapp.c /tiny.c /godzilla.jpg /godzilla.gif /cgi-bin/adder?1&2"
+
+function wait_for_port {
+    for i in `seq 50`; do
+        (echo > /dev/tcp/localhost/$1) 2> /dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing is listening on port $1"
+    exit 1
+}
+
+function cleanup {
+    kill ${tiny_pid} ${proxy_pid} 2> /dev/null
+    wait 2> /dev/null
+}
+trap cleanup EXIT
+
+tiny_port=`${HOME_DIR}/free-port.sh`
+(cd ${HOME_DIR}/tiny; ./tiny ${tiny_port} > /dev/null 2>&1) &
+tiny_pid=$!
+wait_for_port ${tiny_port}
+
+proxy_port=`${HOME_DIR}/free-port.sh`
+${HOME_DIR}/proxy ${proxy_port} ${PROXY_ARGS} > /dev/null 2>&1 &
+proxy_pid=$!
+wait_for_port ${proxy_port}
+
+echo "*** tiny, closed loop, zipf 1.0 ***"
+${LOADGEN} -x localhost:${proxy_port} -o localhost:${tiny_port} -c 4 -d ${DURATION} -z 1.0 \
+    ${TINY_FILES}
+echo ""
+
+echo "*** built-in origin, closed loop, 1 KB objects ***"
+${LOADGEN} -x localhost:${proxy_port} -c 16 -d ${DURATION} -z 1.0 -N 200 -s 1024
+echo ""
+
+echo "*** built-in origin, closed loop, keep-alive, 1 KB objects ***"
+${LOADGEN} -x localhost:${proxy_port} -c 16 -d ${DURATION} -z 1.0 -N 200 -s 1024 -k
+echo ""
+
+echo "*** built-in origin, open loop 2000 req/s, 16 KB objects ***"
+${LOADGEN} -x localhost:${proxy_port} -c 32 -d ${DURATION} -r 2000 -z 0.8 -N 500 -s 16384
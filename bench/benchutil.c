@@ -0,0 +1,212 @@
+#include "benchutil.h"
+
+#include <inttypes.h>
+#include <strings.h>
+#include <time.h>
+
+int bench_timeout_ms = 5000;
+
+static int cmp_u32__(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+bool bench_has_token(const char* line, const char* token) {
+    size_t len = strlen(token);
+    for (const char* p = line; *p != '\0'; p++) {
+        if (strncasecmp(p, token, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t bench_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void bench_conn_init(bench_conn_t* conn) { conn->fd = -1; }
+
+void bench_close(bench_conn_t* conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static bool discard__(bench_conn_t* conn, size_t n, size_t* total) {
+    char buf[MAXBUF];
+    while (n > 0) {
+        ssize_t got = rio_readnb(&conn->rio, buf, n < sizeof(buf) ? n : sizeof(buf));
+        if (got <= 0) {
+            return false;
+        }
+        n -= got;
+        *total += got;
+    }
+    return true;
+}
+
+static bool read_chunked__(bench_conn_t* conn, size_t* total) {
+    char line[MAXLINE];
+    ssize_t n;
+
+    while ((n = rio_readlineb(&conn->rio, line, sizeof(line))) > 0) {
+        *total += n;
+        size_t size = strtoul(line, NULL, 16);
+        if (size == 0) {
+            // trailers end with an empty line
+            while ((n = rio_readlineb(&conn->rio, line, sizeof(line))) > 0) {
+                *total += n;
+                if (strcmp(line, "\r\n") == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        if (!discard__(conn, size + 2, total)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool fetch__(bench_conn_t* conn, const char* req, size_t req_len, bench_response_t* resp) {
+    char line[MAXLINE];
+    ssize_t n;
+    long content_length = -1;
+    bool chunked = false;
+
+    if (rio_writen(conn->fd, (void*)req, req_len) != req_len) {
+        return false;
+    }
+
+    if ((n = rio_readlineb(&conn->rio, line, sizeof(line))) <= 0) {
+        return false;
+    }
+    resp->bytes += n;
+    char* code = strchr(line, ' ');
+    resp->status = strncmp(line, "HTTP/", 5) == 0 && code != NULL ? atoi(code + 1) : 0;
+    resp->closed = strncmp(line, "HTTP/1.0", 8) == 0;
+
+    while ((n = rio_readlineb(&conn->rio, line, sizeof(line))) > 0) {
+        resp->bytes += n;
+        if (strcmp(line, "\r\n") == 0) {
+            break;
+        }
+
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = atol(line + 15);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = bench_has_token(line, "chunked");
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            resp->closed = bench_has_token(line, "close");
+        }
+    }
+    if (n <= 0) {
+        return false;
+    }
+
+    if (chunked) {
+        return read_chunked__(conn, &resp->bytes);
+    }
+
+    if (content_length >= 0) {
+        return discard__(conn, content_length, &resp->bytes);
+    }
+
+    // delimited by connection close
+    resp->closed = true;
+    while (discard__(conn, MAXBUF, &resp->bytes)) {
+    }
+    return true;
+}
+
+bool bench_fetch(bench_conn_t* conn, const char* host, const char* port, const char* req,
+                 size_t req_len, bench_response_t* resp) {
+    bool reused = conn->fd >= 0;
+
+    memset(resp, 0x00, sizeof(*resp));
+    if (!reused) {
+        if ((conn->fd = open_clientfd((char*)host, (char*)port)) < 0) {
+            conn->fd = -1;
+            return false;
+        }
+        struct timeval tv = {bench_timeout_ms / 1000, (bench_timeout_ms % 1000) * 1000};
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        rio_readinitb(&conn->rio, conn->fd);
+    }
+
+    bool ok = fetch__(conn, req, req_len, resp);
+    if (!ok && reused && resp->bytes == 0) {
+        // the server closed an idle keep-alive connection, retry once
+        bench_close(conn);
+        return bench_fetch(conn, host, port, req, req_len, resp);
+    }
+
+    if (!ok || resp->closed) {
+        bench_close(conn);
+    }
+    return ok;
+}
+
+bool bench_scrape_cache(const char* host, const char* port, uint64_t* hits, uint64_t* misses) {
+    char req[] = "GET /__proxy/metrics HTTP/1.0\r\n\r\n";
+    char line[MAXLINE];
+    rio_t rio;
+    bool found = false;
+
+    int fd = open_clientfd((char*)host, (char*)port);
+    if (fd < 0) {
+        return false;
+    }
+
+    rio_readinitb(&rio, fd);
+    if (rio_writen(fd, req, strlen(req)) == strlen(req)) {
+        while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+            if (sscanf(line, "proxy_cache_hits_total %" SCNu64, hits) == 1) {
+                found = true;
+            }
+            sscanf(line, "proxy_cache_misses_total %" SCNu64, misses);
+        }
+    }
+    close(fd);
+    return found;
+}
+
+void lat_push(lat_vec_t* vec, uint32_t us) {
+    if (vec->n == vec->cap) {
+        vec->cap = vec->cap == 0 ? 4096 : vec->cap * 2;
+        vec->v = realloc(vec->v, vec->cap * sizeof(uint32_t));
+    }
+    vec->v[vec->n++] = us;
+}
+
+void lat_merge(lat_vec_t* dst, const lat_vec_t* src) {
+    for (size_t i = 0; i < src->n; i++) {
+        lat_push(dst, src->v[i]);
+    }
+}
+
+void bench_report_latency(FILE* out, lat_vec_t* vec) {
+    static const struct {
+        const char* name;
+        double q;
+    } quantiles[] = {{"p50", 0.50}, {"p90", 0.90}, {"p99", 0.99}, {"p999", 0.999}};
+
+    if (vec->n == 0) {
+        fprintf(out, "latency        n/a\n");
+        return;
+    }
+
+    qsort(vec->v, vec->n, sizeof(uint32_t), cmp_u32__);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        size_t idx = (size_t)(quantiles[i].q * (vec->n - 1));
+        fprintf(out, "latency %-6s %u us\n", quantiles[i].name, vec->v[idx]);
+    }
+    fprintf(out, "latency max    %u us\n", vec->v[vec->n - 1]);
+}
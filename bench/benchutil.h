@@ -0,0 +1,41 @@
+#ifndef __BENCHUTIL_H__
+#define __BENCHUTIL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "csapp.h"
+
+typedef struct {
+    int fd;
+    rio_t rio;
+} bench_conn_t;
+
+typedef struct {
+    int status;
+    size_t bytes;
+    bool closed;
+} bench_response_t;
+
+typedef struct {
+    uint32_t* v;
+    size_t n;
+    size_t cap;
+} lat_vec_t;
+
+// per request socket timeout, a stuck request counts as an error
+extern int bench_timeout_ms;
+
+bool bench_has_token(const char* line, const char* token);
+uint64_t bench_now_us(void);
+void bench_conn_init(bench_conn_t* conn);
+void bench_close(bench_conn_t* conn);
+bool bench_fetch(bench_conn_t* conn, const char* host, const char* port, const char* req,
+                 size_t req_len, bench_response_t* resp);
+bool bench_scrape_cache(const char* host, const char* port, uint64_t* hits, uint64_t* misses);
+void lat_push(lat_vec_t* vec, uint32_t us);
+void lat_merge(lat_vec_t* dst, const lat_vec_t* src);
+void bench_report_latency(FILE* out, lat_vec_t* vec);
+
+#endif
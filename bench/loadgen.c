@@ -0,0 +1,333 @@
+/*
+ * loadgen.c - closed and open loop HTTP load generator for the proxy.
+ *
+ * Closed loop: every connection issues the next request as soon as the
+ * previous response is complete. Open loop: requests are scheduled at a
+ * fixed aggregate rate and latency is measured from the scheduled send
+ * time, so a stalled proxy shows up in the tail instead of lowering the
+ * offered load (coordinated omission).
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "benchutil.h"
+#include "origin.h"
+
+typedef struct {
+    int id;
+    uint64_t seed;
+    lat_vec_t lat;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    pthread_t tid;
+} worker_t;
+
+static struct {
+    char* host;
+    char* port;
+    char* origin_host;
+    char* origin_port;
+    char** paths;
+    size_t n_paths;
+    double* cdf;
+    int concurrency;
+    double duration;
+    long total;
+    double rate;
+    bool keepalive;
+    double zipf;
+    size_t object_size;
+} cfg;
+
+static _Atomic long issued = 0;
+static uint64_t start_us, stop_us;
+
+void print_usage(char* program) {
+    fprintf(stderr, "Usage: %s [OPTIONS] <PATH>...\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -x, --proxy=HOST:PORT     Send requests through the proxy\n");
+    fprintf(stderr, "  -o, --origin=HOST:PORT    Origin server (default: built-in origin)\n");
+    fprintf(stderr, "  -c, --concurrency=N       Concurrent connections (default: 8)\n");
+    fprintf(stderr, "  -d, --duration=SEC        Run for SEC seconds (default: 5)\n");
+    fprintf(stderr, "  -n, --requests=N          Stop after N requests\n");
+    fprintf(stderr, "  -r, --rate=RPS            Open loop at RPS requests/sec\n");
+    fprintf(stderr, "  -k, --keepalive           Reuse connections (HTTP/1.1)\n");
+    fprintf(stderr, "  -z, --zipf=S              Zipf exponent over PATHs (default: 0, uniform)\n");
+    fprintf(stderr, "  -N, --objects=N           Use N built-in origin objects as PATHs\n");
+    fprintf(stderr, "  -s, --size=BYTES          Built-in origin object size (default: 1024)\n");
+    fprintf(stderr, "  -t, --timeout=MS          Per request timeout (default: 5000)\n");
+    fprintf(stderr, "  -?, --help                Show this help message\n");
+}
+
+static bool split_hostport__(char* arg, char** host, char** port) {
+    char* pos = strrchr(arg, ':');
+    if (pos == NULL) {
+        return false;
+    }
+    *pos = '\0';
+    *host = arg;
+    *port = pos + 1;
+    return true;
+}
+
+static size_t fixed_size__(const char* path, void* arg) { return *(size_t*)arg; }
+
+static uint64_t next_rand__(uint64_t* state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static size_t pick_path__(worker_t* w) {
+    double u = (next_rand__(&w->seed) >> 11) * (1.0 / 9007199254740992.0);
+    size_t lo = 0, hi = cfg.n_paths - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cfg.cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void build_cdf__(void) {
+    double sum = 0;
+    cfg.cdf = malloc(sizeof(double) * cfg.n_paths);
+    for (size_t i = 0; i < cfg.n_paths; i++) {
+        sum += 1.0 / pow(i + 1, cfg.zipf);
+        cfg.cdf[i] = sum;
+    }
+    for (size_t i = 0; i < cfg.n_paths; i++) {
+        cfg.cdf[i] /= sum;
+    }
+}
+
+static bool more__(void) {
+    if (cfg.total > 0) {
+        return atomic_fetch_add(&issued, 1) < cfg.total;
+    }
+    return bench_now_us() < stop_us;
+}
+
+static void sleep_until__(uint64_t us) {
+    uint64_t now = bench_now_us();
+    if (us > now) {
+        struct timespec ts = {(us - now) / 1000000, ((us - now) % 1000000) * 1000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void* run_worker__(void* arg) {
+    worker_t* w = arg;
+    bench_conn_t conn;
+    bench_response_t resp;
+    char req[MAXLINE];
+    double interval = cfg.rate > 0 ? 1e6 * cfg.concurrency / cfg.rate : 0;
+    const char* target_host = cfg.host ? cfg.host : cfg.origin_host;
+    const char* target_port = cfg.host ? cfg.port : cfg.origin_port;
+
+    bench_conn_init(&conn);
+    for (uint64_t k = 0; more__(); k++) {
+        const char* path = cfg.paths[pick_path__(w)];
+        uint64_t begin = bench_now_us();
+
+        if (interval > 0) {
+            // stagger workers so the aggregate schedule is uniform
+            begin = start_us + (uint64_t)((k + (double)w->id / cfg.concurrency) * interval);
+            sleep_until__(begin);
+        }
+
+        int len;
+        if (cfg.host != NULL) {
+            len = snprintf(req, sizeof(req), "GET http://%s:%s%s %s\r\nHost: %s:%s\r\n%s\r\n",
+                           cfg.origin_host, cfg.origin_port, path,
+                           cfg.keepalive ? "HTTP/1.1" : "HTTP/1.0", cfg.origin_host,
+                           cfg.origin_port,
+                           cfg.keepalive ? "Proxy-Connection: keep-alive\r\n" : "");
+        } else {
+            len = snprintf(req, sizeof(req), "GET %s %s\r\nHost: %s:%s\r\n%s\r\n", path,
+                           cfg.keepalive ? "HTTP/1.1" : "HTTP/1.0", cfg.origin_host,
+                           cfg.origin_port, cfg.keepalive ? "" : "Connection: close\r\n");
+        }
+
+        bool ok = bench_fetch(&conn, target_host, target_port, req, len, &resp);
+        if (!cfg.keepalive) {
+            bench_close(&conn);
+        }
+
+        w->requests++;
+        w->bytes += resp.bytes;
+        if (!ok || resp.status != 200) {
+            w->errors++;
+            continue;
+        }
+        lat_push(&w->lat, bench_now_us() - begin);
+    }
+
+    bench_close(&conn);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int c, option_index = 0;
+    long n_objects = 0;
+    uint64_t hits0 = 0, misses0 = 0, hits1 = 0, misses1 = 0;
+    bool scraped = false;
+    origin_t* origin = NULL;
+
+    static struct option long_options[] = {{"proxy", required_argument, 0, 'x'},
+                                           {"origin", required_argument, 0, 'o'},
+                                           {"concurrency", required_argument, 0, 'c'},
+                                           {"duration", required_argument, 0, 'd'},
+                                           {"requests", required_argument, 0, 'n'},
+                                           {"rate", required_argument, 0, 'r'},
+                                           {"keepalive", no_argument, 0, 'k'},
+                                           {"zipf", required_argument, 0, 'z'},
+                                           {"objects", required_argument, 0, 'N'},
+                                           {"size", required_argument, 0, 's'},
+                                           {"timeout", required_argument, 0, 't'},
+                                           {"help", no_argument, 0, '?'},
+                                           {0, 0, 0, 0}};
+
+    cfg.concurrency = 8;
+    cfg.duration = 5;
+    cfg.object_size = 1024;
+    while ((c = getopt_long(argc, argv, "x:o:c:d:n:r:kz:N:s:t:?", long_options,
+                            &option_index)) != -1) {
+        switch (c) {
+            case 'x':
+                if (!split_hostport__(optarg, &cfg.host, &cfg.port)) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                if (!split_hostport__(optarg, &cfg.origin_host, &cfg.origin_port)) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                cfg.concurrency = atoi(optarg);
+                break;
+            case 'd':
+                cfg.duration = atof(optarg);
+                break;
+            case 'n':
+                cfg.total = atol(optarg);
+                break;
+            case 'r':
+                cfg.rate = atof(optarg);
+                break;
+            case 'k':
+                cfg.keepalive = true;
+                break;
+            case 'z':
+                cfg.zipf = atof(optarg);
+                break;
+            case 'N':
+                n_objects = atol(optarg);
+                break;
+            case 's':
+                cfg.object_size = atol(optarg);
+                break;
+            case 't':
+                bench_timeout_ms = atoi(optarg);
+                break;
+            case '?':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (cfg.origin_host == NULL) {
+        if ((origin = origin_start("0", fixed_size__, &cfg.object_size)) == NULL) {
+            fprintf(stderr, "Failed to start the built-in origin\n");
+            exit(1);
+        }
+        cfg.origin_host = "localhost";
+        cfg.origin_port = origin->port;
+        if (n_objects == 0 && optind == argc) {
+            n_objects = 100;
+        }
+    }
+
+    if (n_objects > 0) {
+        cfg.n_paths = n_objects;
+        cfg.paths = malloc(sizeof(char*) * n_objects);
+        for (long i = 0; i < n_objects; i++) {
+            char path[64];
+            snprintf(path, sizeof(path), "/obj/%ld", i);
+            cfg.paths[i] = strdup(path);
+        }
+    } else {
+        cfg.n_paths = argc - optind;
+        cfg.paths = &argv[optind];
+    }
+
+    if (cfg.n_paths == 0 || cfg.concurrency <= 0) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    build_cdf__();
+    signal(SIGPIPE, SIG_IGN);
+
+    if (cfg.host != NULL) {
+        scraped = bench_scrape_cache(cfg.host, cfg.port, &hits0, &misses0);
+    }
+
+    worker_t* workers = calloc(cfg.concurrency, sizeof(worker_t));
+    start_us = bench_now_us();
+    stop_us = start_us + (uint64_t)(cfg.duration * 1e6);
+    for (int i = 0; i < cfg.concurrency; i++) {
+        workers[i].id = i;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&workers[i].tid, NULL, run_worker__, &workers[i]);
+    }
+
+    lat_vec_t all = {0};
+    uint64_t requests = 0, errors = 0, bytes = 0;
+    for (int i = 0; i < cfg.concurrency; i++) {
+        pthread_join(workers[i].tid, NULL);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        lat_merge(&all, &workers[i].lat);
+    }
+    double elapsed = (bench_now_us() - start_us) / 1e6;
+
+    if (cfg.host != NULL && scraped) {
+        scraped = bench_scrape_cache(cfg.host, cfg.port, &hits1, &misses1);
+    }
+
+    printf("mode           %s, %s\n", cfg.rate > 0 ? "open loop" : "closed loop",
+           cfg.keepalive ? "keep-alive" : "close");
+    printf("concurrency    %d\n", cfg.concurrency);
+    printf("requests       %lu\n", (unsigned long)requests);
+    printf("errors         %lu\n", (unsigned long)errors);
+    printf("elapsed        %.2f s\n", elapsed);
+    printf("throughput     %.1f req/s\n", requests / elapsed);
+    printf("transfer       %.2f MB/s\n", bytes / elapsed / 1e6);
+    bench_report_latency(stdout, &all);
+
+    if (scraped && hits1 + misses1 > hits0 + misses0) {
+        printf("hit ratio      %.3f\n",
+               (double)(hits1 - hits0) / (hits1 - hits0 + misses1 - misses0));
+    } else if (origin != NULL && requests > errors) {
+        uint64_t fetched = origin_requests(origin);
+        uint64_t served = requests - errors;
+        printf("hit ratio      %.3f (origin)\n",
+               fetched > served ? 0.0 : 1.0 - (double)fetched / served);
+    }
+    return errors > 0 && errors == requests;
+}
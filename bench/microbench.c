@@ -0,0 +1,318 @@
+/*
+ * microbench.c - ns/op and allocations/op for the proxy's hot primitives:
+ *     the cache list, string helpers, parse_url() and rio_readlineb().
+ *
+ *     usage: ./microbench [-t MS] [FILTER]
+ */
+#include <stdatomic.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+
+#include "cache.h"
+#include "csapp.h"
+#include "http.h"
+#include "string.h"
+
+typedef void (*bench_fn)(uint64_t iters, void* arg);
+
+typedef struct {
+    int entries;
+    size_t size;
+    cache* c;
+    char** urls;
+    char* content;
+} cache_arg_t;
+
+static _Atomic uint64_t alloc_count = 0;
+static _Atomic uint64_t alloc_bytes = 0;
+static double target_ms = 200;
+static volatile uintptr_t sink;
+
+// count every allocation by wrapping the glibc allocator
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+
+void* malloc(size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, n * size, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run(const char* filter, const char* name, bench_fn fn, void* arg) {
+    uint64_t iters = 1, elapsed = 0;
+
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    // grow the iteration count until one run takes long enough to time
+    while (true) {
+        uint64_t start = now_ns();
+        fn(iters, arg);
+        elapsed = now_ns() - start;
+        if (elapsed >= target_ms * 1e6 / 10 || iters >= (1ULL << 40)) {
+            break;
+        }
+        iters *= elapsed < target_ms * 1e6 / 1000 ? 10 : 2;
+    }
+    iters = iters * (target_ms * 1e6) / (elapsed ? elapsed : 1);
+    iters = iters ? iters : 1;
+
+    atomic_store(&alloc_count, 0);
+    atomic_store(&alloc_bytes, 0);
+    uint64_t start = now_ns();
+    fn(iters, arg);
+    elapsed = now_ns() - start;
+
+    printf("%-40s %12lu %12.1f %10.2f %12.1f\n", name, (unsigned long)iters,
+           (double)elapsed / iters, (double)atomic_load(&alloc_count) / iters,
+           (double)atomic_load(&alloc_bytes) / iters);
+}
+
+/* cache.c */
+
+static void fill_cache__(cache_arg_t* a) {
+    a->c = create_cache(MAX_CACHE_SIZE, MAX_OBJECT_SIZE);
+    for (int i = 0; i < a->entries; i++) {
+        add_tail(a->c, create_cacheline(a->urls[i], a->content, a->size));
+    }
+}
+
+static cache_arg_t* cache_arg__(int entries, size_t size) {
+    cache_arg_t* a = __libc_calloc(1, sizeof(cache_arg_t));
+    char url[MAXLINE];
+
+    a->entries = entries;
+    a->size = size;
+    a->urls = __libc_malloc(sizeof(char*) * (entries + 1));
+    for (int i = 0; i <= entries; i++) {
+        snprintf(url, sizeof(url), "http://localhost:8080/static/object-%d.html", i);
+        a->urls[i] = __libc_malloc(strlen(url) + 1);
+        strcpy(a->urls[i], url);
+    }
+    a->content = __libc_malloc(size + 1);
+    memset(a->content, 'x', size);
+    a->content[size] = '\0';
+    fill_cache__(a);
+    return a;
+}
+
+static void bench_find_hit(uint64_t iters, void* arg) {
+    cache_arg_t* a = arg;
+    for (uint64_t i = 0; i < iters; i++) {
+        sink = (uintptr_t)find(a->c, a->urls[i % a->entries]);
+    }
+}
+
+static void bench_find_miss(uint64_t iters, void* arg) {
+    cache_arg_t* a = arg;
+    for (uint64_t i = 0; i < iters; i++) {
+        sink = (uintptr_t)find(a->c, a->urls[a->entries]);
+    }
+}
+
+static void bench_add_head(uint64_t iters, void* arg) {
+    // the same urls go in again as new lines, each replacing the line of
+    // its url. shapes that start at the cache size also evict through
+    // kill_victim() on every insert
+    cache_arg_t* a = arg;
+    for (uint64_t i = 0; i < iters; i++) {
+        cacheline* line = create_cacheline(a->urls[i % a->entries], a->content, a->size);
+        if (!add_head(a->c, line)) {
+            release_cacheline(line);
+        }
+    }
+}
+
+static void bench_kill_victim(uint64_t iters, void* arg) {
+    // refill after every eviction to keep the list length constant
+    cache_arg_t* a = arg;
+    for (uint64_t i = 0; i < iters; i++) {
+        kill_victim(a->c);
+        cacheline* line = create_cacheline(a->urls[i % a->entries], a->content, a->size);
+        if (!add_tail(a->c, line)) {
+            release_cacheline(line);
+        }
+    }
+}
+
+/* string.c */
+
+static const char* header_line = "Accept-Language: en-US,en;q=0.9,ko;q=0.8\r\n";
+
+static void bench_fast_strstr(uint64_t iters, void* arg) {
+    for (uint64_t i = 0; i < iters; i++) {
+        sink = (uintptr_t)fast_strstr(header_line, arg);
+    }
+}
+
+static void bench_strstr(uint64_t iters, void* arg) {
+    for (uint64_t i = 0; i < iters; i++) {
+        sink = (uintptr_t)strstr(header_line, arg);
+    }
+}
+
+static void bench_strncasecmp(uint64_t iters, void* arg) {
+    size_t len = strlen(arg);
+    for (uint64_t i = 0; i < iters; i++) {
+        sink = strncasecmp(header_line, arg, len);
+    }
+}
+
+static void bench_strncatf(uint64_t iters, void* arg) {
+    char header[MAXLINE];
+    for (uint64_t i = 0; i < iters; i++) {
+        header[0] = '\0';
+        strncatf(header, sizeof(header), "Host: %s\r\n", "localhost:8080");
+        strncatf(header, sizeof(header), "Connection: close\r\n");
+        strncatf(header, sizeof(header), "Proxy-Connection: close\r\n");
+        strncatf(header, sizeof(header), "%s", header_line);
+        sink = (uintptr_t)header[0];
+    }
+}
+
+static void bench_snprintf_offset(uint64_t iters, void* arg) {
+    char header[MAXLINE];
+    for (uint64_t i = 0; i < iters; i++) {
+        size_t len = 0;
+        len += snprintf(header + len, sizeof(header) - len, "Host: %s\r\n", "localhost:8080");
+        len += snprintf(header + len, sizeof(header) - len, "Connection: close\r\n");
+        len += snprintf(header + len, sizeof(header) - len, "Proxy-Connection: close\r\n");
+        len += snprintf(header + len, sizeof(header) - len, "%s", header_line);
+        sink = len;
+    }
+}
+
+/* http.c */
+
+static void bench_parse_url(uint64_t iters, void* arg) {
+    URL url;
+    for (uint64_t i = 0; i < iters; i++) {
+        result_t r = parse_url(arg, &url);
+        sink = r.succ;
+    }
+}
+
+/* rio layer */
+
+typedef struct {
+    int fd;
+    size_t line_len;
+    uint64_t lines;
+} rio_arg_t;
+
+static void* rio_writer__(void* arg) {
+    rio_arg_t* a = arg;
+    char buf[RIO_BUFSIZE];
+    size_t per_buf = sizeof(buf) / a->line_len;
+    uint64_t left = a->lines;
+
+    for (size_t i = 0; i < per_buf; i++) {
+        memset(buf + i * a->line_len, 'h', a->line_len - 2);
+        memcpy(buf + (i + 1) * a->line_len - 2, "\r\n", 2);
+    }
+
+    while (left > 0) {
+        size_t n = left < per_buf ? left : per_buf;
+        if (rio_writen(a->fd, buf, n * a->line_len) < 0) {
+            break;
+        }
+        left -= n;
+    }
+    return NULL;
+}
+
+static void bench_rio_readlineb(uint64_t iters, void* arg) {
+    int sv[2];
+    pthread_t tid;
+    rio_t rio;
+    char line[MAXLINE];
+    rio_arg_t writer = {0, *(size_t*)arg, iters};
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    writer.fd = sv[1];
+    pthread_create(&tid, NULL, rio_writer__, &writer);
+
+    rio_readinitb(&rio, sv[0]);
+    for (uint64_t i = 0; i < iters; i++) {
+        if (rio_readlineb(&rio, line, sizeof(line)) <= 0) {
+            break;
+        }
+    }
+
+    pthread_join(tid, NULL);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(int argc, char** argv) {
+    const char* filter = NULL;
+    char name[128];
+    static size_t line_lens[] = {32, 128, 1024};
+    static const struct {
+        int entries;
+        size_t size;
+    } shapes[] = {{16, 16384}, {64, 16384}, {256, 1024}, {1024, 1024}, {4096, 128}};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            target_ms = atof(argv[++i]);
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    printf("%-40s %12s %12s %10s %12s\n", "benchmark", "iters", "ns/op", "allocs/op",
+           "bytes/op");
+
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        cache_arg_t* a = cache_arg__(shapes[i].entries, shapes[i].size);
+        snprintf(name, sizeof(name), "cache/find_hit/%d/%zu", a->entries, a->size);
+        run(filter, name, bench_find_hit, a);
+        snprintf(name, sizeof(name), "cache/find_miss/%d/%zu", a->entries, a->size);
+        run(filter, name, bench_find_miss, a);
+        snprintf(name, sizeof(name), "cache/add_head_evict/%d/%zu", a->entries, a->size);
+        run(filter, name, bench_add_head, a);
+        snprintf(name, sizeof(name), "cache/kill_victim+add_tail/%d/%zu", a->entries, a->size);
+        run(filter, name, bench_kill_victim, a);
+    }
+
+    run(filter, "string/fast_strstr/hit", bench_fast_strstr, "en;q=0.9");
+    run(filter, "string/fast_strstr/miss", bench_fast_strstr, "User-Agent");
+    run(filter, "string/strstr/hit", bench_strstr, "en;q=0.9");
+    run(filter, "string/strstr/miss", bench_strstr, "User-Agent");
+    run(filter, "string/strncasecmp/prefix", bench_strncasecmp, "user-agent:");
+    run(filter, "string/strncatf/4_headers", bench_strncatf, NULL);
+    run(filter, "string/snprintf_offset/4_headers", bench_snprintf_offset, NULL);
+
+    run(filter, "http/parse_url/absolute", bench_parse_url,
+        "http://www.cmu.edu:8080/hub/index.html");
+    run(filter, "http/parse_url/relative", bench_parse_url, "/hub/index.html");
+    run(filter, "http/parse_url/no_path", bench_parse_url, "http://localhost");
+
+    for (size_t i = 0; i < sizeof(line_lens) / sizeof(line_lens[0]); i++) {
+        snprintf(name, sizeof(name), "rio/readlineb/%zu", line_lens[i]);
+        run(filter, name, bench_rio_readlineb, &line_lens[i]);
+    }
+    return 0;
+}
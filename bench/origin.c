@@ -0,0 +1,139 @@
+#include "origin.h"
+
+#include <stdbool.h>
+#include <strings.h>
+
+#include "benchutil.h"
+#include "csapp.h"
+
+#define PATTERN_SIZE 65536
+
+typedef struct {
+    origin_t* origin;
+    int fd;
+} origin_conn_t;
+
+static char pattern[PATTERN_SIZE];
+
+static bool serve_one__(origin_t* origin, int fd, rio_t* rio) {
+    char line[MAXLINE], method[MAXLINE], path[MAXLINE], ver[16], header[MAXLINE];
+    bool keepalive;
+
+    if (rio_readlineb(rio, line, sizeof(line)) <= 0) {
+        return false;
+    }
+
+    // a version longer than ver is not one we answer anyway
+    if (sscanf(line, "%s %s %15s", method, path, ver) != 3) {
+        return false;
+    }
+    keepalive = strcmp(ver, "HTTP/1.1") == 0;
+
+    while (rio_readlineb(rio, line, sizeof(line)) > 0) {
+        if (strcmp(line, "\r\n") == 0) {
+            break;
+        }
+        if (strncasecmp(line, "Connection:", 11) == 0) {
+            keepalive = bench_has_token(line, "keep-alive");
+        }
+    }
+
+    // absolute-form requests still carry the scheme and host
+    char* rel = path;
+    if (strncmp(rel, "http://", 7) == 0 && (rel = strchr(rel + 7, '/')) == NULL) {
+        rel = "/";
+    }
+
+    size_t size = origin->size_of(rel, origin->arg);
+    snprintf(header, sizeof(header),
+             "%s 200 OK\r\nServer: bench-origin\r\nContent-Type: text/plain\r\n"
+             "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+             ver, size, keepalive ? "keep-alive" : "close");
+    if (rio_writen(fd, header, strlen(header)) < 0) {
+        return false;
+    }
+
+    if (strcmp(method, "HEAD") != 0) {
+        for (size_t left = size; left > 0;) {
+            size_t n = left < PATTERN_SIZE ? left : PATTERN_SIZE;
+            if (rio_writen(fd, pattern, n) < 0) {
+                return false;
+            }
+            left -= n;
+        }
+    }
+
+    atomic_fetch_add(&origin->requests, 1);
+    atomic_fetch_add(&origin->bytes, size);
+    return keepalive;
+}
+
+static void* serve_conn__(void* arg) {
+    origin_conn_t* conn = arg;
+    rio_t rio;
+
+    pthread_detach(pthread_self());
+    rio_readinitb(&rio, conn->fd);
+    while (serve_one__(conn->origin, conn->fd, &rio)) {
+    }
+
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
+
+static void* accept_loop__(void* arg) {
+    origin_t* origin = arg;
+    pthread_t tid;
+
+    while (true) {
+        int fd = accept(origin->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        origin_conn_t* conn = malloc(sizeof(origin_conn_t));
+        conn->origin = origin;
+        conn->fd = fd;
+        if (pthread_create(&tid, NULL, serve_conn__, conn) != 0) {
+            close(fd);
+            free(conn);
+        }
+    }
+    return NULL;
+}
+
+origin_t* origin_start(const char* port, origin_size_fn size_of, void* arg) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    pthread_t tid;
+
+    for (size_t i = 0; i < PATTERN_SIZE; i++) {
+        pattern[i] = 'a' + i % 26;
+    }
+
+    origin_t* origin = calloc(1, sizeof(origin_t));
+    origin->size_of = size_of;
+    origin->arg = arg;
+    if ((origin->listen_fd = open_listenfd((char*)port)) < 0) {
+        free(origin);
+        return NULL;
+    }
+
+    getsockname(origin->listen_fd, (SA*)&addr, &addr_len);
+    getnameinfo((SA*)&addr, addr_len, NULL, 0, origin->port, sizeof(origin->port),
+                NI_NUMERICSERV);
+
+    if (pthread_create(&tid, NULL, accept_loop__, origin) != 0) {
+        close(origin->listen_fd);
+        free(origin);
+        return NULL;
+    }
+    pthread_detach(tid);
+    return origin;
+}
+
+uint64_t origin_requests(origin_t* origin) { return atomic_load(&origin->requests); }
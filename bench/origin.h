@@ -0,0 +1,25 @@
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Returns the body size to synthesize for a request path.
+typedef size_t (*origin_size_fn)(const char* path, void* arg);
+
+// A fast stand-in origin server: one thread per connection, keep-alive
+// for HTTP/1.1 requests, bodies synthesized from a fixed pattern.
+typedef struct {
+    int listen_fd;
+    char port[16];
+    origin_size_fn size_of;
+    void* arg;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t bytes;
+} origin_t;
+
+origin_t* origin_start(const char* port, origin_size_fn size_of, void* arg);
+uint64_t origin_requests(origin_t* origin);
+
+#endif
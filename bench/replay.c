@@ -0,0 +1,500 @@
+/*
+ * replay.c - replays a JSONL request trace through the proxy.
+ *
+ * Each trace line is a JSON object:
+ *
+ *   {"timestamp": 1697712000.125, "method": "GET",
+ *    "url": "http://example.com/a.js", "headers": {"Accept": "text/html"},
+ *    "response_size": 5120}
+ *
+ * timestamp is in seconds (any epoch), headers is optional. URLs are
+ * rewritten to http://localhost:<origin>/<host>/<path> and served by a
+ * built-in stand-in origin that returns response_size bytes for them, so
+ * cache keys keep the shape of the original traffic.
+ */
+#include <getopt.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <time.h>
+
+#include "benchutil.h"
+#include "origin.h"
+
+typedef struct {
+    double timestamp;
+    char method[16];
+    char* path;
+    char* headers;
+    size_t size;
+} record_t;
+
+typedef struct {
+    char* path;
+    size_t size;
+} size_entry_t;
+
+typedef struct {
+    int id;
+    lat_vec_t lat;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    pthread_t tid;
+} worker_t;
+
+static record_t* records;
+static size_t n_records;
+static size_entry_t* sizes;
+static size_t n_sizes;
+static char* proxy_host;
+static char* proxy_port;
+static origin_t* origin;
+static double speed = 1.0;
+static _Atomic size_t next_record = 0;
+static uint64_t start_us;
+
+void print_usage(char* program) {
+    fprintf(stderr, "Usage: %s -x HOST:PORT [OPTIONS] <TRACE.jsonl>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -x, --proxy=HOST:PORT     Proxy to replay against\n");
+    fprintf(stderr, "  -s, --speed=FACTOR        Replay speed, 0 = as fast as possible "
+                    "(default: 1)\n");
+    fprintf(stderr, "  -c, --concurrency=N       Concurrent connections (default: 32)\n");
+    fprintf(stderr, "  -t, --timeout=MS          Per request timeout (default: 5000)\n");
+    fprintf(stderr, "  -?, --help                Show this help message\n");
+}
+
+/* a minimal JSON reader for flat trace records */
+
+static const char* skip_ws__(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+static const char* parse_string__(const char* p, char* out, size_t max) {
+    size_t n = 0;
+
+    if (*p != '"') {
+        return NULL;
+    }
+
+    for (p++; *p != '"'; p++) {
+        char c = *p;
+        if (c == '\0') {
+            return NULL;
+        }
+
+        if (c == '\\') {
+            switch (*++p) {
+                case 'n':
+                    c = '\n';
+                    break;
+                case 't':
+                    c = '\t';
+                    break;
+                case 'r':
+                    c = '\r';
+                    break;
+                case 'u':
+                    // non ASCII code points are not needed for URLs and headers
+                    c = '?';
+                    for (int i = 0; i < 4 && p[1] != '\0'; i++) {
+                        p++;
+                    }
+                    break;
+                case '\0':
+                    return NULL;
+                default:
+                    c = *p;
+                    break;
+            }
+        }
+
+        if (n + 1 < max) {
+            out[n++] = c;
+        }
+    }
+
+    out[n] = '\0';
+    return p + 1;
+}
+
+static const char* skip_value__(const char* p) {
+    char tmp[MAXLINE];
+    int depth = 0;
+
+    if (*p == '"') {
+        return parse_string__(p, tmp, sizeof(tmp));
+    }
+
+    for (; *p != '\0'; p++) {
+        if (*p == '"') {
+            if ((p = parse_string__(p, tmp, sizeof(tmp))) == NULL) {
+                return NULL;
+            }
+            p--;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (depth == 0) {
+                return p;
+            }
+            if (--depth == 0) {
+                return p + 1;
+            }
+        } else if (*p == ',' && depth == 0) {
+            return p;
+        }
+    }
+    return p;
+}
+
+static const char* parse_headers__(const char* p, char* out, size_t max) {
+    char key[MAXLINE], value[MAXLINE];
+    size_t len = 0;
+
+    out[0] = '\0';
+    p = skip_ws__(p);
+    if (*p != '{') {
+        return skip_value__(p);
+    }
+
+    for (p = skip_ws__(p + 1); *p != '}'; p = skip_ws__(p)) {
+        if ((p = parse_string__(p, key, sizeof(key))) == NULL) {
+            return NULL;
+        }
+        p = skip_ws__(p);
+        if (*p++ != ':') {
+            return NULL;
+        }
+        p = skip_ws__(p);
+        if ((p = parse_string__(p, value, sizeof(value))) == NULL) {
+            return NULL;
+        }
+
+        // the replay sets its own hop-by-hop and routing headers
+        if (strcasecmp(key, "Host") != 0 && strcasecmp(key, "Connection") != 0 &&
+            strcasecmp(key, "Proxy-Connection") != 0 && strcasecmp(key, "Content-Length") != 0) {
+            int n = snprintf(out + len, max - len, "%s: %s\r\n", key, value);
+            if (n > 0 && len + n < max) {
+                len += n;
+            }
+        }
+
+        p = skip_ws__(p);
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return p + 1;
+}
+
+static bool parse_record__(const char* line, record_t* r) {
+    char key[64], url[MAXLINE], headers[MAXLINE];
+    const char* p = skip_ws__(line);
+    bool has_url = false;
+
+    memset(r, 0x00, sizeof(*r));
+    strcpy(r->method, "GET");
+    headers[0] = '\0';
+
+    if (*p != '{') {
+        return false;
+    }
+
+    for (p = skip_ws__(p + 1); *p != '}' && *p != '\0'; p = skip_ws__(p)) {
+        if ((p = parse_string__(p, key, sizeof(key))) == NULL) {
+            return false;
+        }
+        p = skip_ws__(p);
+        if (*p++ != ':') {
+            return false;
+        }
+        p = skip_ws__(p);
+
+        if (strcmp(key, "timestamp") == 0 || strcmp(key, "ts") == 0) {
+            r->timestamp = strtod(p, (char**)&p);
+        } else if (strcmp(key, "response_size") == 0 || strcmp(key, "size") == 0) {
+            r->size = strtoull(p, (char**)&p, 10);
+        } else if (strcmp(key, "method") == 0) {
+            p = parse_string__(p, r->method, sizeof(r->method));
+        } else if (strcmp(key, "url") == 0) {
+            p = parse_string__(p, url, sizeof(url));
+            has_url = p != NULL;
+        } else if (strcmp(key, "headers") == 0) {
+            p = parse_headers__(p, headers, sizeof(headers));
+        } else {
+            p = skip_value__(p);
+        }
+
+        if (p == NULL) {
+            return false;
+        }
+        p = skip_ws__(p);
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    if (!has_url) {
+        return false;
+    }
+
+    // http://host:port/path?query -> /host:port/path?query
+    const char* rest = strstr(url, "://");
+    rest = rest != NULL ? rest + 3 : url;
+    while (*rest == '/') {
+        rest++;
+    }
+    r->path = malloc(strlen(rest) + 2);
+    sprintf(r->path, "/%s", rest);
+    r->headers = strdup(headers);
+    return true;
+}
+
+/* path -> response size, looked up by the stand-in origin */
+
+static uint64_t hash__(const char* s) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*s != '\0') {
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_entry_t* size_slot__(const char* path) {
+    size_t mask = n_sizes - 1;
+    for (size_t i = hash__(path) & mask;; i = (i + 1) & mask) {
+        if (sizes[i].path == NULL || strcmp(sizes[i].path, path) == 0) {
+            return &sizes[i];
+        }
+    }
+}
+
+static size_t lookup_size__(const char* path, void* arg) {
+    size_entry_t* e = size_slot__(path);
+    return e->path != NULL ? e->size : 0;
+}
+
+static void build_sizes__(void) {
+    n_sizes = 16;
+    while (n_sizes < n_records * 2) {
+        n_sizes <<= 1;
+    }
+    sizes = calloc(n_sizes, sizeof(size_entry_t));
+
+    for (size_t i = 0; i < n_records; i++) {
+        size_entry_t* e = size_slot__(records[i].path);
+        e->path = records[i].path;
+        // the most recent size wins, as after an origin update
+        e->size = records[i].size;
+    }
+}
+
+static void load_trace__(const char* file) {
+    FILE* fp = fopen(file, "r");
+    char* line = NULL;
+    size_t cap = 0, capacity = 0, bad = 0;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s\n", file);
+        exit(1);
+    }
+
+    while (getline(&line, &cap, fp) > 0) {
+        if (skip_ws__(line)[0] == '\0') {
+            continue;
+        }
+
+        if (n_records == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            records = realloc(records, capacity * sizeof(record_t));
+        }
+
+        if (parse_record__(line, &records[n_records])) {
+            n_records++;
+        } else {
+            bad++;
+        }
+    }
+
+    if (bad > 0) {
+        fprintf(stderr, "Skipped %zu malformed trace lines\n", bad);
+    }
+    free(line);
+    fclose(fp);
+}
+
+static void* run_worker__(void* arg) {
+    worker_t* w = arg;
+    bench_conn_t conn;
+    bench_response_t resp;
+    char req[MAXLINE * 2];
+    size_t i;
+
+    bench_conn_init(&conn);
+    while ((i = atomic_fetch_add(&next_record, 1)) < n_records) {
+        record_t* r = &records[i];
+        uint64_t begin = bench_now_us();
+
+        if (speed > 0) {
+            begin = start_us + (uint64_t)((r->timestamp - records[0].timestamp) * 1e6 / speed);
+            uint64_t now = bench_now_us();
+            if (begin > now) {
+                struct timespec ts = {(begin - now) / 1000000, ((begin - now) % 1000000) * 1000};
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        int len = snprintf(req, sizeof(req),
+                           "%s http://localhost:%s%s HTTP/1.1\r\nHost: localhost:%s\r\n%s"
+                           "Proxy-Connection: keep-alive\r\n%s\r\n",
+                           r->method, origin->port, r->path, origin->port, r->headers,
+                           strcmp(r->method, "POST") == 0 || strcmp(r->method, "PUT") == 0
+                               ? "Content-Length: 0\r\n"
+                               : "");
+
+        bool ok = bench_fetch(&conn, proxy_host, proxy_port, req, len, &resp);
+        w->requests++;
+        w->bytes += resp.bytes;
+        if (!ok || resp.status >= 500 || resp.status == 0) {
+            w->errors++;
+            continue;
+        }
+        lat_push(&w->lat, bench_now_us() - begin);
+    }
+
+    bench_close(&conn);
+    return NULL;
+}
+
+static int cmp_timestamp__(const void* a, const void* b) {
+    double x = ((const record_t*)a)->timestamp, y = ((const record_t*)b)->timestamp;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv) {
+    int c, option_index = 0, concurrency = 32;
+    uint64_t hits0 = 0, misses0 = 0, hits1 = 0, misses1 = 0;
+    uint64_t trace_bytes = 0;
+
+    static struct option long_options[] = {{"proxy", required_argument, 0, 'x'},
+                                           {"speed", required_argument, 0, 's'},
+                                           {"concurrency", required_argument, 0, 'c'},
+                                           {"timeout", required_argument, 0, 't'},
+                                           {"help", no_argument, 0, '?'},
+                                           {0, 0, 0, 0}};
+
+    while ((c = getopt_long(argc, argv, "x:s:c:t:?", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'x': {
+                char* pos = strrchr(optarg, ':');
+                if (pos == NULL) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                *pos = '\0';
+                proxy_host = optarg;
+                proxy_port = pos + 1;
+                break;
+            }
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 't':
+                bench_timeout_ms = atoi(optarg);
+                break;
+            case '?':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (proxy_host == NULL || optind >= argc || concurrency <= 0) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    load_trace__(argv[optind]);
+    if (n_records == 0) {
+        fprintf(stderr, "No records in %s\n", argv[optind]);
+        exit(1);
+    }
+    qsort(records, n_records, sizeof(record_t), cmp_timestamp__);
+    build_sizes__();
+    for (size_t i = 0; i < n_records; i++) {
+        trace_bytes += records[i].size;
+    }
+
+    if ((origin = origin_start("0", lookup_size__, NULL)) == NULL) {
+        fprintf(stderr, "Failed to start the stand-in origin\n");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    bool scraped = bench_scrape_cache(proxy_host, proxy_port, &hits0, &misses0);
+
+    worker_t* workers = calloc(concurrency, sizeof(worker_t));
+    start_us = bench_now_us();
+    for (int i = 0; i < concurrency; i++) {
+        workers[i].id = i;
+        pthread_create(&workers[i].tid, NULL, run_worker__, &workers[i]);
+    }
+
+    lat_vec_t all = {0};
+    uint64_t requests = 0, errors = 0, bytes = 0;
+    for (int i = 0; i < concurrency; i++) {
+        pthread_join(workers[i].tid, NULL);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        lat_merge(&all, &workers[i].lat);
+    }
+    double elapsed = (bench_now_us() - start_us) / 1e6;
+    double span = records[n_records - 1].timestamp - records[0].timestamp;
+
+    if (scraped) {
+        scraped = bench_scrape_cache(proxy_host, proxy_port, &hits1, &misses1);
+    }
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < n_sizes; i++) {
+        distinct += sizes[i].path != NULL;
+    }
+
+    printf("records        %zu (%zu distinct URLs, %.1f s of traffic)\n", n_records, distinct,
+           span);
+    if (speed > 0) {
+        printf("speed          %.2fx\n", speed);
+    } else {
+        printf("speed          as fast as possible\n");
+    }
+    printf("requests       %lu\n", (unsigned long)requests);
+    printf("errors         %lu\n", (unsigned long)errors);
+    printf("elapsed        %.2f s\n", elapsed);
+    printf("throughput     %.1f req/s\n", requests / elapsed);
+    printf("transfer       %.2f MB/s\n", bytes / elapsed / 1e6);
+    bench_report_latency(stdout, &all);
+
+    uint64_t fetched = origin_requests(origin);
+    uint64_t fetched_bytes = atomic_load(&origin->bytes);
+    if (scraped && hits1 + misses1 > hits0 + misses0) {
+        printf("hit ratio      %.3f\n",
+               (double)(hits1 - hits0) / (hits1 - hits0 + misses1 - misses0));
+    } else if (requests > errors) {
+        printf("hit ratio      %.3f (origin)\n",
+               fetched > requests - errors ? 0.0 : 1.0 - (double)fetched / (requests - errors));
+    }
+    if (trace_bytes > 0) {
+        printf("byte hit ratio %.3f (origin)\n",
+               fetched_bytes > trace_bytes ? 0.0 : 1.0 - (double)fetched_bytes / trace_bytes);
+    }
+    return errors > 0 && errors == requests;
+}
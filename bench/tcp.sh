@@ -0,0 +1,53 @@
+#!/bin/bash
+#
+# tcp.sh - small object latency through loopback under each TCP profile
+#     of the proxy (-t). Keep-alive clients fetch 1 KB objects from the
+#     built-in origin, once as cache hits and once with caching off, where
+#     every request also goes to the origin.
+#
+#     usage: ./tcp.sh [DURATION]
+#
+#     PROFILES overrides the profiles compared, separated by spaces.
+#
+
+DURATION=${1:-3}
+HOME_DIR=`cd $(dirname $0)/.. && pwd`
+LOADGEN=${HOME_DIR}/bench/loadgen
+PROFILES=${PROFILES:-"none nodelay nodelay,quickack nodelay,quickack,cork"}
+
+function wait_for_port {
+    for i in `seq 50`; do
+        (echo > /dev/tcp/localhost/$1) 2> /dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing is listening on port $1"
+    exit 1
+}
+
+function cleanup {
+    kill ${proxy_pid} 2> /dev/null
+    wait 2> /dev/null
+}
+trap cleanup EXIT
+
+function run {
+    local profile=$1 object_size=$2
+
+    proxy_port=`${HOME_DIR}/free-port.sh`
+    ${HOME_DIR}/proxy ${proxy_port} -t ${profile} -o ${object_size} > /dev/null 2>&1 &
+    proxy_pid=$!
+    wait_for_port ${proxy_port}
+    ${LOADGEN} -x localhost:${proxy_port} -c 8 -d ${DURATION} -N 200 -s 1024 -k |
+        grep -E "throughput|p50|p99 "
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+}
+
+for profile in ${PROFILES}; do
+    echo "*** ${profile}, cache hits ***"
+    run ${profile} 100K
+    echo ""
+    echo "*** ${profile}, origin on every request ***"
+    run ${profile} 0
+    echo ""
+done
@@ -1,27 +1,40 @@
 #include "cache.h"
 
-cacheline* create_cacheline(const char* url, const char* content) {
+_Thread_local unsigned int cache_local_node;
+
+cacheline* create_cacheline(const char* url, const char* content, size_t size) {
     cacheline* c = (cacheline*)calloc(1, sizeof(cacheline));
     size_t url_len = strlen(url);
-    size_t content_len = strlen(content);
-    c->url = (char*)calloc(1, url_len);
-    c->content = (char*)calloc(1, content_len);
+    c->url = (char*)calloc(1, url_len + 1);
+    c->content = (char*)malloc(size + 1);
     c->last_request = time(NULL);
-    c->size = content_len;
+    c->size = size;
+    c->refcnt = 1;
+    c->hash = cache_hash(url);
     c->prev = NULL;
     c->next = NULL;
+    c->chain = NULL;
+
+    memcpy(c->url, url, url_len);
+    memcpy(c->content, content, size);
+    c->content[size] = '\0';
 
-    strncpy(c->url, url, url_len);
-    strncpy(c->content, content, content_len);
-    
     return c;
 }
 
-cache* create_cache() {
+cache* create_cache(size_t max_size, size_t max_object_size) {
     cache* new_cache = (cache*)malloc(sizeof(cache));
     new_cache->head = NULL;
     new_cache->tail = NULL;
+    new_cache->index = (cacheline**)calloc(CACHE_INDEX_MIN, sizeof(cacheline*));
+    new_cache->index_size = CACHE_INDEX_MIN;
     new_cache->total_size = 0;
+    new_cache->len = 0;
+    new_cache->evictions = 0;
+    new_cache->max_size = max_size;
+    new_cache->max_object_size = max_object_size;
+    new_cache->on_evict = NULL;
+    new_cache->evict_arg = NULL;
     return new_cache;
 }
 
@@ -30,35 +43,120 @@ void free_cache(cache* c) {
     while (cl != NULL) {
         cacheline* temp = cl;
         cl = cl->next;
-        free_cacheline(temp);
+        release_cacheline(temp);
     }
+    free(c->index);
+    free(c);
 }
 
 void free_cacheline(cacheline* c) {
     free(c->url);
     free(c->content);
+    free(c);
 }
 
-cacheline* find(cache* c, const char* url) {
-    cacheline* current = c->head;
-    while (current != NULL) {
-        if (strcmp(current->url, url) == 0) {
-            return current;
+// drops one reference; the line is freed once neither the cache nor any
+// reader holds it
+void release_cacheline(cacheline* c) {
+    if (atomic_fetch_sub(&c->refcnt, 1) == 1) {
+        free_cacheline(c);
+    }
+}
+
+// the shard was picked with the low bits of the hash, the bucket takes the
+// high ones
+static cacheline** bucket__(cache* c, uint64_t hash) {
+    return &c->index[(hash >> 32) & (c->index_size - 1)];
+}
+
+static void index_add__(cache* c, cacheline* line) {
+    if (c->len >= c->index_size) {
+        size_t old_size = c->index_size;
+        cacheline** old = c->index;
+
+        c->index_size *= 2;
+        c->index = (cacheline**)calloc(c->index_size, sizeof(cacheline*));
+        for (size_t i = 0; i < old_size; i++) {
+            for (cacheline *cl = old[i], *next; cl != NULL; cl = next) {
+                cacheline** b = bucket__(c, cl->hash);
+                next = cl->chain;
+                cl->chain = *b;
+                *b = cl;
+            }
         }
-        current = current->next;
+        free(old);
+    }
+    cacheline** b = bucket__(c, line->hash);
+    line->chain = *b;
+    *b = line;
+}
+
+static void index_remove__(cache* c, cacheline* line) {
+    for (cacheline** pos = bucket__(c, line->hash); *pos != NULL; pos = &(*pos)->chain) {
+        if (*pos == line) {
+            *pos = line->chain;
+            line->chain = NULL;
+            return;
+        }
+    }
+}
+
+// takes the line out of the list and the index, the caller still holds the
+// cache's reference
+static void unlink__(cache* c, cacheline* cl) {
+    if (cl->prev != NULL) {
+        cl->prev->next = cl->next;
+    } else {
+        c->head = cl->next;
+    }
+    if (cl->next != NULL) {
+        cl->next->prev = cl->prev;
+    } else {
+        c->tail = cl->prev;
     }
+    cl->prev = cl->next = NULL;
+    index_remove__(c, cl);
+    c->total_size -= cl->size;
+    c->len -= 1;
+}
 
+cacheline* find(cache* c, const char* url) {
+    uint64_t hash = cache_hash(url);
+
+    for (cacheline* cl = *bucket__(c, hash); cl != NULL; cl = cl->chain) {
+        if (cl->hash == hash && strcmp(cl->url, url) == 0) {
+            return cl;
+        }
+    }
     return NULL;
 }
 
-void add_head(cache* c, cacheline* new_line) {
-    if (new_line->size > MAX_OBJECT_SIZE) {
-        return;
+// a line for the same url is replaced, its readers keep their copy. it goes
+// even when the new one does not fit, being the older response
+static bool make_room__(cache* c, cacheline* new_line) {
+    cacheline* old = find(c, new_line->url);
+    size_t size = new_line->size;
+
+    if (old != NULL) {
+        unlink__(c, old);
+        release_cacheline(old);
+    }
+    if (size > c->max_object_size || size > c->max_size) {
+        return false;
     }
 
-    while (c->total_size + new_line->size > MAX_CACHE_SIZE) {
+    // a large object may need many small victims, it always fits once the
+    // cache is empty
+    while (c->total_size + size > c->max_size && c->len > 0) {
         kill_victim(c);
     }
+    return true;
+}
+
+bool add_head(cache* c, cacheline* new_line) {
+    if (!make_room__(c, new_line)) {
+        return false;
+    }
 
     if (c->head == NULL) {
         c->head = new_line;
@@ -68,17 +166,15 @@ void add_head(cache* c, cacheline* new_line) {
         c->head->prev = new_line;
         c->head = new_line;
     }
+    index_add__(c, new_line);
     c->total_size += new_line->size;
     c->len += 1;
+    return true;
 }
 
-void add_tail(cache* c, cacheline* new_line) {
-    if (new_line->size > MAX_OBJECT_SIZE) {
-        return;
-    }
-
-    while (c->total_size + new_line->size > MAX_CACHE_SIZE) {
-        kill_victim(c);
+bool add_tail(cache* c, cacheline* new_line) {
+    if (!make_room__(c, new_line)) {
+        return false;
     }
 
     if (c->tail == NULL) {
@@ -89,47 +185,35 @@ void add_tail(cache* c, cacheline* new_line) {
         c->tail->next = new_line;
         c->tail = new_line;
     }
+    index_add__(c, new_line);
     c->total_size += new_line->size;
     c->len += 1;
+    return true;
 }
 
 void delete_head(cache* c) {
     if (c->head != NULL) {
         cacheline* temp = c->head;
-        c->head = c->head->next;
-        if (c->head != NULL) {
-            c->head->prev = NULL;
-        } else {
-            c->tail = NULL;
-        }
-        c->total_size -= temp->size;
-        c->len -= 1;
-        free_cacheline(temp);
+        unlink__(c, temp);
+        release_cacheline(temp);
     }
 }
 
 void delete_tail(cache* c) {
     if (c->tail != NULL) {
         cacheline* temp = c->tail;
-        c->tail = c->tail->prev;
-        if (c->tail != NULL) {
-            c->tail->next = NULL;
-        } else {
-            c->head = NULL;
-        }
-        c->total_size -= temp->size;
-        c->len -= 1;
-        free_cacheline(temp);
+        unlink__(c, temp);
+        release_cacheline(temp);
     }
 }
 
 void kill_victim(cache* c) {
-    srand(time(NULL));
-    int idx = rand() % c->len;
-
     if (c->len == 0) {
         return;
-    } 
+    }
+
+    srand(time(NULL));
+    int idx = rand() % c->len;
 
     cacheline* cl = c->head;
     for (size_t i = 0; i < idx; i++) {
@@ -138,19 +222,184 @@ void kill_victim(cache* c) {
         }
     }
 
-    if (cl->prev != NULL) {
-        cl->prev->next = cl->next;
-    } else {
-        c->head = cl->next;
+    unlink__(c, cl);
+    c->evictions += 1;
+    if (c->on_evict != NULL) {
+        c->on_evict(cl, c->evict_arg);
     }
+    release_cacheline(cl);
+}
 
-    if (cl->next != NULL) {
-        cl->next->prev = cl->prev;
-    } else {
-        c->tail = cl->prev;
+// evicts at most max_victims lines while the cache is over its budget,
+// returns the number of lines evicted
+size_t trim_cache(cache* c, size_t max_victims) {
+    size_t n = 0;
+    while (n < max_victims && c->len > 0 && c->total_size > c->max_size) {
+        kill_victim(c);
+        n++;
+    }
+    return n;
+}
+
+sharded_cache* create_sharded_cache(size_t n_shards, size_t shard_size, size_t max_object_size) {
+    sharded_cache* sc = (sharded_cache*)malloc(sizeof(sharded_cache));
+    sc->n_shards = n_shards;
+    sc->n_nodes = 1;
+    sc->max_object_size = max_object_size;
+    sc->shards = (cache_shard*)calloc(n_shards, sizeof(cache_shard));
+    for (size_t i = 0; i < n_shards; i++) {
+        sc->shards[i].c = create_cache(shard_size, max_object_size);
+        pthread_mutex_init(&sc->shards[i].mutex, NULL);
     }
+    return sc;
+}
 
-    c->total_size -= cl->size;
-    c->len -= 1;
-    free_cacheline(cl);
-}
\ No newline at end of file
+// n_shards has to be a multiple of n_nodes
+void cache_split_nodes(sharded_cache* sc, size_t n_nodes) {
+    sc->n_nodes = n_nodes;
+}
+
+// builds the (still empty) shards of node anew from the calling thread, which
+// runs there, so their state is in that node's memory
+void cache_localize(sharded_cache* sc, unsigned int node) {
+    size_t per = sc->n_shards / sc->n_nodes;
+
+    for (size_t i = node * per; i < (node + 1) * per; i++) {
+        cache_shard* shard = &sc->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        cache* c = create_cache(shard->c->max_size, shard->c->max_object_size);
+        c->on_evict = shard->c->on_evict;
+        c->evict_arg = shard->c->evict_arg;
+        free_cache(shard->c);
+        shard->c = c;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void free_sharded_cache(sharded_cache* sc) {
+    for (size_t i = 0; i < sc->n_shards; i++) {
+        free_cache(sc->shards[i].c);
+        pthread_mutex_destroy(&sc->shards[i].mutex);
+    }
+    free(sc->shards);
+    free(sc);
+}
+
+void cache_set_evict_hook(sharded_cache* sc, void (*on_evict)(cacheline*, void*), void* arg) {
+    for (size_t i = 0; i < sc->n_shards; i++) {
+        pthread_mutex_lock(&sc->shards[i].mutex);
+        sc->shards[i].c->on_evict = on_evict;
+        sc->shards[i].c->evict_arg = arg;
+        pthread_mutex_unlock(&sc->shards[i].mutex);
+    }
+}
+
+// FNV-1a
+uint64_t cache_hash(const char* url) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*url != '\0') {
+        h = (h ^ (unsigned char)*url++) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static cache_shard* shard_on__(sharded_cache* sc, const char* url, size_t node) {
+    size_t per = sc->n_shards / sc->n_nodes;
+    return &sc->shards[node * per + cache_hash(url) % per];
+}
+
+cache_shard* cache_shard_of(sharded_cache* sc, const char* url) {
+    return shard_on__(sc, url, cache_local_node % sc->n_nodes);
+}
+
+static cacheline* lookup__(cache_shard* shard, const char* url) {
+    pthread_mutex_lock(&shard->mutex);
+    cacheline* found = find(shard->c, url);
+    if (found != NULL) {
+        atomic_fetch_add(&found->refcnt, 1);
+        found->last_request = time(NULL);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return found;
+}
+
+// returns a referenced line that stays valid until release_cacheline(),
+// even if it is evicted in the meantime. the node's own shards are tried
+// first; a line found on another node is served from there, a copy would
+// take room from the local shards for every object read on both nodes
+cacheline* cache_get(sharded_cache* sc, const char* url) {
+    size_t local = cache_local_node % sc->n_nodes;
+    cacheline* found = lookup__(shard_on__(sc, url, local), url);
+
+    for (size_t node = 0; found == NULL && node < sc->n_nodes; node++) {
+        if (node != local) {
+            found = lookup__(shard_on__(sc, url, node), url);
+        }
+    }
+    return found;
+}
+
+bool cache_put(sharded_cache* sc, const char* url, const char* content, size_t size) {
+    cache_shard* shard = cache_shard_of(sc, url);
+    cacheline* line = create_cacheline(url, content, size);
+
+    pthread_mutex_lock(&shard->mutex);
+    bool added = add_head(shard->c, line);
+    trim_cache(shard->c, CACHE_TRIM_BATCH);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (!added) {
+        release_cacheline(line);
+    }
+    return added;
+}
+
+// takes effect immediately for new inserts. a shrink is applied a batch at a
+// time by trims, and by inserts, which evict until they fit
+void cache_resize(sharded_cache* sc, size_t shard_size, size_t max_object_size) {
+    sc->max_object_size = max_object_size;
+    for (size_t i = 0; i < sc->n_shards; i++) {
+        cache_shard* shard = &sc->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        shard->c->max_size = shard_size;
+        shard->c->max_object_size = max_object_size;
+        trim_cache(shard->c, CACHE_TRIM_BATCH);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void cache_get_stats(sharded_cache* sc, cache_stats* stats) {
+    memset(stats, 0x00, sizeof(*stats));
+    for (size_t i = 0; i < sc->n_shards; i++) {
+        cache_shard* shard = &sc->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->total_size += shard->c->total_size;
+        stats->len += shard->c->len;
+        stats->evictions += shard->c->evictions;
+        stats->max_size += shard->c->max_size;
+        stats->max_object_size = shard->c->max_object_size;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+// returns every line in the cache with a reference held, so the caller can
+// walk them without any shard lock. release each line and free the array
+size_t cache_collect(sharded_cache* sc, cacheline*** lines) {
+    size_t n = 0, cap = 0;
+    *lines = NULL;
+
+    for (size_t i = 0; i < sc->n_shards; i++) {
+        cache_shard* shard = &sc->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        if (n + shard->c->len > cap) {
+            cap = n + shard->c->len;
+            *lines = realloc(*lines, sizeof(cacheline*) * cap);
+        }
+        for (cacheline* cl = shard->c->head; cl != NULL; cl = cl->next) {
+            atomic_fetch_add(&cl->refcnt, 1);
+            (*lines)[n++] = cl;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return n;
+}
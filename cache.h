@@ -1,35 +1,100 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <time.h>
 
 #include "csapp.h"
 
-/* Recommended max cache and object sizes */
+/* Recommended max cache and object sizes, used as defaults */
 #define MAX_CACHE_SIZE  1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Max victims evicted by one trim, so shrinking is gradual */
+#define CACHE_TRIM_BATCH 8
+
+/* Buckets of a new cache's url index, doubled whenever it gets full */
+#define CACHE_INDEX_MIN 64
+
 typedef struct cache_line {
     char* url;
     char* content;
     time_t last_request;
     size_t size;
+    _Atomic int refcnt;
+    uint64_t hash;
     struct cache_line* prev;
     struct cache_line* next;
+    // the next line in the same bucket of the url index
+    struct cache_line* chain;
 } cacheline;
 
 typedef struct {
     cacheline* head;
     cacheline* tail;
+    // every line by url, there is at most one line per url
+    cacheline** index;
+    size_t index_size;
     size_t total_size;
     size_t len;
+    size_t evictions;
+    size_t max_size;
+    size_t max_object_size;
+    // called by kill_victim() while the line is still referenced
+    void (*on_evict)(cacheline* line, void* arg);
+    void* evict_arg;
 } cache;
 
-cacheline* create_cacheline(const char* url, const char* content);
-cache* create_cache();
+typedef struct {
+    cache* c;
+    pthread_mutex_t mutex;
+} cache_shard;
+
+// with more than one node the shards are split between them evenly, each
+// thread stores into the shards of its own node
+typedef struct {
+    cache_shard* shards;
+    size_t n_shards;
+    size_t n_nodes;
+    _Atomic size_t max_object_size;
+} sharded_cache;
+
+typedef struct {
+    size_t total_size;
+    size_t len;
+    size_t evictions;
+    size_t max_size;
+    size_t max_object_size;
+} cache_stats;
+
+cacheline* create_cacheline(const char* url, const char* content, size_t size);
+cache* create_cache(size_t max_size, size_t max_object_size);
 void free_cache(cache* c);
 void free_cacheline(cacheline* c);
+void release_cacheline(cacheline* c);
 cacheline* find(cache* c, const char* url);
-void add_head(cache* c, cacheline* new_line);
-void add_tail(cache* c, cacheline* new_line);
+bool add_head(cache* c, cacheline* new_line);
+bool add_tail(cache* c, cacheline* new_line);
 void delete_head(cache* c);
 void delete_tail(cache* c);
-void kill_victim(cache* c);
\ No newline at end of file
+void kill_victim(cache* c);
+size_t trim_cache(cache* c, size_t max_victims);
+
+// the NUMA node the calling thread runs on, 0 unless it was pinned
+extern _Thread_local unsigned int cache_local_node;
+
+sharded_cache* create_sharded_cache(size_t n_shards, size_t shard_size, size_t max_object_size);
+void cache_split_nodes(sharded_cache* sc, size_t n_nodes);
+void cache_localize(sharded_cache* sc, unsigned int node);
+void free_sharded_cache(sharded_cache* sc);
+void cache_set_evict_hook(sharded_cache* sc, void (*on_evict)(cacheline*, void*), void* arg);
+uint64_t cache_hash(const char* url);
+cache_shard* cache_shard_of(sharded_cache* sc, const char* url);
+cacheline* cache_get(sharded_cache* sc, const char* url);
+bool cache_put(sharded_cache* sc, const char* url, const char* content, size_t size);
+void cache_resize(sharded_cache* sc, size_t shard_size, size_t max_object_size);
+void cache_get_stats(sharded_cache* sc, cache_stats* stats);
+size_t cache_collect(sharded_cache* sc, cacheline*** lines);
+
+#endif
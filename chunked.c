@@ -0,0 +1,122 @@
+#include "chunked.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+void chunked_init(chunked_t* c) {
+    c->state = CHUNK_SIZE;
+    c->remaining = 0;
+    c->digits = 0;
+    c->line_len = 0;
+}
+
+static int hex__(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') {
+        return (ch | 0x20) - 'a' + 10;
+    }
+    return -1;
+}
+
+// the size line ended, a zero size starts the trailer
+static void end_size__(chunked_t* c) {
+    if (c->digits == 0) {
+        c->state = CHUNK_ERROR;
+        return;
+    }
+    c->state = c->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+    c->digits = 0;
+    c->line_len = 0;
+}
+
+// decodes n bytes in place: the body bytes among them are moved to the
+// front of buf and their number is returned. *used is set to the bytes
+// consumed, which is less than n only when the body ended early in buf
+size_t chunked_decode(chunked_t* c, char* buf, size_t n, size_t* used) {
+    size_t in = 0, out = 0;
+
+    while (in < n && c->state != CHUNK_DONE && c->state != CHUNK_ERROR) {
+        char ch = buf[in];
+        switch (c->state) {
+            case CHUNK_SIZE:
+                if (hex__(ch) >= 0) {
+                    if (c->remaining > SIZE_MAX >> 4) {
+                        c->state = CHUNK_ERROR;
+                        break;
+                    }
+                    c->remaining = (c->remaining << 4) | hex__(ch);
+                    c->digits += 1;
+                } else if (ch == ';' || ch == ' ' || ch == '\t') {
+                    c->state = CHUNK_EXT;
+                } else if (ch == '\r') {
+                    c->state = CHUNK_SIZE_LF;
+                } else if (ch == '\n') {
+                    end_size__(c);
+                } else {
+                    c->state = CHUNK_ERROR;
+                }
+                in++;
+                break;
+            case CHUNK_EXT:
+                if (ch == '\n') {
+                    end_size__(c);
+                }
+                in++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (ch == '\n') {
+                    end_size__(c);
+                } else {
+                    c->state = CHUNK_ERROR;
+                }
+                in++;
+                break;
+            case CHUNK_DATA: {
+                size_t len = n - in < c->remaining ? n - in : c->remaining;
+                memmove(buf + out, buf + in, len);
+                in += len;
+                out += len;
+                c->remaining -= len;
+                if (c->remaining == 0) {
+                    c->state = CHUNK_DATA_CR;
+                }
+                break;
+            }
+            case CHUNK_DATA_CR:
+                c->state = ch == '\r' ? CHUNK_DATA_LF : ch == '\n' ? CHUNK_SIZE : CHUNK_ERROR;
+                in++;
+                break;
+            case CHUNK_DATA_LF:
+                c->state = ch == '\n' ? CHUNK_SIZE : CHUNK_ERROR;
+                in++;
+                break;
+            case CHUNK_TRAILER:
+                // trailer fields are dropped, an empty line ends the body
+                if (ch == '\n') {
+                    c->state = c->line_len == 0 ? CHUNK_DONE : CHUNK_TRAILER;
+                    c->line_len = 0;
+                } else if (ch != '\r') {
+                    c->line_len += 1;
+                }
+                in++;
+                break;
+            default:
+                break;
+        }
+    }
+
+    *used = in;
+    return out;
+}
+
+bool chunked_done(const chunked_t* c) { return c->state == CHUNK_DONE; }
+
+bool chunked_failed(const chunked_t* c) { return c->state == CHUNK_ERROR; }
+
+// the size line in front of a chunk of len bytes
+size_t chunked_head(char* out, size_t cap, size_t len) {
+    return snprintf(out, cap, "%zx\r\n", len);
+}
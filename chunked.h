@@ -0,0 +1,35 @@
+#ifndef __CHUNKED_H__
+#define __CHUNKED_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CHUNKED_END "0\r\n\r\n"
+
+typedef enum {
+    CHUNK_SIZE = 0,
+    CHUNK_EXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,
+    CHUNK_DONE,
+    CHUNK_ERROR,
+} chunk_state_t;
+
+// incremental decoder for a chunked body, fed whatever the socket returned
+typedef struct {
+    chunk_state_t state;
+    size_t remaining;
+    size_t digits;
+    size_t line_len;
+} chunked_t;
+
+void chunked_init(chunked_t* c);
+size_t chunked_decode(chunked_t* c, char* buf, size_t n, size_t* used);
+bool chunked_done(const chunked_t* c);
+bool chunked_failed(const chunked_t* c);
+size_t chunked_head(char* out, size_t cap, size_t len);
+
+#endif
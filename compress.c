@@ -0,0 +1,209 @@
+#include "compress.h"
+
+#include <stdlib.h>
+#include <strings.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "http.h"
+
+static const char* compressible_types[] = {"text/", "application/javascript", "application/json",
+                                           "application/xml", "image/svg+xml", NULL};
+
+// picks the best encoding we can produce out of an Accept-Encoding value.
+// codings with q=0 are refused, also when * would take them
+encoding_t parse_accept_encoding(const char* value) {
+    bool gzip = false, br = false, any = false, no_gzip = false, no_br = false;
+
+    while (*value != '\0') {
+        while (*value == ' ' || *value == ',') {
+            value++;
+        }
+        size_t len = strcspn(value, ",;\r\n ");
+        const char* params = value + len;
+        const char* end = params + strcspn(params, ",");
+        const char* q = strstr(params, "q=");
+        bool refused = q != NULL && q < end && atof(q + 2) <= 0;
+
+        if (len == 4 && strncasecmp(value, "gzip", 4) == 0) {
+            gzip |= !refused;
+            no_gzip |= refused;
+        } else if (len == 2 && strncasecmp(value, "br", 2) == 0) {
+            br |= !refused;
+            no_br |= refused;
+        } else if (len == 1 && *value == '*') {
+            any |= !refused;
+        }
+        value = *end == '\0' ? end : end + 1;
+    }
+    gzip = (gzip || any) && !no_gzip;
+    br = br && !no_br;
+
+#ifdef HAVE_BROTLI
+    if (br) {
+        return ENCODING_BR;
+    }
+#else
+    (void)br;
+#endif
+    return gzip ? ENCODING_GZIP : ENCODING_IDENTITY;
+}
+
+const char* encoding_name(encoding_t encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP:
+            return "gzip";
+        case ENCODING_BR:
+            return "br";
+        default:
+            return "identity";
+    }
+}
+
+// a 200 with a text like type that is not encoded yet. length is the
+// body's, -1 while it is not known
+static bool compressible_head__(const char* response, size_t body, long long length) {
+    size_t len;
+    const char* type;
+
+    if ((length >= 0 && length < COMPRESS_MIN_SIZE) || parse_status(response) != 200) {
+        return false;
+    }
+    if (find_header(response, body, "Content-Encoding", &len) != NULL ||
+        find_header(response, body, "Content-Range", &len) != NULL) {
+        return false;
+    }
+    if ((type = find_header(response, body, "Content-Type", &len)) == NULL) {
+        return false;
+    }
+    for (const char** t = compressible_types; *t != NULL; t++) {
+        if (len >= strlen(*t) && strncasecmp(type, *t, strlen(*t)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// whether the Vary header already names Accept-Encoding, or everything
+static bool varies__(const char* response, size_t body) {
+    size_t len;
+    const char* vary = find_header(response, body, "Vary", &len);
+
+    for (size_t i = 0; vary != NULL && i < len; i++) {
+        if (vary[i] == '*' ||
+            (len - i >= 15 && strncasecmp(vary + i, "Accept-Encoding", 15) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a complete 200 with a text like type that is not encoded yet
+bool compressible(const char* response, size_t size) {
+    size_t body = find_body(response, size);
+
+    return body != 0 && compressible_head__(response, body, size - body);
+}
+
+// a response we may send compressed to other clients varies on
+// Accept-Encoding in its identity form too
+bool needs_vary(const char* response, size_t body, long long length) {
+    return compressible_head__(response, body, length) && !varies__(response, body);
+}
+
+// a copy of a complete response with Vary: Accept-Encoding added, NULL if
+// it needs none
+char* add_vary(const char* data, size_t size, size_t* out_size) {
+    size_t body = find_body(data, size);
+    static const char vary[] = "Vary: Accept-Encoding\r\n";
+
+    if (body == 0 || !needs_vary(data, body, size - body)) {
+        return NULL;
+    }
+    char* out = malloc(size + sizeof(vary));
+    size_t len = body - 2;
+    memcpy(out, data, len);
+    memcpy(out + len, vary, sizeof(vary) - 1);
+    len += sizeof(vary) - 1;
+    memcpy(out + len, data + body - 2, size - body + 2);
+    *out_size = len + size - body + 2;
+    return out;
+}
+
+static size_t gzip__(const char* in, size_t in_len, char* out, size_t out_cap) {
+    z_stream z = {0};
+
+    // 16 on top of the window bits asks for a gzip wrapper
+    if (deflateInit2(&z, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    z.next_in = (Bytef*)in;
+    z.avail_in = in_len;
+    z.next_out = (Bytef*)out;
+    z.avail_out = out_cap;
+    int ret = deflate(&z, Z_FINISH);
+    size_t len = z.total_out;
+    deflateEnd(&z);
+    return ret == Z_STREAM_END ? len : 0;
+}
+
+static size_t bound__(size_t in_len, encoding_t encoding) {
+#ifdef HAVE_BROTLI
+    if (encoding == ENCODING_BR) {
+        return BrotliEncoderMaxCompressedSize(in_len);
+    }
+#endif
+    return compressBound(in_len) + 32;
+}
+
+static size_t encode__(const char* in, size_t in_len, encoding_t encoding, char* out,
+                       size_t out_cap) {
+#ifdef HAVE_BROTLI
+    if (encoding == ENCODING_BR) {
+        size_t len = out_cap;
+        if (!BrotliEncoderCompress(COMPRESS_LEVEL, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, in_len,
+                                   (const uint8_t*)in, &len, (uint8_t*)out)) {
+            return 0;
+        }
+        return len;
+    }
+#endif
+    return gzip__(in, in_len, out, out_cap);
+}
+
+// builds the encoded variant of a compressible response: the same head with
+// the new framing, then the encoded body. NULL if it would not be smaller
+char* compress_response(const char* response, size_t size, encoding_t encoding,
+                        size_t* out_size) {
+    size_t body = find_body(response, size);
+    size_t cap = bound__(size - body, encoding);
+    char* encoded = malloc(cap);
+    size_t encoded_len = encode__(response + body, size - body, encoding, encoded, cap);
+
+    if (encoded_len == 0 || encoded_len >= size - body) {
+        free(encoded);
+        return NULL;
+    }
+
+    char* out = malloc(body + MAXLINE + encoded_len);
+    size_t len = 0;
+    const char* end = response + body;
+    for (const char* line = response; line < end;) {
+        const char* next = memchr(line, '\n', end - line);
+        next = next == NULL ? end : next + 1;
+        if (next - line > 2 && strncasecmp(line, "Content-Length:", 15) != 0) {
+            memcpy(out + len, line, next - line);
+            len += next - line;
+        }
+        line = next;
+    }
+    len += sprintf(out + len, "Content-Encoding: %s\r\n%sContent-Length: %zu\r\n\r\n",
+                   encoding_name(encoding),
+                   varies__(response, body) ? "" : "Vary: Accept-Encoding\r\n", encoded_len);
+    memcpy(out + len, encoded, encoded_len);
+    free(encoded);
+    *out_size = len + encoded_len;
+    return out;
+}
@@ -0,0 +1,25 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// bodies smaller than this are not worth a variant
+#define COMPRESS_MIN_SIZE 256
+#define COMPRESS_LEVEL    6
+
+typedef enum {
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP,
+    ENCODING_BR,
+} encoding_t;
+
+encoding_t parse_accept_encoding(const char* value);
+const char* encoding_name(encoding_t encoding);
+bool compressible(const char* response, size_t size);
+bool needs_vary(const char* response, size_t body, long long length);
+char* add_vary(const char* data, size_t size, size_t* out_size);
+char* compress_response(const char* response, size_t size, encoding_t encoding,
+                        size_t* out_size);
+
+#endif
@@ -0,0 +1,511 @@
+#include "disk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "logger.h"
+
+// The disk tier is one file used as a circular log of DISK_SEGMENTS segments.
+// Objects evicted from the memory tier are queued by kill_victim() and
+// appended by a single writer thread, so no disk I/O happens under a shard
+// lock. When the log wraps, the oldest segment is reused as a whole: the FIFO
+// list holds entries in write order, so its entries are at the head of the
+// list. An entry pinned by a reader is never dropped; the writer waits for it.
+//
+// sendfile() leaves references to page cache pages in the socket, so bytes
+// still in flight would change if the file were overwritten in place. A
+// segment is hole punched before reuse, which detaches the old pages instead.
+// Without hole punching objects are copied to the socket.
+
+static int disk_fd = -1;
+static char* index_path = NULL;
+static size_t disk_max = 0;
+static size_t segment_size = 0;
+static bool zero_copy = true;
+static uint64_t disk_head = 0;
+static uint64_t disk_seq = 0;
+static disk_stats_t disk_stats;
+
+static disk_entry_t** index_buckets = NULL;
+static size_t index_size = 0;
+static disk_entry_t* fifo_head = NULL;
+static disk_entry_t* fifo_tail = NULL;
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_unpinned = PTHREAD_COND_INITIALIZER;
+
+static cacheline* queue[DISK_QUEUE_LEN];
+static size_t queue_head = 0;
+static size_t queue_len = 0;
+static bool running = false;
+static pthread_t writer_tid;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static disk_entry_t** lookup__(const char* url) {
+    disk_entry_t** pos = &index_buckets[cache_hash(url) & (index_size - 1)];
+    while (*pos != NULL && strcmp((*pos)->url, url) != 0) {
+        pos = &(*pos)->hnext;
+    }
+    return pos;
+}
+
+static void grow_index__(void) {
+    disk_entry_t** old = index_buckets;
+    size_t old_size = index_size;
+
+    index_size *= 2;
+    index_buckets = calloc(index_size, sizeof(disk_entry_t*));
+    for (size_t i = 0; i < old_size; i++) {
+        disk_entry_t* e = old[i];
+        while (e != NULL) {
+            disk_entry_t* next = e->hnext;
+            disk_entry_t** bucket = &index_buckets[cache_hash(e->url) & (index_size - 1)];
+            e->hnext = *bucket;
+            *bucket = e;
+            e = next;
+        }
+    }
+    free(old);
+}
+
+// drops the oldest entry, waiting for its readers first. called with
+// disk_mutex held
+static void drop_oldest__(void) {
+    disk_entry_t* e = fifo_head;
+    while (e->pins > 0) {
+        pthread_cond_wait(&disk_unpinned, &disk_mutex);
+    }
+
+    if (e->indexed) {
+        *lookup__(e->url) = e->hnext;
+    }
+    fifo_head = e->fnext;
+    if (fifo_head == NULL) {
+        fifo_tail = NULL;
+    }
+    disk_stats.used -= e->length;
+    disk_stats.entries -= 1;
+    free(e->url);
+    free(e);
+}
+
+// empties the segment starting at disk_head before it is written again
+static void reuse_segment__(void) {
+    while (fifo_head != NULL && fifo_head->offset >= disk_head &&
+           fifo_head->offset < disk_head + segment_size) {
+        drop_oldest__();
+    }
+
+    // fallocate() is only declared with _GNU_SOURCE, which csapp.h conflicts with
+    if (zero_copy && syscall(SYS_fallocate, disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                             (off_t)disk_head, (off_t)segment_size) != 0) {
+        log_warn("DISK", "Hole punching is not supported, disabling sendfile()\n");
+        zero_copy = false;
+    }
+}
+
+// adds a written entry to the index and the tail of the FIFO. called with
+// disk_mutex held
+static void insert__(disk_entry_t* e) {
+    disk_entry_t** bucket = &index_buckets[cache_hash(e->url) & (index_size - 1)];
+    e->hnext = *bucket;
+    *bucket = e;
+    e->indexed = true;
+    if (fifo_tail != NULL) {
+        fifo_tail->fnext = e;
+    } else {
+        fifo_head = e;
+    }
+    fifo_tail = e;
+    disk_stats.used += e->length;
+    disk_stats.entries += 1;
+    if (disk_stats.entries > index_size) {
+        grow_index__();
+    }
+}
+
+// reserves length bytes at the head of the log, returns the offset. objects
+// never span segments
+static uint64_t reserve__(uint64_t length) {
+    uint64_t segment_end = (disk_head / segment_size + 1) * segment_size;
+
+    if (disk_head + length > segment_end) {
+        disk_head = segment_end < disk_max ? segment_end : 0;
+    }
+    if (disk_head % segment_size == 0) {
+        reuse_segment__();
+    }
+
+    uint64_t offset = disk_head;
+    disk_head += length;
+    return offset;
+}
+
+static void write_line__(cacheline* line) {
+    disk_record_t record;
+    size_t url_len = strlen(line->url);
+    uint64_t length = sizeof(record) + url_len + line->size;
+    uint64_t offset;
+
+    if (length > segment_size) {
+        pthread_mutex_lock(&disk_mutex);
+        disk_stats.dropped += 1;
+        pthread_mutex_unlock(&disk_mutex);
+        return;
+    }
+
+    // the object may have been promoted and evicted again, the log copy is
+    // still good
+    pthread_mutex_lock(&disk_mutex);
+    if (*lookup__(line->url) != NULL) {
+        pthread_mutex_unlock(&disk_mutex);
+        return;
+    }
+    offset = reserve__(length);
+    record.seq = ++disk_seq;
+    pthread_mutex_unlock(&disk_mutex);
+
+    record.magic = DISK_MAGIC;
+    record.url_len = url_len;
+    record.size = line->size;
+
+    struct iovec iov[3] = {{&record, sizeof(record)},
+                           {line->url, url_len},
+                           {line->content, line->size}};
+    if (pwritev(disk_fd, iov, 3, offset) != length) {
+        log_error("DISK", "Failed to write %s\n", line->url);
+        pthread_mutex_lock(&disk_mutex);
+        disk_stats.dropped += 1;
+        pthread_mutex_unlock(&disk_mutex);
+        return;
+    }
+
+    disk_entry_t* e = calloc(1, sizeof(disk_entry_t));
+    e->url = strdup(line->url);
+    e->offset = offset;
+    e->size = line->size;
+    e->seq = record.seq;
+    e->length = length;
+    e->status = parse_status(line->content);
+    e->verified = true;
+
+    pthread_mutex_lock(&disk_mutex);
+    insert__(e);
+    disk_stats.writes += 1;
+    pthread_mutex_unlock(&disk_mutex);
+}
+
+static void* writer__(void* arg) {
+    while (true) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_len == 0 && running) {
+            pthread_cond_wait(&queue_ready, &queue_mutex);
+        }
+        if (queue_len == 0) {
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+        cacheline* line = queue[queue_head];
+        queue_head = (queue_head + 1) % DISK_QUEUE_LEN;
+        queue_len -= 1;
+        pthread_mutex_unlock(&queue_mutex);
+
+        write_line__(line);
+        release_cacheline(line);
+    }
+    return NULL;
+}
+
+// reloads the index saved by disk_close(). entries are checked against their
+// record header on first use rather than here, so startup stays fast
+static bool load_index__(void) {
+    disk_index_header_t h;
+    disk_index_record_t r;
+    FILE* in = fopen(index_path, "r");
+
+    if (in == NULL) {
+        return false;
+    }
+    // a crash after this point must not reuse an index of a changed log
+    unlink(index_path);
+
+    if (fread(&h, sizeof(h), 1, in) != 1 || h.magic != DISK_INDEX_MAGIC ||
+        h.version != DISK_VERSION || h.segment_size != segment_size || h.head > disk_max) {
+        log_warn("DISK", "Ignoring stale or corrupt index %s\n", index_path);
+        fclose(in);
+        return false;
+    }
+
+    for (uint64_t i = 0; i < h.n_entries; i++) {
+        if (fread(&r, sizeof(r), 1, in) != 1 || r.offset + r.length > disk_max ||
+            r.url_len >= MAXLINE) {
+            break;
+        }
+        disk_entry_t* e = calloc(1, sizeof(disk_entry_t));
+        e->url = calloc(1, r.url_len + 1);
+        if (fread(e->url, 1, r.url_len, in) != r.url_len) {
+            free(e->url);
+            free(e);
+            break;
+        }
+        e->offset = r.offset;
+        e->length = r.length;
+        e->size = r.size;
+        e->seq = r.seq;
+        e->status = r.status;
+        insert__(e);
+    }
+
+    disk_head = h.head;
+    disk_seq = h.seq;
+    fclose(in);
+    log_info("DISK", "Reloaded %zu objects (%zu bytes)\n", disk_stats.entries, disk_stats.used);
+    return true;
+}
+
+static void save_index__(void) {
+    disk_index_header_t h;
+    disk_index_record_t r;
+    FILE* out = fopen(index_path, "w");
+
+    if (out == NULL) {
+        log_error("DISK", "Failed to write %s\n", index_path);
+        return;
+    }
+
+    memset(&h, 0x00, sizeof(h));
+    h.magic = DISK_INDEX_MAGIC;
+    h.version = DISK_VERSION;
+    h.segment_size = segment_size;
+    h.head = disk_head;
+    h.seq = disk_seq;
+    h.n_entries = disk_stats.entries;
+    fwrite(&h, sizeof(h), 1, out);
+
+    memset(&r, 0x00, sizeof(r));
+    for (disk_entry_t* e = fifo_head; e != NULL; e = e->fnext) {
+        r.offset = e->offset;
+        r.length = e->length;
+        r.size = e->size;
+        r.seq = e->seq;
+        r.url_len = strlen(e->url);
+        r.status = e->status;
+        fwrite(&r, sizeof(r), 1, out);
+        fwrite(e->url, 1, r.url_len, out);
+    }
+
+    bool ok = !ferror(out);
+    if (fclose(out) != 0 || !ok) {
+        log_error("DISK", "Failed to write %s\n", index_path);
+        unlink(index_path);
+    }
+}
+
+// every segment has to hold the largest object the memory tier evicts
+bool disk_open(const char* path, size_t max_size, size_t max_object_size) {
+    size_t len = strlen(path) + sizeof(".idx");
+
+    if (max_size / DISK_SEGMENTS < sizeof(disk_record_t) + max_object_size) {
+        log_error("DISK", "A disk cache of %zu bytes is too small, it needs at least %zu\n",
+                  max_size, DISK_SEGMENTS * (sizeof(disk_record_t) + max_object_size));
+        return false;
+    }
+    index_path = malloc(len);
+    snprintf(index_path, len, "%s.idx", path);
+
+    if ((disk_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        log_error("DISK", "Failed to open %s\n", path);
+        return false;
+    }
+
+    segment_size = max_size / DISK_SEGMENTS;
+    disk_max = segment_size * DISK_SEGMENTS;
+    disk_stats.max_size = disk_max;
+    index_size = DISK_INDEX_INIT;
+    index_buckets = calloc(index_size, sizeof(disk_entry_t*));
+
+    if (!load_index__() && ftruncate(disk_fd, 0) != 0) {
+        log_error("DISK", "Failed to truncate %s\n", path);
+    }
+
+    running = true;
+    if (pthread_create(&writer_tid, NULL, writer__, NULL) != 0) {
+        log_error("DISK", "Failed to start the writer thread\n");
+        running = false;
+        close(disk_fd);
+        disk_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void disk_close(void) {
+    if (disk_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue_mutex);
+    running = false;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_join(writer_tid, NULL);
+
+    pthread_mutex_lock(&disk_mutex);
+    save_index__();
+    pthread_mutex_unlock(&disk_mutex);
+    close(disk_fd);
+    disk_fd = -1;
+}
+
+bool disk_enabled(void) { return disk_fd >= 0; }
+
+// runs under the shard lock of the evicting cache, so it only queues the line
+void disk_evict_hook(cacheline* line, void* arg) {
+    pthread_mutex_lock(&queue_mutex);
+    if (!running || queue_len == DISK_QUEUE_LEN) {
+        pthread_mutex_unlock(&queue_mutex);
+        pthread_mutex_lock(&disk_mutex);
+        disk_stats.dropped += 1;
+        pthread_mutex_unlock(&disk_mutex);
+        return;
+    }
+    atomic_fetch_add(&line->refcnt, 1);
+    queue[(queue_head + queue_len) % DISK_QUEUE_LEN] = line;
+    queue_len += 1;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+// checks a reloaded entry against the record header it points to
+static bool verify__(disk_entry_t* e) {
+    disk_record_t record;
+    size_t url_len = strlen(e->url);
+
+    e->verified = pread(disk_fd, &record, sizeof(record), e->offset) == sizeof(record) &&
+                  record.magic == DISK_MAGIC && record.seq == e->seq &&
+                  record.url_len == url_len && record.size == e->size &&
+                  e->length == sizeof(record) + url_len + e->size;
+    if (!e->verified) {
+        log_warn("DISK", "Dropping stale entry for %s\n", e->url);
+    }
+    return e->verified;
+}
+
+// returns a pinned entry that will not be overwritten until disk_release()
+disk_entry_t* disk_get(const char* url) {
+    pthread_mutex_lock(&disk_mutex);
+    disk_entry_t* e = *lookup__(url);
+    if (e != NULL && !e->verified && !verify__(e)) {
+        *lookup__(url) = e->hnext;
+        e->indexed = false;
+        e = NULL;
+    }
+    if (e != NULL) {
+        e->pins += 1;
+        e->hits += 1;
+    }
+    pthread_mutex_unlock(&disk_mutex);
+    return e;
+}
+
+void disk_release(disk_entry_t* entry) {
+    pthread_mutex_lock(&disk_mutex);
+    entry->pins -= 1;
+    if (entry->pins == 0) {
+        pthread_cond_broadcast(&disk_unpinned);
+    }
+    pthread_mutex_unlock(&disk_mutex);
+}
+
+// repeated hits are worth copying back to the memory tier
+bool disk_promote(disk_entry_t* entry) { return entry->hits >= DISK_PROMOTE_HITS; }
+
+bool disk_read(disk_entry_t* entry, char* buf) {
+    off_t offset = entry->offset + entry->length - entry->size;
+    size_t done = 0;
+
+    while (done < entry->size) {
+        ssize_t n = pread(disk_fd, buf + done, entry->size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log_error("DISK", "Failed to read %s\n", entry->url);
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static bool wait_writable__(int fd) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    return poll(&pfd, 1, DISK_SEND_TIMEOUT) > 0;
+}
+
+static ssize_t copy__(disk_entry_t* entry, int fd) {
+    char* buf = malloc(entry->size);
+    size_t done = 0;
+
+    if (buf == NULL || !disk_read(entry, buf)) {
+        free(buf);
+        return -1;
+    }
+    while (done < entry->size) {
+        ssize_t n = write(fd, buf + done, entry->size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN && wait_writable__(fd)) {
+            continue;
+        }
+        if (n <= 0) {
+            free(buf);
+            return -1;
+        }
+        done += n;
+    }
+    free(buf);
+    return done;
+}
+
+// sends the object straight from the page cache to the client socket
+ssize_t disk_send(disk_entry_t* entry, int fd) {
+    off_t offset = entry->offset + entry->length - entry->size;
+    size_t done = 0;
+
+    if (!zero_copy) {
+        return copy__(entry, fd);
+    }
+
+    while (done < entry->size) {
+        ssize_t n = sendfile(fd, disk_fd, &offset, entry->size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN && wait_writable__(fd)) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+void disk_get_stats(disk_stats_t* stats) {
+    pthread_mutex_lock(&disk_mutex);
+    *stats = disk_stats;
+    pthread_mutex_unlock(&disk_mutex);
+}
@@ -0,0 +1,85 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+#define DISK_MAGIC        0x4b445850 /* "PXDK" */
+#define DISK_INDEX_MAGIC  0x49445850 /* "PXDI" */
+#define DISK_VERSION      1
+#define DISK_DEFAULT_SIZE (1UL << 30)
+#define DISK_SEGMENTS     16
+#define DISK_QUEUE_LEN    1024
+#define DISK_PROMOTE_HITS 2
+#define DISK_INDEX_INIT   1024
+#define DISK_SEND_TIMEOUT 30000
+
+// header of every object in the log, followed by the url and the content
+typedef struct {
+    uint32_t magic;
+    uint32_t url_len;
+    uint64_t size;
+    uint64_t seq;
+} disk_record_t;
+
+// <path>.idx, written on a clean shutdown so the log survives a restart:
+// this header, then one disk_index_record_t plus url per entry, oldest first
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t segment_size;
+    uint64_t head;
+    uint64_t seq;
+    uint64_t n_entries;
+} disk_index_header_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t size;
+    uint64_t seq;
+    uint32_t url_len;
+    uint16_t status;
+    uint16_t reserved;
+} disk_index_record_t;
+
+typedef struct disk_entry {
+    char* url;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t seq;
+    uint64_t length;
+    uint32_t hits;
+    uint16_t status;
+    bool indexed;
+    bool verified;
+    int pins;
+    struct disk_entry* hnext;
+    struct disk_entry* fnext;
+} disk_entry_t;
+
+typedef struct {
+    size_t used;
+    size_t max_size;
+    size_t entries;
+    size_t writes;
+    size_t dropped;
+} disk_stats_t;
+
+bool disk_open(const char* path, size_t max_size, size_t max_object_size);
+void disk_close(void);
+bool disk_enabled(void);
+void disk_evict_hook(cacheline* line, void* arg);
+disk_entry_t* disk_get(const char* url);
+void disk_release(disk_entry_t* entry);
+bool disk_promote(disk_entry_t* entry);
+bool disk_read(disk_entry_t* entry, char* buf);
+ssize_t disk_send(disk_entry_t* entry, int fd);
+void disk_get_stats(disk_stats_t* stats);
+
+#endif
@@ -0,0 +1,271 @@
+#include "fill.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+// Responses being fetched from the origin, by url. A miss for a url that is
+// already being fetched follows that fetch rather than starting another one.
+// A fill leaves the table when it finishes or grows past the object size
+// cap; after that new requests go to the cache or the origin again. Such a
+// fill is never cached, so it only keeps the chunks its followers still
+// need, and the writer waits for the slowest of them once that is more than
+// FILL_WINDOW.
+
+static fill_t* table[FILL_BUCKETS];
+static size_t n_active;
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void unlist__(fill_t* f) {
+    pthread_mutex_lock(&table_mutex);
+    if (f->listed) {
+        fill_t** pos = &table[f->hash % FILL_BUCKETS];
+        while (*pos != f) {
+            pos = &(*pos)->next;
+        }
+        *pos = f->next;
+        f->listed = false;
+        n_active -= 1;
+    }
+    pthread_mutex_unlock(&table_mutex);
+}
+
+static void free_chunks__(fill_t* f) {
+    fill_chunk_t* chunk = f->head;
+    while (chunk != NULL) {
+        fill_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    f->head = f->tail = NULL;
+}
+
+static fill_t* create_fill__(const char* url, uint64_t hash, size_t max_size) {
+    fill_t* f = calloc(1, sizeof(fill_t));
+    f->url = strdup(url);
+    f->hash = hash;
+    f->max_size = max_size;
+    f->state = FILL_ACTIVE;
+    f->refcnt = 1;
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    return f;
+}
+
+// returns the fill in flight for url with writer set to false, or a new one
+// the caller has to write. a fill that is not shared is never followed
+fill_t* fill_open(const char* url, size_t max_size, bool shared, bool* writer) {
+    uint64_t hash = cache_hash(url);
+    fill_t* f;
+
+    *writer = true;
+    if (!shared) {
+        return create_fill__(url, hash, max_size);
+    }
+
+    pthread_mutex_lock(&table_mutex);
+    for (f = table[hash % FILL_BUCKETS]; f != NULL; f = f->next) {
+        if (f->hash == hash && strcmp(f->url, url) == 0) {
+            pthread_mutex_lock(&f->mutex);
+            f->refcnt += 1;
+            f->joining += 1;
+            pthread_mutex_unlock(&f->mutex);
+            pthread_mutex_unlock(&table_mutex);
+            *writer = false;
+            return f;
+        }
+    }
+    f = create_fill__(url, hash, max_size);
+    f->listed = true;
+    f->next = table[hash % FILL_BUCKETS];
+    table[hash % FILL_BUCKETS] = f;
+    n_active += 1;
+    pthread_mutex_unlock(&table_mutex);
+    return f;
+}
+
+// frees the chunks of an oversized fill that every reader is past. with
+// the mutex held. a follower that has not started reading yet needs them all
+static void drop_read__(fill_t* f) {
+    while (f->oversized && f->joining == 0 && f->head != f->tail) {
+        for (fill_reader_t* r = f->readers; r != NULL; r = r->next) {
+            if (r->chunk == NULL || r->chunk == f->head) {
+                return;
+            }
+        }
+        fill_chunk_t* chunk = f->head;
+        f->head = chunk->next;
+        f->dropped += chunk->len;
+        free(chunk);
+    }
+}
+
+// appends bytes read from the origin. returns false once the response no
+// longer fits the cache and nobody follows it, the writer can stop then
+bool fill_append(fill_t* f, const char* data, size_t n) {
+    if (f->oversized && !fill_has_followers(f)) {
+        return false;
+    }
+    if (!f->oversized && f->size + n > f->max_size) {
+        f->oversized = true;
+        unlist__(f);
+        if (!fill_has_followers(f)) {
+            // nobody else can reach it any more
+            pthread_mutex_lock(&f->mutex);
+            free_chunks__(f);
+            pthread_mutex_unlock(&f->mutex);
+            return false;
+        }
+    }
+
+    pthread_mutex_lock(&f->mutex);
+    // the followers go at the pace of their clients, which the origin is
+    // read at once they fall FILL_WINDOW behind
+    while (f->oversized && f->size - f->dropped > FILL_WINDOW &&
+           (f->readers != NULL || f->joining > 0)) {
+        drop_read__(f);
+        if (f->size - f->dropped > FILL_WINDOW) {
+            pthread_cond_wait(&f->cond, &f->mutex);
+        }
+    }
+    while (n > 0) {
+        if (f->tail == NULL || f->tail->len == FILL_CHUNK_SIZE) {
+            fill_chunk_t* chunk = malloc(sizeof(fill_chunk_t));
+            chunk->next = NULL;
+            chunk->len = 0;
+            if (f->tail == NULL) {
+                f->head = chunk;
+            } else {
+                f->tail->next = chunk;
+            }
+            f->tail = chunk;
+        }
+        size_t len = FILL_CHUNK_SIZE - f->tail->len;
+        len = len < n ? len : n;
+        memcpy(f->tail->data + f->tail->len, data, len);
+        f->tail->len += len;
+        f->size += len;
+        data += len;
+        n -= len;
+    }
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+    return true;
+}
+
+void fill_finish(fill_t* f, bool complete) {
+    unlist__(f);
+    pthread_mutex_lock(&f->mutex);
+    f->state = complete ? FILL_DONE : FILL_ABORTED;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+bool fill_has_followers(fill_t* f) {
+    pthread_mutex_lock(&f->mutex);
+    bool followed = f->refcnt > 1;
+    pthread_mutex_unlock(&f->mutex);
+    return followed;
+}
+
+// the whole response in one buffer, NULL if it did not fit the cache
+char* fill_copy(fill_t* f, size_t* size) {
+    if (f->oversized || f->size == 0) {
+        return NULL;
+    }
+
+    char* buf = malloc(f->size);
+    size_t off = 0;
+    for (fill_chunk_t* chunk = f->head; chunk != NULL; chunk = chunk->next) {
+        memcpy(buf + off, chunk->data, chunk->len);
+        off += chunk->len;
+    }
+    *size = f->size;
+    return buf;
+}
+
+// a follower reads from the start, nothing is dropped before it got here
+void fill_reader_init(fill_reader_t* r, fill_t* f) {
+    r->chunk = NULL;
+    r->offset = 0;
+    r->pos = 0;
+    pthread_mutex_lock(&f->mutex);
+    r->next = f->readers;
+    f->readers = r;
+    f->joining -= 1;
+    pthread_mutex_unlock(&f->mutex);
+}
+
+// the reader reads no more, the writer may have waited for it
+void fill_reader_done(fill_reader_t* r, fill_t* f) {
+    pthread_mutex_lock(&f->mutex);
+    fill_reader_t** pos = &f->readers;
+    while (*pos != r) {
+        pos = &(*pos)->next;
+    }
+    *pos = r->next;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+// blocks until the writer appended bytes the reader has not seen and points
+// data at them. returns 0 once the fill finished and everything was read
+size_t fill_wait(fill_t* f, fill_reader_t* r, const char** data) {
+    pthread_mutex_lock(&f->mutex);
+    while (r->offset >= f->size && f->state == FILL_ACTIVE) {
+        pthread_cond_wait(&f->cond, &f->mutex);
+    }
+    if (r->offset >= f->size) {
+        pthread_mutex_unlock(&f->mutex);
+        return 0;
+    }
+    if (r->chunk == NULL) {
+        r->chunk = f->head;
+    } else if (r->pos == r->chunk->len) {
+        r->chunk = r->chunk->next;
+        r->pos = 0;
+        // the writer may wait for this reader to leave a chunk
+        if (f->oversized) {
+            pthread_cond_broadcast(&f->cond);
+        }
+    }
+    size_t n = r->chunk->len - r->pos;
+    pthread_mutex_unlock(&f->mutex);
+
+    // bytes below size are never written again
+    *data = r->chunk->data + r->pos;
+    r->pos += n;
+    r->offset += n;
+    return n;
+}
+
+fill_state_t fill_state(fill_t* f) {
+    pthread_mutex_lock(&f->mutex);
+    fill_state_t state = f->state;
+    pthread_mutex_unlock(&f->mutex);
+    return state;
+}
+
+void fill_release(fill_t* f) {
+    pthread_mutex_lock(&f->mutex);
+    bool last = --f->refcnt == 0;
+    pthread_mutex_unlock(&f->mutex);
+    if (!last) {
+        return;
+    }
+
+    unlist__(f);
+    free_chunks__(f);
+    pthread_mutex_destroy(&f->mutex);
+    pthread_cond_destroy(&f->cond);
+    free(f->url);
+    free(f);
+}
+
+size_t fill_active(void) {
+    pthread_mutex_lock(&table_mutex);
+    size_t n = n_active;
+    pthread_mutex_unlock(&table_mutex);
+    return n;
+}
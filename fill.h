@@ -0,0 +1,69 @@
+#ifndef __FILL_H__
+#define __FILL_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILL_CHUNK_SIZE (64 * 1024)
+#define FILL_BUCKETS    64
+/* Bytes an uncacheable fill holds for its slowest follower */
+#define FILL_WINDOW     (16 * FILL_CHUNK_SIZE)
+
+typedef struct fill_chunk {
+    struct fill_chunk* next;
+    size_t len;
+    char data[FILL_CHUNK_SIZE];
+} fill_chunk_t;
+
+typedef enum {
+    FILL_ACTIVE = 0,
+    FILL_DONE,
+    FILL_ABORTED,
+} fill_state_t;
+
+// where a reader is in a fill
+typedef struct fill_reader {
+    fill_chunk_t* chunk;
+    size_t offset;
+    size_t pos;
+    struct fill_reader* next;
+} fill_reader_t;
+
+// a response on its way from the origin. the writer appends to it, readers
+// that asked for the same url meanwhile follow it instead of going to the
+// origin themselves. dropped counts the bytes before head that every reader
+// is done with
+typedef struct fill {
+    char* url;
+    uint64_t hash;
+    fill_chunk_t* head;
+    fill_chunk_t* tail;
+    size_t size;
+    size_t dropped;
+    size_t max_size;
+    fill_state_t state;
+    bool listed;
+    bool oversized;
+    int refcnt;
+    int joining;
+    fill_reader_t* readers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct fill* next;
+} fill_t;
+
+fill_t* fill_open(const char* url, size_t max_size, bool shared, bool* writer);
+bool fill_append(fill_t* f, const char* data, size_t n);
+void fill_finish(fill_t* f, bool complete);
+bool fill_has_followers(fill_t* f);
+char* fill_copy(fill_t* f, size_t* size);
+void fill_reader_init(fill_reader_t* r, fill_t* f);
+void fill_reader_done(fill_reader_t* r, fill_t* f);
+size_t fill_wait(fill_t* f, fill_reader_t* r, const char** data);
+fill_state_t fill_state(fill_t* f);
+void fill_release(fill_t* f);
+size_t fill_active(void);
+
+#endif
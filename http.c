@@ -0,0 +1,345 @@
+#include "http.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "string.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+result_t parse_url(const char* url, URL* parsedURL) {
+    char *token, *rest;
+    bool no_proto = false;
+    char* url_copy = strdup(url);
+    result_t result;
+
+    memset(parsedURL, 0x00, sizeof(*parsedURL));
+    result.succ = true;
+    result.data = NULL;
+
+    // Parse proto
+    if (fast_strstr(url_copy, "://") != NULL) {
+        token = strtok_r(url_copy, ":", &rest);
+        if (token != NULL && rest != NULL && *rest != '\0') {
+            size_t len = MIN(strlen(token), sizeof(parsedURL->proto) - 1);
+            memcpy(parsedURL->proto, token, len);
+            parsedURL->proto[len] = '\0';
+        }
+    } else {
+        rest = url_copy;
+        no_proto = true;
+    }
+
+    // parse relative path
+    if (no_proto && rest != NULL && rest[0] == '/') {
+        size_t len = MIN(strlen(rest), sizeof(parsedURL->path) - 1);
+        memcpy(parsedURL->path, rest, len);
+        parsedURL->path[len] = '\0';
+    } else {
+        // Parse host
+        token = strtok_r(rest, "/", &rest);
+        if (token != NULL) {
+            size_t len = MIN(strlen(token), sizeof(parsedURL->host) - 1);
+            memcpy(parsedURL->host, token, len);
+            parsedURL->host[len] = '\0';
+        }
+
+        // Parse path
+        if (rest != NULL) {
+            size_t len = MIN(strlen(rest), sizeof(parsedURL->path) - 1);
+            if (rest[0] != '/') {
+                strncpy(parsedURL->path, "/", 2);
+            }
+            strncat(parsedURL->path, rest, len);
+        } else {
+            strncpy(parsedURL->path, "/", 2);
+        }
+    }
+
+    // Parse port
+    // Remove invalid port
+    size_t host_len = strlen(parsedURL->host);
+    if (host_len > 0 && parsedURL->host[host_len - 1] == ':') {
+        parsedURL->host[host_len - 1] = '\0';
+    }
+
+    unsigned int cnt = 0;
+    for (size_t i = 0; i < host_len; i++) {
+        if (parsedURL->host[i] == ':') {
+            cnt += 1;
+            if (cnt > 1) {
+                break;
+            }
+        }
+    }
+
+    // Can't parse ipv6
+    if (cnt > 1) {
+        result.succ = false;
+    } else {
+        char* saveptr;
+        char* host_copy = strdup(parsedURL->host);
+        strtok_r(host_copy, ":", &saveptr);
+
+        if (saveptr != NULL) {
+            parsedURL->port = atoi(saveptr);
+        }
+
+        char* pos = strchr(parsedURL->host, ':');
+        if (pos != NULL) {
+            *pos = '\0';
+        }
+        free(host_copy);
+    }
+
+    // prevent directory traversal
+    if (fast_strstr(parsedURL->path, "../") != NULL || fast_strstr(parsedURL->path, "//") != NULL) {
+        result.succ = false;
+    }
+
+    if (!no_proto) {
+        result.has_data = (result.data != NULL);
+        free(url_copy);
+        return result;
+    }
+
+    // if there is no proto, determine proto using known port number
+    switch (parsedURL->port) {
+        case 0:
+        case 80:
+            strcpy(parsedURL->proto, "http");
+            break;
+        case 443:
+            strcpy(parsedURL->proto, "https");
+            break;
+        default:
+            result.succ = false;
+            break;
+    }
+
+    free(url_copy);
+    return result;
+}
+
+// the host:port target of a CONNECT. the port is required, any port goes
+bool parse_authority(const char* authority, URL* url) {
+    const char* colon = strrchr(authority, ':');
+    char* end;
+
+    memset(url, 0x00, sizeof(*url));
+    if (colon == NULL || colon == authority || colon - authority >= sizeof(url->host)) {
+        return false;
+    }
+    long port = strtol(colon + 1, &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535) {
+        return false;
+    }
+    memcpy(url->host, authority, colon - authority);
+    url->port = port;
+    strcpy(url->proto, port == 443 ? "https" : "http");
+    strcpy(url->path, "/");
+    return true;
+}
+
+int parse_status(const char* line) {
+    // "HTTP/1.x NNN ..."
+    if (strncmp(line, "HTTP/", 5) != 0) {
+        return 0;
+    }
+
+    const char* pos = strchr(line, ' ');
+    return pos == NULL ? 0 : atoi(pos + 1);
+}
+
+// parses the value of a Range header. lists of ranges are rejected, the
+// caller then answers with the whole object
+bool parse_range(const char* value, range_t* range) {
+    char* end;
+
+    while (*value == ' ') {
+        value++;
+    }
+    if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+        return false;
+    }
+    value += 6;
+
+    range->first = -1;
+    range->last = -1;
+    if (*value != '-') {
+        range->first = strtoll(value, &end, 10);
+        if (end == value || range->first < 0) {
+            return false;
+        }
+        value = end;
+    }
+    if (*value++ != '-') {
+        return false;
+    }
+    if (*value >= '0' && *value <= '9') {
+        range->last = strtoll(value, &end, 10);
+        value = end;
+    } else if (range->first < 0) {
+        return false;
+    }
+    while (*value == ' ' || *value == '\r' || *value == '\n') {
+        value++;
+    }
+    if (*value != '\0' || (range->first >= 0 && range->last >= 0 && range->last < range->first)) {
+        return false;
+    }
+    range->set = true;
+    return true;
+}
+
+// turns a range into inclusive offsets of a body of total bytes. false if
+// none of its bytes exist
+bool resolve_range(const range_t* range, size_t total, size_t* from, size_t* to) {
+    if (range->first < 0) {
+        if (range->last <= 0 || total == 0) {
+            return false;
+        }
+        *from = (size_t)range->last >= total ? 0 : total - range->last;
+        *to = total - 1;
+        return true;
+    }
+    if ((size_t)range->first >= total) {
+        return false;
+    }
+    *from = range->first;
+    *to = range->last < 0 || (size_t)range->last >= total ? total - 1 : (size_t)range->last;
+    return true;
+}
+
+// offset of the body in a response, 0 if the head is not complete
+size_t find_body(const char* data, size_t size) {
+    for (size_t i = 0; i + 4 <= size; i++) {
+        if (data[i] == '\r' && memcmp(data + i, "\r\n\r\n", 4) == 0) {
+            return i + 4;
+        }
+    }
+    return 0;
+}
+
+// value of the first header called name in a response head, NULL if there
+// is none. the value runs up to the line end and has no leading spaces
+const char* find_header(const char* head, size_t head_len, const char* name, size_t* value_len) {
+    const char* end = head + head_len;
+    size_t name_len = strlen(name);
+
+    for (const char* line = head; line < end;) {
+        const char* next = memchr(line, '\n', end - line);
+        next = next == NULL ? end : next + 1;
+        if (next - line > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0) {
+            const char* value = line + name_len + 1;
+            while (value < next && *value == ' ') {
+                value++;
+            }
+            size_t len = next - value;
+            while (len > 0 && (value[len - 1] == '\r' || value[len - 1] == '\n')) {
+                len--;
+            }
+            *value_len = len;
+            return value;
+        }
+        line = next;
+    }
+    return NULL;
+}
+
+long long parse_content_length(const char* head, size_t head_len) {
+    size_t len;
+    const char* value = find_header(head, head_len, "Content-Length", &len);
+    return value == NULL ? -1 : strtoll(value, NULL, 10);
+}
+
+// a Content-Length value: digits only, with spaces around them. false for
+// anything else and for values that do not fit
+bool parse_length(const char* value, long long* length) {
+    long long n = 0;
+
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    if (*value < '0' || *value > '9') {
+        return false;
+    }
+    for (; *value >= '0' && *value <= '9'; value++) {
+        if (n > (LLONG_MAX - (*value - '0')) / 10) {
+            return false;
+        }
+        n = n * 10 + (*value - '0');
+    }
+    while (*value == ' ' || *value == '\t' || *value == '\r' || *value == '\n') {
+        value++;
+    }
+    if (*value != '\0') {
+        return false;
+    }
+    *length = n;
+    return true;
+}
+
+// headers that describe one connection and are never passed on
+static const char* hop_by_hop[] = {"Connection", "Keep-Alive", "Proxy-Connection",
+                                   "Transfer-Encoding", "TE", "Trailer", "Upgrade", NULL};
+
+static bool named__(const char* line, size_t line_len, const char* name) {
+    size_t name_len = strlen(name);
+    return line_len > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0;
+}
+
+bool is_hop_by_hop(const char* line, size_t line_len) {
+    for (const char** name = hop_by_hop; *name != NULL; name++) {
+        if (named__(line, line_len, *name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// appends the header lines of a head to out at *len, leaving out the status
+// line, the blank line, hop-by-hop headers and those named in drop
+bool copy_headers(char* out, size_t cap, size_t* len, const char* head, size_t head_len,
+                  const char* const* drop) {
+    const char* end = head + head_len;
+    const char* line = memchr(head, '\n', head_len);
+
+    for (line = line == NULL ? end : line + 1; line < end;) {
+        const char* next = memchr(line, '\n', end - line);
+        next = next == NULL ? end : next + 1;
+        bool skip = next - line <= 2 || is_hop_by_hop(line, next - line);
+        for (const char* const* name = drop; !skip && name != NULL && *name != NULL; name++) {
+            skip = named__(line, next - line, *name);
+        }
+        if (!skip) {
+            if (*len + (next - line) >= cap) {
+                return false;
+            }
+            memcpy(out + *len, line, next - line);
+            *len += next - line;
+        }
+        line = next;
+    }
+    return true;
+}
+
+// a copy of a complete response with a Content-Length header, for bodies
+// that were framed by chunks or the end of the connection
+char* add_content_length(const char* data, size_t size, size_t* out_size) {
+    size_t body = find_body(data, size);
+    size_t len;
+
+    if (body == 0 || find_header(data, body, "Content-Length", &len) != NULL) {
+        return NULL;
+    }
+    char* out = malloc(size + 64);
+    len = body - 2;
+    memcpy(out, data, len);
+    len += sprintf(out + len, "Content-Length: %zu\r\n\r\n", size - body);
+    memcpy(out + len, data + body, size - body);
+    *out_size = len + size - body;
+    return out;
+}
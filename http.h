@@ -0,0 +1,45 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stdbool.h>
+
+#include "csapp.h"
+
+#define SMALL_MAXSIZE 255
+
+typedef struct {
+    char proto[SMALL_MAXSIZE];
+    char host[SMALL_MAXSIZE];
+    char path[SMALL_MAXSIZE];
+    int port;
+} URL;
+
+typedef struct {
+    bool succ;
+    bool has_data;
+    void* data;
+} result_t;
+
+// a single "bytes=" range. first < 0 asks for the last `last` bytes,
+// last < 0 for everything from first on
+typedef struct {
+    bool set;
+    long long first;
+    long long last;
+} range_t;
+
+result_t parse_url(const char* urlstr, URL* url);
+bool parse_authority(const char* authority, URL* url);
+int parse_status(const char* line);
+bool parse_range(const char* value, range_t* range);
+bool resolve_range(const range_t* range, size_t total, size_t* from, size_t* to);
+size_t find_body(const char* data, size_t size);
+const char* find_header(const char* head, size_t head_len, const char* name, size_t* value_len);
+long long parse_content_length(const char* head, size_t head_len);
+bool parse_length(const char* value, long long* length);
+bool is_hop_by_hop(const char* line, size_t line_len);
+bool copy_headers(char* out, size_t cap, size_t* len, const char* head, size_t head_len,
+                  const char* const* drop);
+char* add_content_length(const char* data, size_t size, size_t* out_size);
+
+#endif
@@ -0,0 +1,193 @@
+#include "metrics.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Every thread picks one shard on first use and only ever adds to it, so
+// updates are uncontended relaxed increments on a cache line that no other
+// thread writes. Scrapes sum all shards.
+#define METRICS_SHARDS 64
+
+// HDR style log-linear histogram over microseconds: values below
+// HIST_SUB_BUCKETS get their own bucket, above that every power of two is
+// split into HIST_SUB_BUCKETS buckets (~25% relative error).
+#define HIST_SUB_BITS    2
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     100
+
+typedef struct {
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t sum;
+} histogram_t;
+
+typedef struct {
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    _Atomic int64_t gauges[METRIC_GAUGES];
+    histogram_t hists[METRIC_HISTOGRAMS];
+} __attribute__((aligned(64))) metric_shard_t;
+
+static const struct {
+    const char* name;
+    const char* help;
+} counter_info[METRIC_COUNTERS] = {
+    {"proxy_requests_total", "Requests received"},
+    {"proxy_cache_hits_total", "Requests served from the cache"},
+    {"proxy_cache_misses_total", "Requests forwarded to the origin"},
+    {"proxy_bytes_in_total", "Bytes read from clients"},
+    {"proxy_bytes_out_total", "Bytes written to clients"},
+    {"proxy_upstream_errors_total", "Failed origin connections or requests"},
+    {"proxy_disk_hits_total", "Requests served from the disk tier"},
+    {"proxy_compressed_total", "Compressed variants created"},
+    {"proxy_upstream_reused_total", "Requests sent over a kept alive origin connection"},
+    {"proxy_tunnel_bytes_up_total", "Bytes tunnelled from clients to origins"},
+    {"proxy_tunnel_bytes_down_total", "Bytes tunnelled from origins to clients"},
+    {"proxy_tunnel_timeouts_total", "Tunnels closed for being idle"},
+    {"proxy_timeouts_total", "Requests cut off by a deadline"},
+    {"proxy_connections_rejected_total", "Connections turned away over a connection limit"},
+    {"proxy_requests_shed_total", "Requests that needed the origin turned away"},
+    {"proxy_requests_rate_limited_total", "Requests over their client's rate limit"},
+    {"proxy_spool_spills_total", "Read ahead responses that spilled to a temp file"},
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} gauge_info[METRIC_GAUGES] = {
+    {"proxy_active_connections", "Open client connections"},
+    {"proxy_worker_queue_depth", "Dispatched requests waiting for a worker"},
+    {"proxy_workers_busy", "Workers processing a request"},
+    {"proxy_client_buffered_bytes", "Response bytes waiting for slow clients"},
+    {"proxy_spooled_bytes", "Response bytes read ahead of slow clients"},
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} hist_info[METRIC_HISTOGRAMS] = {
+    {"proxy_request_duration_seconds", "Time from accept to the last response byte"},
+    {"proxy_first_byte_seconds", "Time from accept to the first response byte"},
+    {"proxy_upstream_connect_seconds", "Time to connect to the origin"},
+    {"proxy_accept_latency_seconds", "Time from the accept loop waking up to the accept"},
+};
+
+static metric_shard_t shards[METRICS_SHARDS];
+static _Atomic unsigned int next_shard = 0;
+static __thread metric_shard_t* my_shard = NULL;
+
+static metric_shard_t* shard__(void) {
+    if (my_shard == NULL) {
+        my_shard = &shards[atomic_fetch_add(&next_shard, 1) % METRICS_SHARDS];
+    }
+    return my_shard;
+}
+
+static unsigned int bucket_index__(uint64_t us) {
+    if (us < HIST_SUB_BUCKETS) {
+        return us;
+    }
+
+    unsigned int shift = 63 - __builtin_clzll(us) - HIST_SUB_BITS;
+    unsigned int idx = (shift + 1) * HIST_SUB_BUCKETS + ((us >> shift) - HIST_SUB_BUCKETS);
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static uint64_t bucket_upper__(unsigned int idx) {
+    if (idx < HIST_SUB_BUCKETS) {
+        return idx;
+    }
+
+    unsigned int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t mantissa = idx % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void metrics_inc(metric_counter_t counter, uint64_t n) {
+    atomic_fetch_add_explicit(&shard__()->counters[counter], n, memory_order_relaxed);
+}
+
+void metrics_gauge_add(metric_gauge_t gauge, int64_t n) {
+    atomic_fetch_add_explicit(&shard__()->gauges[gauge], n, memory_order_relaxed);
+}
+
+void metrics_observe(metric_hist_t hist, uint64_t us) {
+    histogram_t* h = &shard__()->hists[hist];
+    atomic_fetch_add_explicit(&h->buckets[bucket_index__(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+}
+
+void metrics_record_request(const access_record_t* record) {
+    metrics_inc(COUNTER_REQUESTS, 1);
+    metrics_inc(COUNTER_BYTES_IN, record->bytes_in);
+    metrics_inc(COUNTER_BYTES_OUT, record->bytes_out);
+
+    if (record->cache == CACHE_HIT || record->cache == CACHE_COLLAPSED ||
+        record->cache == CACHE_DISK) {
+        metrics_inc(COUNTER_CACHE_HITS, 1);
+    } else if (record->cache == CACHE_MISS) {
+        metrics_inc(COUNTER_CACHE_MISSES, 1);
+    }
+    if (record->cache == CACHE_DISK) {
+        metrics_inc(COUNTER_DISK_HITS, 1);
+    }
+
+    if (record->last_byte_us != 0) {
+        metrics_observe(HIST_REQUEST, record->last_byte_us);
+    }
+    if (record->first_byte_us != 0) {
+        metrics_observe(HIST_FIRST_BYTE, record->first_byte_us);
+    }
+    if (record->connect_us != 0 && record->connect_us >= record->lookup_us) {
+        metrics_observe(HIST_UPSTREAM_CONNECT, record->connect_us - record->lookup_us);
+    }
+}
+
+void metrics_write_value(FILE* out, const char* name, const char* type, const char* help,
+                         uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name,
+            (unsigned long long)value);
+}
+
+void metrics_write(FILE* out) {
+    for (int m = 0; m < METRIC_COUNTERS; m++) {
+        uint64_t total = 0;
+        for (int s = 0; s < METRICS_SHARDS; s++) {
+            total += atomic_load_explicit(&shards[s].counters[m], memory_order_relaxed);
+        }
+        metrics_write_value(out, counter_info[m].name, "counter", counter_info[m].help, total);
+    }
+
+    for (int m = 0; m < METRIC_GAUGES; m++) {
+        int64_t total = 0;
+        for (int s = 0; s < METRICS_SHARDS; s++) {
+            total += atomic_load_explicit(&shards[s].gauges[m], memory_order_relaxed);
+        }
+        // increments and decrements race with the scrape across shards
+        metrics_write_value(out, gauge_info[m].name, "gauge", gauge_info[m].help,
+                            total < 0 ? 0 : total);
+    }
+
+    for (int m = 0; m < METRIC_HISTOGRAMS; m++) {
+        uint64_t buckets[HIST_BUCKETS] = {0};
+        uint64_t sum = 0, count = 0;
+        const char* name = hist_info[m].name;
+
+        for (int s = 0; s < METRICS_SHARDS; s++) {
+            histogram_t* h = &shards[s].hists[m];
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+            }
+            sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        }
+
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, hist_info[m].help, name);
+        for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+            count += buckets[b];
+            fprintf(out, "%s_bucket{le=\"%.6f\"} %llu\n", name, bucket_upper__(b) / 1e6,
+                    (unsigned long long)count);
+        }
+        count += buckets[HIST_BUCKETS - 1];
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+        fprintf(out, "%s_sum %.6f\n%s_count %llu\n", name, sum / 1e6, name,
+                (unsigned long long)count);
+    }
+}
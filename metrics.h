@@ -0,0 +1,58 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "accesslog.h"
+
+#define METRICS_PATH "/__proxy/metrics"
+
+typedef enum {
+    COUNTER_REQUESTS,
+    COUNTER_CACHE_HITS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BYTES_IN,
+    COUNTER_BYTES_OUT,
+    COUNTER_UPSTREAM_ERRORS,
+    COUNTER_DISK_HITS,
+    COUNTER_COMPRESSED,
+    COUNTER_UPSTREAM_REUSED,
+    COUNTER_TUNNEL_BYTES_UP,
+    COUNTER_TUNNEL_BYTES_DOWN,
+    COUNTER_TUNNEL_TIMEOUTS,
+    COUNTER_TIMEOUTS,
+    COUNTER_REJECTED,
+    COUNTER_SHED,
+    COUNTER_RATE_LIMITED,
+    COUNTER_SPOOL_SPILLS,
+    METRIC_COUNTERS,
+} metric_counter_t;
+
+// gauges are kept as per shard deltas and summed on read
+typedef enum {
+    GAUGE_ACTIVE_CONNECTIONS,
+    GAUGE_QUEUE_DEPTH,
+    GAUGE_WORKERS_BUSY,
+    GAUGE_CLIENT_BUFFERED,
+    GAUGE_SPOOLED,
+    METRIC_GAUGES,
+} metric_gauge_t;
+
+typedef enum {
+    HIST_REQUEST,
+    HIST_FIRST_BYTE,
+    HIST_UPSTREAM_CONNECT,
+    HIST_ACCEPT,
+    METRIC_HISTOGRAMS,
+} metric_hist_t;
+
+void metrics_inc(metric_counter_t counter, uint64_t n);
+void metrics_gauge_add(metric_gauge_t gauge, int64_t n);
+void metrics_observe(metric_hist_t hist, uint64_t us);
+void metrics_record_request(const access_record_t* record);
+void metrics_write(FILE* out);
+void metrics_write_value(FILE* out, const char* name, const char* type, const char* help,
+                         uint64_t value);
+
+#endif
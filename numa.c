@@ -0,0 +1,145 @@
+#include "numa.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+// CPU placement. The nodes and their cpus come from sysfs, limited to the
+// cpus the proxy may run on, so a node it cannot use does not count. Without
+// sysfs all cpus are one node. Memory is not bound explicitly: a thread
+// pinned to a node gets its fresh pages there by first touch.
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+static numa_node_t nodes[NUMA_MAX_NODES];
+static size_t n_nodes;
+
+typedef struct {
+    unsigned int node;
+    void (*fn)(void* arg);
+    void* arg;
+} numa_job_t;
+
+static bool cpu_set__(const unsigned long* mask, unsigned int cpu) {
+    return (mask[cpu / BITS_PER_LONG] >> (cpu % BITS_PER_LONG)) & 1;
+}
+
+static void add_cpu__(numa_node_t* node, unsigned int cpu) {
+    node->mask[cpu / BITS_PER_LONG] |= 1UL << (cpu % BITS_PER_LONG);
+    node->cpus[node->n_cpus++] = cpu;
+}
+
+// a cpulist such as "0-3,8-11"
+static void parse_cpulist__(const char* list, const unsigned long* allowed, numa_node_t* node) {
+    char* end;
+
+    while (*list >= '0' && *list <= '9') {
+        unsigned long first = strtoul(list, &end, 10), last = first;
+        if (*end == '-') {
+            last = strtoul(end + 1, &end, 10);
+        }
+        for (unsigned long cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; cpu++) {
+            if (cpu_set__(allowed, cpu)) {
+                add_cpu__(node, cpu);
+            }
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+static bool set_affinity__(const unsigned long* mask) {
+    return syscall(SYS_sched_setaffinity, 0, sizeof(nodes[0].mask), mask) == 0;
+}
+
+bool numa_init(void) {
+    unsigned long allowed[NUMA_MAX_CPUS / BITS_PER_LONG] = {0};
+    char path[128], line[4096];
+
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) < 0) {
+        log_error("ERROR", "Failed to get the cpus of the proxy\n");
+        return false;
+    }
+    for (int id = 0; id < NUMA_MAX_NODES; id++) {
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", NUMA_SYSFS, id);
+        FILE* f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (fgets(line, sizeof(line), f) != NULL) {
+            parse_cpulist__(line, allowed, &nodes[n_nodes]);
+        }
+        fclose(f);
+        if (nodes[n_nodes].n_cpus > 0) {
+            n_nodes++;
+        }
+    }
+    if (n_nodes == 0) {
+        for (unsigned int cpu = 0; cpu < NUMA_MAX_CPUS; cpu++) {
+            if (cpu_set__(allowed, cpu)) {
+                add_cpu__(&nodes[0], cpu);
+            }
+        }
+        n_nodes = 1;
+    }
+    return true;
+}
+
+size_t numa_nodes(void) {
+    return n_nodes;
+}
+
+size_t numa_cpus(void) {
+    size_t n = 0;
+    for (size_t i = 0; i < n_nodes; i++) {
+        n += nodes[i].n_cpus;
+    }
+    return n;
+}
+
+// pins the calling thread to the i-th core. consecutive i go to different
+// nodes, so a few event loops spread over all of them. returns the node,
+// -1 on failure
+int numa_pin_core(unsigned int i) {
+    unsigned long mask[NUMA_MAX_CPUS / BITS_PER_LONG] = {0};
+    unsigned int node = i % n_nodes;
+    unsigned int cpu = nodes[node].cpus[(i / n_nodes) % nodes[node].n_cpus];
+
+    mask[cpu / BITS_PER_LONG] = 1UL << (cpu % BITS_PER_LONG);
+    if (!set_affinity__(mask)) {
+        log_error("ERROR", "Failed to pin a thread to cpu %u\n", cpu);
+        return -1;
+    }
+    return node;
+}
+
+// lets the calling thread run on any core of node
+bool numa_pin_node(unsigned int node) {
+    return node < n_nodes && set_affinity__(nodes[node].mask);
+}
+
+static void* run__(void* arg) {
+    numa_job_t* job = arg;
+
+    // memory from elsewhere still works, fn runs anyway
+    numa_pin_node(job->node);
+    job->fn(job->arg);
+    return NULL;
+}
+
+// runs fn(arg) on node and waits for it, so what fn allocates first is
+// node local memory
+bool numa_run_on(unsigned int node, void (*fn)(void* arg), void* arg) {
+    numa_job_t job = {.node = node, .fn = fn, .arg = arg};
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, run__, &job) != 0) {
+        return false;
+    }
+    pthread_join(tid, NULL);
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS  1024
+#define NUMA_SYSFS     "/sys/devices/system/node"
+
+// the cpus of one node the proxy may run on, as a sched_setaffinity() mask
+typedef struct {
+    unsigned long mask[NUMA_MAX_CPUS / (8 * sizeof(unsigned long))];
+    unsigned int cpus[NUMA_MAX_CPUS];
+    size_t n_cpus;
+} numa_node_t;
+
+bool numa_init(void);
+size_t numa_nodes(void);
+size_t numa_cpus(void);
+int numa_pin_core(unsigned int i);
+bool numa_pin_node(unsigned int node);
+bool numa_run_on(unsigned int node, void (*fn)(void* arg), void* arg);
+
+#endif
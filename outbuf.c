@@ -0,0 +1,118 @@
+#include "outbuf.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+// Output buffers for non-blocking client sockets. Writes go straight to
+// the socket while nothing is pending; what it does not take is appended
+// here and sent by outbuf_flush() once the socket is writable again. The
+// owner bounds the buffer by waiting once it holds OUTBUF_LIMIT.
+
+static bool append__(outbuf_t* out, const char* data, size_t n) {
+    if (n == 0) {
+        return true;
+    }
+    if (out->start > 0 && out->start + out->len + n > out->cap) {
+        memmove(out->data, out->data + out->start, out->len);
+        out->start = 0;
+    }
+    if (out->len + n > out->cap) {
+        size_t cap = out->cap * 2 > out->len + n ? out->cap * 2 : out->len + n;
+        char* data_new = realloc(out->data, cap);
+        if (data_new == NULL) {
+            return false;
+        }
+        out->data = data_new;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->start + out->len, data, n);
+    out->len += n;
+    metrics_gauge_add(GAUGE_CLIENT_BUFFERED, n);
+    return true;
+}
+
+// sends iov, buffering what the socket does not take. false when the
+// client is gone
+bool outbuf_writev(outbuf_t* out, int fd, const struct iovec* iov, int n) {
+    struct msghdr msg = {.msg_iov = (struct iovec*)iov, .msg_iovlen = n};
+    ssize_t written = 0;
+
+    if (out->len > 0 && !outbuf_flush(out, fd)) {
+        return false;
+    }
+    // bytes must not overtake what is still buffered
+    if (out->len == 0) {
+        while ((written = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+        }
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            written = 0;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        size_t skip = (size_t)written < iov[i].iov_len ? (size_t)written : iov[i].iov_len;
+        written -= skip;
+        if (!append__(out, (char*)iov[i].iov_base + skip, iov[i].iov_len - skip)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// sends what is buffered until the socket would block. false when the
+// client is gone
+bool outbuf_flush(outbuf_t* out, int fd) {
+    while (out->len > 0) {
+        ssize_t n = send(fd, out->data + out->start, out->len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n < 0) {
+            return false;
+        }
+        out->start += n;
+        out->len -= n;
+        metrics_gauge_add(GAUGE_CLIENT_BUFFERED, -n);
+    }
+    outbuf_free(out);
+    return true;
+}
+
+// buffers iov without sending any of it, someone else sends the buffer
+bool outbuf_append(outbuf_t* out, const struct iovec* iov, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!append__(out, iov[i].iov_base, iov[i].iov_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// drops the first n buffered bytes, which were sent from the buffer as it is
+void outbuf_sent(outbuf_t* out, size_t n) {
+    out->start += n;
+    out->len -= n;
+    metrics_gauge_add(GAUGE_CLIENT_BUFFERED, -(int64_t)n);
+    if (out->len == 0) {
+        outbuf_free(out);
+    }
+}
+
+size_t outbuf_pending(const outbuf_t* out) {
+    return out->len;
+}
+
+void outbuf_free(outbuf_t* out) {
+    metrics_gauge_add(GAUGE_CLIENT_BUFFERED, -(int64_t)out->len);
+    free(out->data);
+    memset(out, 0, sizeof(*out));
+}
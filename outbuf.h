@@ -0,0 +1,29 @@
+#ifndef __OUTBUF_H__
+#define __OUTBUF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// past this many bytes a writer waits for the client
+#define OUTBUF_LIMIT         (256 * 1024)
+// the kernel keeps this much unsent for a client, the rest waits here
+#define CLIENT_NOTSENT_LOWAT (64 * 1024)
+
+// what a client socket did not take yet. memory is only held while
+// something is pending
+typedef struct {
+    char* data;
+    size_t start;
+    size_t len;
+    size_t cap;
+} outbuf_t;
+
+bool outbuf_writev(outbuf_t* out, int fd, const struct iovec* iov, int n);
+bool outbuf_flush(outbuf_t* out, int fd);
+bool outbuf_append(outbuf_t* out, const struct iovec* iov, int n);
+void outbuf_sent(outbuf_t* out, size_t n);
+size_t outbuf_pending(const outbuf_t* out);
+void outbuf_free(outbuf_t* out);
+
+#endif
@@ -0,0 +1,90 @@
+#include "pool.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Idle keep-alive connections to origins. A connection is owned by the pool
+// only while idle; pool_get() hands it out and the caller gives it back with
+// pool_put() after a response that left it reusable.
+
+static pool_conn_t conns[POOL_SIZE];
+static size_t n_idle;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void take__(size_t i) {
+    conns[i] = conns[n_idle - 1];
+    n_idle -= 1;
+}
+
+// an idle origin connection only becomes readable when the origin closed it
+static bool alive__(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// returns an idle connection to host:port, or -1 if there is none
+int pool_get(const char* host, int port) {
+    time_t now = time(NULL);
+    int fd = -1;
+
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < n_idle && fd < 0;) {
+        pool_conn_t* conn = &conns[i];
+        if (now - conn->idle_since >= POOL_IDLE_TIMEOUT || !alive__(conn->fd)) {
+            close(conn->fd);
+            take__(i);
+            continue;
+        }
+        if (conn->port == port && strcmp(conn->host, host) == 0) {
+            fd = conn->fd;
+            take__(i);
+            break;
+        }
+        i++;
+    }
+    pthread_mutex_unlock(&mutex);
+    return fd;
+}
+
+// keeps fd for the next request to host:port. the connection idle the
+// longest makes room when the pool is full
+void pool_put(const char* host, int port, int fd) {
+    pthread_mutex_lock(&mutex);
+    if (n_idle == POOL_SIZE) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < n_idle; i++) {
+            if (conns[i].idle_since < conns[oldest].idle_since) {
+                oldest = i;
+            }
+        }
+        close(conns[oldest].fd);
+        take__(oldest);
+    }
+
+    pool_conn_t* conn = &conns[n_idle++];
+    strncpy(conn->host, host, sizeof(conn->host) - 1);
+    conn->host[sizeof(conn->host) - 1] = '\0';
+    conn->port = port;
+    conn->fd = fd;
+    conn->idle_since = time(NULL);
+    pthread_mutex_unlock(&mutex);
+}
+
+size_t pool_idle(void) {
+    pthread_mutex_lock(&mutex);
+    size_t n = n_idle;
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+void pool_close(void) {
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < n_idle; i++) {
+        close(conns[i].fd);
+    }
+    n_idle = 0;
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,26 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "http.h"
+
+#define POOL_SIZE         64
+#define POOL_IDLE_TIMEOUT 30 /* seconds */
+
+// an idle origin connection that can carry the next request
+typedef struct {
+    char host[SMALL_MAXSIZE];
+    int port;
+    int fd;
+    time_t idle_since;
+} pool_conn_t;
+
+int pool_get(const char* host, int port);
+void pool_put(const char* host, int port, int fd);
+size_t pool_idle(void);
+void pool_close(void);
+
+#endif
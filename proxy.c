@@ -1,37 +1,135 @@
 #include "proxy.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
+#include <strings.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
+#include "accesslog.h"
+#include "admit.h"
 #include "cache.h"
+#include "chunked.h"
 #include "csapp.h"
+#include "disk.h"
+#include "fill.h"
+#include "http.h"
 #include "logger.h"
+#include "metrics.h"
+#include "numa.h"
+#include "outbuf.h"
+#include "pool.h"
+#include "pump.h"
+#include "ratelimit.h"
+#include "shmcache.h"
+#include "snapshot.h"
+#include "spool.h"
 #include "string.h"
+#include "tcpopt.h"
+#include "timer.h"
+#include "tunnel.h"
+#include "uring.h"
 
-#define MIN(a, b)       ((a) < (b) ? (a) : (b))
-#define HTTP_VER_STRING "HTTP/1.0"
+#define HTTP_VER_STRING "HTTP/1.1"
 #define MAX_EVENTS      100
+#define ACCEPT_BATCH    64
+// what an io_uring completion is for. a plain fd is a poll for a request,
+// reads also carry their buffer from bit 40 on
+#define URING_ACCEPT     (1ULL << 32)
+#define URING_WAKE       (2ULL << 32)
+#define URING_TIMEOUT    (3ULL << 32)
+#define URING_UNTIMEOUT  (4ULL << 32)
+#define URING_HANDBACK   (5ULL << 32)
+#define URING_READ       (6ULL << 32)
+#define URING_SEND       (7ULL << 32)
+#define URING_RETRY      (8ULL << 32)
+#define URING_STOP       (9ULL << 32)
+#define URING_WRITABLE   (10ULL << 32)
+#define URING_KIND(data) (((data) >> 32) & 0xff)
 
 /* You won't lose style points for including this long line in your code */
 static const char* user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
-static cache* http_cache;
-static pthread_mutex_t mutex;
+static sharded_cache* http_cache;
+static char* snapshot_path = NULL;
+static shm_cache* shared_cache = NULL;
+static bool range_fill = false;
+static bool use_uring = false;
+static long n_acceptors = 1;
+static char* rate_key_header = NULL;
+static bool pin_threads = false;
+static handback_t handback = {.mutex = PTHREAD_MUTEX_INITIALIZER, .wake_fd = -1};
+// readable once SIGINT or SIGTERM came in, every event loop then returns
+static int stop_fd = -1;
+// the workers that are still running, shutdown__() waits for them
+static atomic_long workers;
 int main(int argc, char** argv) {
     int c = 0;
     int option_index = 0;
-    context_t ctx;
+    context_t ctx = {0};
+    char* access_log_path = NULL;
+    char* disk_path = NULL;
+    size_t disk_size = DISK_DEFAULT_SIZE;
+    char* shared_name = NULL;
+    size_t shared_size = SHM_DEFAULT_SIZE;
+    unsigned int snapshot_interval = 0;
+    unsigned long interval;
+    char* end;
+    unsigned int tunnel_timeout = TUNNEL_IDLE_TIMEOUT;
+    long max_connections = -1, max_per_client = 0, max_fetches = 0;
+    long rate = 0;
+    size_t rate_bytes = 0;
+    char* spool_dir = NULL;
+    size_t spool_memory = 0;
+    char tcp[MAXLINE];
+    struct rlimit rl;
+    size_t cache_size = MAX_CACHE_SIZE, max_object_size = MAX_OBJECT_SIZE, shard_size = 0;
+    long n_shards = 1;
+    bool numa_shards = false;
 
     static struct option long_options[] = {{"host", required_argument, 0, 'h'},
                                            {"port", required_argument, 0, 'p'},
+                                           {"access-log", required_argument, 0, 'l'},
+                                           {"cache-size", required_argument, 0, 'c'},
+                                           {"max-object-size", required_argument, 0, 'o'},
+                                           {"cache-shards", required_argument, 0, 'n'},
+                                           {"shard-size", required_argument, 0, 'S'},
+                                           {"disk-cache", required_argument, 0, 'd'},
+                                           {"disk-size", required_argument, 0, 'D'},
+                                           {"snapshot", required_argument, 0, 's'},
+                                           {"snapshot-interval", required_argument, 0, 'i'},
+                                           {"shared-cache", required_argument, 0, 'm'},
+                                           {"shared-size", required_argument, 0, 'M'},
+                                           {"range-fill", no_argument, 0, 'r'},
+                                           {"tunnel-timeout", required_argument, 0, 'T'},
+                                           {"connect-ports", required_argument, 0, 'X'},
+                                           {"backend", required_argument, 0, 'b'},
+                                           {"acceptors", required_argument, 0, 'a'},
+                                           {"max-connections", required_argument, 0, 'C'},
+                                           {"max-per-client", required_argument, 0, 'P'},
+                                           {"max-fetches", required_argument, 0, 'F'},
+                                           {"rate", required_argument, 0, 'R'},
+                                           {"rate-bytes", required_argument, 0, 'B'},
+                                           {"rate-key", required_argument, 0, 'K'},
+                                           {"buffer", required_argument, 0, 'w'},
+                                           {"buffer-dir", required_argument, 0, 'W'},
+                                           {"tcp", required_argument, 0, 't'},
+                                           {"affinity", no_argument, 0, 'A'},
+                                           {"numa-shards", no_argument, 0, 'N'},
                                            {"help", no_argument, 0, '?'},
                                            {0, 0, 0, 0}};
 
-    while ((c = getopt_long(argc, argv, "h:p:?", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "h:p:l:c:o:n:S:d:D:s:i:m:M:rT:X:b:a:C:P:F:R:B:K:w:W:t:AN?", long_options, &option_index)) != -1) {
         switch (c) {
             case 0:
                 break;
@@ -42,6 +140,149 @@ int main(int argc, char** argv) {
             case 'p':
                 strncpy(ctx.default_port, optarg, MAXLINE - 1);
                 break;
+            case 'l':
+                access_log_path = optarg;
+                break;
+            case 'c':
+                if (!parse_size(optarg, &cache_size)) {
+                    fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                if (!parse_size(optarg, &max_object_size)) {
+                    fprintf(stderr, "Invalid object size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                n_shards = atol(optarg);
+                if (n_shards <= 0) {
+                    fprintf(stderr, "Invalid number of cache shards: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                if (!parse_size(optarg, &shard_size)) {
+                    fprintf(stderr, "Invalid shard size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                disk_path = optarg;
+                break;
+            case 'D':
+                if (!parse_size(optarg, &disk_size)) {
+                    fprintf(stderr, "Invalid disk cache size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'i':
+                interval = strtoul(optarg, &end, 10);
+                if (!isdigit((unsigned char)*optarg) || *end != '\0' || interval > UINT_MAX) {
+                    fprintf(stderr, "Invalid snapshot interval: %s\n", optarg);
+                    exit(1);
+                }
+                snapshot_interval = interval;
+                break;
+            case 'm':
+                shared_name = optarg;
+                break;
+            case 'M':
+                if (!parse_size(optarg, &shared_size)) {
+                    fprintf(stderr, "Invalid shared cache size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                range_fill = true;
+                break;
+            case 'T':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Invalid tunnel timeout: %s\n", optarg);
+                    exit(1);
+                }
+                tunnel_timeout = atoi(optarg);
+                break;
+            case 'X':
+                if (!tunnel_ports(optarg)) {
+                    fprintf(stderr, "Invalid CONNECT ports: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                if (strcmp(optarg, "uring") != 0 && strcmp(optarg, "epoll") != 0) {
+                    fprintf(stderr, "Invalid backend: %s\n", optarg);
+                    exit(1);
+                }
+                use_uring = strcmp(optarg, "uring") == 0;
+                break;
+            case 'a':
+                n_acceptors = atol(optarg);
+                if (n_acceptors <= 0) {
+                    fprintf(stderr, "Invalid number of acceptors: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                if ((max_connections = atol(optarg)) < 0) {
+                    fprintf(stderr, "Invalid connection limit: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                if ((max_per_client = atol(optarg)) < 0) {
+                    fprintf(stderr, "Invalid per client limit: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'F':
+                if ((max_fetches = atol(optarg)) < 0) {
+                    fprintf(stderr, "Invalid fetch limit: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'R':
+                if ((rate = atol(optarg)) < 0) {
+                    fprintf(stderr, "Invalid rate: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                if (!parse_size(optarg, &rate_bytes)) {
+                    fprintf(stderr, "Invalid byte rate: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'K':
+                rate_key_header = optarg;
+                break;
+            case 'w':
+                if (!parse_size(optarg, &spool_memory) || spool_memory == 0) {
+                    fprintf(stderr, "Invalid buffer size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'W':
+                spool_dir = optarg;
+                break;
+            case 't':
+                if (!tcpopt_parse(optarg)) {
+                    fprintf(stderr, "Invalid TCP options: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'A':
+                pin_threads = true;
+                break;
+            case 'N':
+                // shards are picked by the node a thread is pinned to
+                numa_shards = true;
+                pin_threads = true;
+                break;
             case '?':
                 print_usage(argv[0]);
                 exit(0);
@@ -80,13 +321,133 @@ int main(int argc, char** argv) {
         unix_error("Failed to set sigpipe handler");
     }
 
+    if ((stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        unix_error("Failed to create the stop event");
+    }
     if (Signal(SIGINT, sigint_handler) == SIG_ERR) {
         unix_error("Failed to set sigint handler");
     }
 
-    pthread_mutex_init(&mutex, NULL);
-    http_cache = create_cache();
+    // deploys stop the proxy with SIGTERM, which should also save the cache
+    if (Signal(SIGTERM, sigint_handler) == SIG_ERR) {
+        unix_error("Failed to set sigterm handler");
+    }
+
+    if (access_log_path != NULL) {
+        if (!accesslog_open(access_log_path)) {
+            exit(1);
+        }
+        log_info("INFO", "access log: %s\n", access_log_path);
+    }
+
+    ctx.max_conns = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        ctx.max_conns = rl.rlim_cur;
+    }
+    // fds at or above it are turned away by accepted__()
+    if (ctx.max_conns > MAX_CONNS) {
+        ctx.max_conns = MAX_CONNS;
+    }
+    if ((ctx.conns = calloc(ctx.max_conns, sizeof(conn_t))) == NULL) {
+        unix_error("Failed to allocate the connection table");
+    }
+    ctx.node = -1;
+
+    // a connection may need an origin socket too
+    if (max_connections < 0) {
+        max_connections = ctx.max_conns / 2;
+    }
+    admit_init(max_connections, max_per_client, max_fetches);
+    log_info("INFO", "limits: %ld connections, %ld per client, %ld fetches (0 is none)\n",
+             max_connections, max_per_client, max_fetches);
+
+    if (pin_threads) {
+        if (!numa_init()) {
+            exit(1);
+        }
+        log_info("INFO", "affinity: %zu node(s), %zu cpu(s)\n", numa_nodes(), numa_cpus());
+    }
+    // threads store into their own node's shards only, so every node needs
+    // an event loop: -N raises -a to the number of nodes. io_uring has one
+    // loop, its cache stays whole
+    if (numa_shards && numa_nodes() > 1 && use_uring) {
+        log_warn("WARN", "io_uring runs one event loop, the cache is not split over nodes\n");
+        numa_shards = false;
+    }
+    // every node gets the same number of shards
+    if (numa_shards && numa_nodes() > 1) {
+        n_shards = (n_shards + numa_nodes() - 1) / numa_nodes() * numa_nodes();
+        if (n_acceptors < (long)numa_nodes()) {
+            log_info("INFO", "affinity: %zu event loops, one per node\n", numa_nodes());
+            n_acceptors = numa_nodes();
+        }
+    }
+
+    // the per shard budget wins over the total when both are given
+    if (shard_size == 0) {
+        shard_size = cache_size / n_shards;
+    }
+    if (shard_size < max_object_size) {
+        log_warn("WARN", "Objects larger than the shard size (%zu) will not be cached\n",
+                 shard_size);
+    }
+    http_cache = create_sharded_cache(n_shards, shard_size, max_object_size);
+    log_info("INFO", "cache: %ld shard(s) of %zu bytes, objects up to %zu bytes\n", n_shards,
+             shard_size, max_object_size);
+    // each node builds its shards in its own memory
+    if (numa_shards && numa_nodes() > 1) {
+        cache_split_nodes(http_cache, numa_nodes());
+        for (size_t node = 0; node < numa_nodes(); node++) {
+            numa_run_on(node, localize_shards__, (void*)(uintptr_t)node);
+        }
+        log_info("INFO", "cache: shards split over %zu nodes\n", numa_nodes());
+    }
+
+    // processes started with the same name share one cache; new objects go
+    // there instead of the private cache
+    if (shared_name != NULL) {
+        if ((shared_cache = shm_cache_open(shared_name, shared_size)) == NULL) {
+            exit(1);
+        }
+        log_info("INFO", "shared cache: %s\n", shared_name);
+    }
+
+    if (disk_path != NULL) {
+        if (!disk_open(disk_path, disk_size, max_object_size)) {
+            exit(1);
+        }
+        cache_set_evict_hook(http_cache, disk_evict_hook, NULL);
+        log_info("INFO", "disk cache: %s (%zu bytes)\n", disk_path, disk_size);
+    }
+
+    if (snapshot_path != NULL) {
+        snapshot_load(snapshot_path);
+        if (snapshot_interval > 0) {
+            snapshot_schedule(snapshot_path, http_cache, snapshot_interval);
+        }
+        log_info("INFO", "snapshot: %s (every %us)\n", snapshot_path, snapshot_interval);
+    }
+    if (!timer_init() || !tunnel_start(tunnel_timeout)) {
+        exit(1);
+    }
+    tcpopt_describe(tcp, sizeof(tcp));
+    log_info("INFO", "tcp: %s\n", tcp);
+    tunnel_describe_ports(tcp, sizeof(tcp));
+    log_info("INFO", "CONNECT ports: %s\n", tcp);
+    ratelimit_init(rate, rate_bytes);
+    if (ratelimit_enabled()) {
+        log_info("INFO", "rate limit: %ld requests, %zu bytes per second per %s\n", rate,
+                 rate_bytes, rate_key_header != NULL ? rate_key_header : "address");
+    }
+    // slow clients then do not hold origin connections, responses are read
+    // ahead of them
+    if (spool_memory > 0) {
+        spool_enable(spool_dir, spool_memory);
+        log_info("INFO", "buffering: %zu bytes in memory, then %s\n", spool_memory,
+                 spool_dir != NULL ? spool_dir : SPOOL_DEFAULT_DIR);
+    }
     start_proxy(argv[port_idx], &ctx);
+    shutdown__(&ctx);
 }
 
 void print_usage(char* program) {
@@ -94,39 +455,160 @@ void print_usage(char* program) {
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -h, --host=HOST      Set the default host of remote host\n");
     fprintf(stderr, "  -p, --port=PORT      Set the default port of remote host\n");
+    fprintf(stderr, "  -l, --access-log=FILE  Write binary access log records to FILE\n");
+    fprintf(stderr, "  -c, --cache-size=SIZE  Total cache capacity (default: %d)\n",
+            MAX_CACHE_SIZE);
+    fprintf(stderr, "  -o, --max-object-size=SIZE  Largest cacheable object (default: %d)\n",
+            MAX_OBJECT_SIZE);
+    fprintf(stderr, "  -n, --cache-shards=N   Independently locked cache shards (default: 1)\n");
+    fprintf(stderr, "  -S, --shard-size=SIZE  Per shard budget (default: cache size / shards)\n");
+    fprintf(stderr, "  -d, --disk-cache=FILE  Keep objects evicted from memory in FILE\n");
+    fprintf(stderr, "  -D, --disk-size=SIZE   Disk cache capacity (default: 1G)\n");
+    fprintf(stderr, "  -s, --snapshot=FILE    Save the cache to FILE on exit, reload it on start\n");
+    fprintf(stderr, "  -i, --snapshot-interval=SEC  Also save the cache every SEC seconds\n");
+    fprintf(stderr, "  -m, --shared-cache=NAME  Share the cache with proxies using the same NAME\n");
+    fprintf(stderr, "  -M, --shared-size=SIZE   Shared cache size when creating it (default: 64M)\n");
+    fprintf(stderr, "  -r, --range-fill       Fetch the whole object on a range miss\n");
+    fprintf(stderr, "  -T, --tunnel-timeout=SEC  Close CONNECT tunnels idle for SEC seconds\n");
+    fprintf(stderr, "                         (default: %d)\n", TUNNEL_IDLE_TIMEOUT);
+    fprintf(stderr, "  -X, --connect-ports=LIST  Ports CONNECT may reach, comma separated\n");
+    fprintf(stderr, "                         (default: %s)\n", TUNNEL_DEFAULT_PORTS);
+    fprintf(stderr, "  -b, --backend=NAME     Wait for connections with epoll or uring\n");
+    fprintf(stderr, "                         (default: epoll)\n");
+    fprintf(stderr, "  -a, --acceptors=N      Threads accepting connections, epoll only\n");
+    fprintf(stderr, "                         (default: 1)\n");
+    fprintf(stderr, "  -C, --max-connections=N  Open client connections\n");
+    fprintf(stderr, "                         (default: half the fd limit)\n");
+    fprintf(stderr, "  -P, --max-per-client=N   Open connections per client address\n");
+    fprintf(stderr, "  -F, --max-fetches=N      Requests waiting on the origin\n");
+    fprintf(stderr, "                         a limit of 0 is none, the default for -P and -F\n");
+    fprintf(stderr, "  -R, --rate=N           Origin requests per second per client\n");
+    fprintf(stderr, "  -B, --rate-bytes=SIZE  Origin bytes per second per client\n");
+    fprintf(stderr, "  -K, --rate-key=HEADER  Tell clients apart by HEADER instead of address\n");
+    fprintf(stderr, "  -w, --buffer=SIZE      Read responses ahead of slow clients, up to SIZE\n");
+    fprintf(stderr, "                         of each in memory and the rest in a temp file\n");
+    fprintf(stderr, "  -W, --buffer-dir=DIR   Where those temp files go (default: %s)\n",
+            SPOOL_DEFAULT_DIR);
+    fprintf(stderr, "  -t, --tcp=LIST         TCP options for clients and origins, out of\n");
+    fprintf(stderr, "                         nodelay, quickack, cork, fastopen[=N], defer[=SEC],\n");
+    fprintf(stderr, "                         rcvbuf=SIZE, sndbuf=SIZE, backlog=N or none\n");
+    fprintf(stderr, "                         (default: %s)\n", TCPOPT_DEFAULT);
+    fprintf(stderr, "  -A, --affinity         Pin event loops to cores, their workers to the\n");
+    fprintf(stderr, "                         loop's NUMA node\n");
+    fprintf(stderr, "  -N, --numa-shards      Split the cache shards over NUMA nodes, each\n");
+    fprintf(stderr, "                         thread uses its node's first (implies -A and at\n");
+    fprintf(stderr, "                         least one event loop per node)\n");
+    fprintf(stderr, "                         SIZE accepts K, M and G suffixes\n");
     fprintf(stderr, "  -?, --help           Show this help message\n");
 }
 
 static void start_proxy(char* proxy_port, context_t* ctx) {
-    int listen_fd, client_fd, epoll_fd;
-    struct sockaddr_storage client_addr;
-    socklen_t client_len;
-    char host[MAXLINE], port[MAXLINE];
-    struct epoll_event event, events[MAX_EVENTS];
+    int listen_fd;
+    pthread_t* loops;
+    long n_loops = 1;
 
     listen_fd = Open_listenfd(proxy_port);
+    if (!tcpopt_listener(listen_fd)) {
+        exit(1);
+    }
     log_info("INFO", "The proxy server is listening on port %s\n", proxy_port);
+    // accepts run until the backlog is empty, and with several acceptors
+    // another one may have taken the connection that woke us
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    ctx->listen_fd = listen_fd;
+
+    if (use_uring) {
+        pin_loop__(ctx);
+        serve_uring__(listen_fd, ctx);
+        close(listen_fd);
+        return;
+    }
+
+    // every acceptor has an epoll and clients of its own, this thread also
+    // drives the timer wheel
+    if ((loops = calloc(n_acceptors, sizeof(pthread_t))) == NULL) {
+        unix_error("Failed to allocate the acceptors");
+    }
+    for (; n_loops < n_acceptors; n_loops++) {
+        context_t* copy = malloc(sizeof(context_t));
+        *copy = *ctx;
+        copy->loop = n_loops;
+        if (pthread_create(&loops[n_loops], NULL, acceptor__, copy) != 0) {
+            log_error("ERROR", "Failed to start acceptor %ld\n", n_loops);
+            free(copy);
+            break;
+        }
+    }
+    pin_loop__(ctx);
+    serve_epoll__(ctx, true);
+    // the loops return on a stop, nothing may accept or park after that
+    for (long i = 1; i < n_loops; i++) {
+        pthread_join(loops[i], NULL);
+    }
+    free(loops);
+    close(listen_fd);
+}
+
+static void* acceptor__(void* ctx) {
+    pin_loop__(ctx);
+    serve_epoll__(ctx, false);
+    return NULL;
+}
+
+// an event loop stays on a core of its own and its workers on the cores of
+// the same node, so the memory they touch first and the cache shards they
+// use are local to it
+static void pin_loop__(context_t* ctx) {
+    if (pin_threads && (ctx->node = numa_pin_core(ctx->loop)) >= 0) {
+        cache_local_node = ctx->node;
+    }
+}
+
+static void localize_shards__(void* node) {
+    cache_localize(http_cache, (uintptr_t)node);
+}
+
+static void serve_epoll__(context_t* ctx, bool timers) {
+    int epoll_fd;
+    struct epoll_event event, events[MAX_EVENTS];
 
     epoll_fd = epoll_create1(0);
     ctx->epoll_fd = epoll_fd;
     ctx->events = events;
     if (epoll_fd == -1) {
         log_error("ERROR", "Failed to create epoll\n");
-        close(listen_fd);
         return;
     }
 
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = listen_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+    // level triggered: a wakeup accepts at most ACCEPT_BATCH connections, the
+    // rest of a burst wakes the loop again. with several acceptors a
+    // connection wakes only one of them
+    event.events = EPOLLIN | (n_acceptors > 1 ? EPOLLEXCLUSIVE : 0);
+    event.data.fd = ctx->listen_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ctx->listen_fd, &event) == -1) {
         log_error("ERROR", "Failed to add server socket to epoll");
-        close(listen_fd);
+        close(epoll_fd);
+        return;
+    }
+    // never read, so it wakes every loop
+    event.events = EPOLLIN;
+    event.data.fd = stop_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event) == -1) {
+        log_error("ERROR", "Failed to add the stop event to epoll");
+        close(epoll_fd);
+        return;
+    }
+    // wakes the loop when a worker sets a deadline earlier than it sleeps
+    event.events = EPOLLIN;
+    event.data.fd = timer_wake_fd();
+    if (timers && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_wake_fd(), &event) == -1) {
+        log_error("ERROR", "Failed to add the timer wakeup to epoll");
         close(epoll_fd);
         return;
     }
 
     while (true) {
-        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timers ? timer_next_ms() : -1);
         if (num_events == -1) {
             if (errno == EINTR) {
                 log_warn("WARN", "epoll_wait fails due to interrupt\n");
@@ -135,35 +617,400 @@ static void start_proxy(char* proxy_port, context_t* ctx) {
             log_error("ERROR", "An error in epoll_wait\n");
             exit(1);
         }
+        uint64_t woke_ns = accesslog_now();
 
         for (int i = 0; i < num_events; i++) {
-            if (events[i].data.fd == listen_fd) {
-                client_len = sizeof(client_addr);
-                client_fd = Accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
-
-                int flags = fcntl(client_fd, F_GETFL, 0);
-                fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
-
-                event.events = EPOLLIN | EPOLLET;
-                event.data.fd = client_fd;
-                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
-                    log_error("ERROR", "Failed to add client to epoll\n");
-                    close(client_fd);
-                    continue;
-                }
-
-                Getnameinfo((struct sockaddr*)&client_addr, client_len, host, sizeof(host), port,
-                            sizeof(host), 0);
-                log_info("CONNECT", "%s:%s\n", host, port);
+            // the epoll stays open, workers may still park connections in it
+            if (events[i].data.fd == stop_fd) {
+                return;
+            } else if (events[i].data.fd == ctx->listen_fd) {
+                accept_batch__(ctx, woke_ns);
+            } else if (timers && events[i].data.fd == timer_wake_fd()) {
+                continue;
+            } else if (events[i].events & EPOLLOUT) {
+                flush_conn__(ctx, events[i].data.fd);
             } else {
-                client_fd = events[i].data.fd;
-                threaded_request(client_fd, ctx);
+                threaded_request(events[i].data.fd, ctx, NULL, 0);
             }
         }
+        if (timers) {
+            timer_advance();
+        }
     }
+}
 
-    close(listen_fd);
-    return;
+// accept4() is only declared with _GNU_SOURCE, which csapp.h conflicts with
+static int accept4__(int fd, struct sockaddr* addr, socklen_t* len) {
+    return syscall(SYS_accept4, fd, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+// takes connections off the backlog until it is empty or ACCEPT_BATCH were
+// taken, so clients that are already waiting get their turn in between
+static void accept_batch__(context_t* ctx, uint64_t woke_ns) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_len;
+    struct epoll_event event;
+    int client_fd;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        client_len = sizeof(client_addr);
+        if ((client_fd = accept4__(ctx->listen_fd, (struct sockaddr*)&client_addr,
+                                   &client_len)) < 0) {
+            // the client gave up while it waited in the backlog
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("ERROR", "Failed to accept: %s\n", strerror(errno));
+            }
+            return;
+        }
+        metrics_observe(HIST_ACCEPT, (accesslog_now() - woke_ns) / 1000);
+        if (!accepted__(ctx, client_fd, &client_addr, client_len)) {
+            continue;
+        }
+
+        // one shot: the event that starts a worker disarms the fd, so the
+        // worker owns it until it parks the connection again
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.fd = client_fd;
+        if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            log_error("ERROR", "Failed to add client to epoll\n");
+            close(client_fd);
+        }
+    }
+}
+
+// sets up a new client connection for either backend, the socket already
+// does not block. a connection over a limit gets a 503 and is closed right
+// away, false then
+static bool accepted__(context_t* ctx, int client_fd, struct sockaddr_storage* addr,
+                       socklen_t len) {
+    char host[MAXLINE], port[MAXLINE];
+    uint32_t client_addr = 0;
+
+    if (addr->ss_family == AF_INET) {
+        client_addr = ((struct sockaddr_in*)addr)->sin_addr.s_addr;
+    }
+    if (client_fd >= ctx->max_conns || !admit_conn(client_addr)) {
+        metrics_inc(COUNTER_REJECTED, 1);
+        admit_reject(client_fd);
+        close(client_fd);
+        return false;
+    }
+
+    // the kernel only holds a little of a response the client does not
+    // read, the output buffer the rest
+    int lowat = CLIENT_NOTSENT_LOWAT;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
+    metrics_gauge_add(GAUGE_ACTIVE_CONNECTIONS, 1);
+    conn_t* conn = &ctx->conns[client_fd];
+    conn->accept_ns = accesslog_now();
+    conn->served = 0;
+    conn->client_addr = client_addr;
+    if (addr->ss_family == AF_INET6) {
+        conn->client_key = ratelimit_key(&((struct sockaddr_in6*)addr)->sin6_addr,
+                                         sizeof(struct in6_addr));
+    } else {
+        conn->client_key = ratelimit_key(&client_addr, sizeof(client_addr));
+    }
+
+    // a reverse lookup here would hold up the whole accept batch
+    Getnameinfo((struct sockaddr*)addr, len, host, sizeof(host), port, sizeof(host),
+                NI_NUMERICHOST | NI_NUMERICSERV);
+    log_info("CONNECT", "%s:%s\n", host, port);
+    return true;
+}
+
+static struct io_uring_sqe* next_sqe__(uring_t* ring) {
+    struct io_uring_sqe* sqe;
+
+    // a full ring is handed to the kernel to make room
+    while ((sqe = uring_sqe(ring)) == NULL) {
+        uring_submit(ring, 0);
+    }
+    return sqe;
+}
+
+static void queue_accept__(uring_loop_t* l, unsigned int i) {
+    struct io_uring_sqe* sqe = next_sqe__(&l->ring);
+
+    l->slots[i].idle = false;
+    l->slots[i].len = sizeof(l->slots[i].addr);
+    uring_prep_accept(sqe, l->fixed ? 0 : l->listen_fd, URING_ACCEPT | i);
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->addr = (uint64_t)(uintptr_t)&l->slots[i].addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)&l->slots[i].len;
+    if (l->fixed) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+// an accept that failed for want of fds or memory would fail again right
+// away, it is queued again by a retry ACCEPT_RETRY_MS later
+static void accept_done__(uring_loop_t* l, unsigned int i, int res, uint64_t woke_ns) {
+    static struct __kernel_timespec retry = {.tv_nsec = ACCEPT_RETRY_MS * 1000000L};
+
+    if (l->stopping) {
+        if (res >= 0) {
+            close(res);
+        }
+        return;
+    }
+    if (res >= 0) {
+        metrics_observe(HIST_ACCEPT, (accesslog_now() - woke_ns) / 1000);
+        if (accepted__(l->ctx, res, &l->slots[i].addr, l->slots[i].len)) {
+            queue_read__(l, res);
+        }
+    } else if (res != -ECONNABORTED && res != -EINTR) {
+        l->slots[i].idle = true;
+        if (!l->retry_queued) {
+            log_warn("WARN", "accept failed: %s\n", strerror(-res));
+            uring_prep_timeout(next_sqe__(&l->ring), &retry, URING_RETRY);
+            l->retry_queued = true;
+        }
+        return;
+    }
+    queue_accept__(l, i);
+}
+
+// waits for the next request on fd. with a registered buffer free the
+// kernel reads it, otherwise a poll starts a worker that reads it. a read
+// of a socket that does not block would fail with EAGAIN, so it waits for
+// the socket with a poll linked in front of it that posts no completion
+static void queue_read__(uring_loop_t* l, int fd) {
+    struct io_uring_sqe* sqe = next_sqe__(&l->ring);
+
+    if (l->n_free == 0) {
+        uring_prep_poll(sqe, fd, POLLIN, fd);
+        return;
+    }
+    unsigned int buf = l->free_bufs[--l->n_free];
+    uring_prep_poll(sqe, fd, POLLIN, URING_READ | (uint64_t)buf << 40 | fd);
+    sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    uring_prep_read_fixed(next_sqe__(&l->ring), fd, l->bufs + (size_t)buf * RIO_BUFSIZE,
+                          RIO_BUFSIZE, buf, URING_READ | (uint64_t)buf << 40 | fd);
+}
+
+// a failed poll also cancels its read, both complete then
+static void read_done__(uring_loop_t* l, unsigned int buf, int fd, int res) {
+    if (res == -ECANCELED) {
+        return;
+    }
+    l->free_bufs[l->n_free++] = buf;
+    if (res > 0 && !l->stopping) {
+        threaded_request(fd, l->ctx, l->bufs + (size_t)buf * RIO_BUFSIZE, res);
+    } else {
+        close_conn__(l->ctx, fd);
+    }
+}
+
+// the io_uring version of hand_off__() and park__(): sends what a
+// connection has buffered, then closes it or waits for its next request.
+// the deadlines shut the socket down, which ends the sqe in flight for it
+static void resume__(uring_loop_t* l, int fd) {
+    conn_t* conn = &l->ctx->conns[fd];
+    outbuf_t* out = &conn->out;
+
+    if (outbuf_pending(out) > 0) {
+        timer_add(&conn->idle, IDLE_TIMEOUT, conn_idle__, (void*)(intptr_t)fd);
+        uring_prep_send(next_sqe__(&l->ring), fd, out->data + out->start, out->len,
+                        URING_SEND | fd);
+        conn->sending = true;
+        l->sends++;
+        return;
+    }
+    if (conn->close_after) {
+        close_conn__(l->ctx, fd);
+        return;
+    }
+    timer_add(&conn->idle, KEEPALIVE_TIMEOUT, conn_idle__, (void*)(intptr_t)fd);
+    queue_read__(l, fd);
+}
+
+// a send canceled because the poll for the socket failed fails the
+// connection too. after a stop shutdown__() sends the rest
+static void send_done__(uring_loop_t* l, int fd, int res) {
+    conn_t* conn = &l->ctx->conns[fd];
+
+    timer_cancel(&conn->idle);
+    conn->sending = false;
+    l->sends--;
+    if (res == -EAGAIN) {
+        // the socket is full, the send waits for it
+        struct io_uring_sqe* sqe = next_sqe__(&l->ring);
+        uring_prep_poll(sqe, fd, POLLOUT, URING_WRITABLE | fd);
+        sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        resume__(l, fd);
+        return;
+    }
+    if (res < 0) {
+        close_conn__(l->ctx, fd);
+        return;
+    }
+    outbuf_sent(&conn->out, res);
+    if (!l->stopping) {
+        resume__(l, fd);
+    }
+}
+
+// the connections workers handed back since the last wakeup
+static void handed_back__(uring_loop_t* l) {
+    uint64_t value;
+    int* fds;
+    size_t n;
+
+    while (read(handback.wake_fd, &value, sizeof(value)) > 0) {
+    }
+    pthread_mutex_lock(&handback.mutex);
+    fds = handback.fds;
+    n = handback.len;
+    handback.fds = NULL;
+    handback.len = handback.cap = 0;
+    pthread_mutex_unlock(&handback.mutex);
+
+    for (size_t i = 0; i < n && !l->stopping; i++) {
+        resume__(l, fds[i]);
+    }
+    free(fds);
+    uring_prep_poll(next_sqe__(&l->ring), handback.wake_fd, POLLIN, URING_HANDBACK);
+}
+
+// the io_uring backend. accepts, the reads of requests into registered
+// buffers and the sends of what workers left buffered are sqes; everything
+// the completions of one wait ask for goes to the kernel in the next
+// io_uring_enter(). several accepts stay queued, so a burst of connections
+// completes in one wait. a timeout sqe stands in for the epoll_wait()
+// timeout, it is replaced when a worker needs an earlier one
+static void serve_uring__(int listen_fd, context_t* ctx) {
+    uring_loop_t* l = calloc(1, sizeof(uring_loop_t));
+    struct iovec iov[URING_BUFFERS];
+    struct io_uring_cqe cqe;
+    struct __kernel_timespec ts;
+    bool timeout_queued = false, wake_queued = false;
+    uint64_t stop_ns = 0;
+    int ms;
+
+    ctx->epoll_fd = -1;
+    if (l == NULL || !uring_init(&l->ring, URING_ENTRIES)) {
+        log_error("ERROR", "Failed to set up io_uring\n");
+        free(l);
+        return;
+    }
+    if ((handback.wake_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        log_error("ERROR", "Failed to create the io_uring wakeup\n");
+        uring_exit(&l->ring);
+        free(l);
+        return;
+    }
+    l->ctx = ctx;
+    l->listen_fd = listen_fd;
+    // the listening socket is fixed file 0
+    l->fixed = uring_register_files(&l->ring, &listen_fd, 1);
+    // without registered buffers every request waits with a poll
+    if ((l->bufs = malloc((size_t)URING_BUFFERS * RIO_BUFSIZE)) != NULL) {
+        for (unsigned int i = 0; i < URING_BUFFERS; i++) {
+            iov[i].iov_base = l->bufs + (size_t)i * RIO_BUFSIZE;
+            iov[i].iov_len = RIO_BUFSIZE;
+            l->free_bufs[i] = URING_BUFFERS - 1 - i;
+        }
+        if (uring_register_buffers(&l->ring, iov, URING_BUFFERS)) {
+            l->n_free = URING_BUFFERS;
+        } else {
+            log_warn("WARN", "Failed to register io_uring buffers\n");
+        }
+    }
+    for (unsigned int i = 0; i < URING_ACCEPTS; i++) {
+        queue_accept__(l, i);
+    }
+    uring_prep_poll(next_sqe__(&l->ring), handback.wake_fd, POLLIN, URING_HANDBACK);
+    uring_prep_poll(next_sqe__(&l->ring), stop_fd, POLLIN, URING_STOP);
+    log_info("INFO", "io_uring backend, %d accepts queued, %u read buffers\n", URING_ACCEPTS,
+             l->n_free);
+
+    // a client that takes nothing holds the stop up for SHUTDOWN_TIMEOUT
+    while (!l->stopping ||
+           (l->sends > 0 && accesslog_now() - stop_ns < SHUTDOWN_TIMEOUT * 1000000ULL)) {
+        // timer_next_ms() also drains the wakeup, the poll for it is queued
+        // after that
+        if (!timeout_queued) {
+            ms = timer_next_ms();
+            if (l->stopping && (ms < 0 || ms > ACCEPT_RETRY_MS)) {
+                ms = ACCEPT_RETRY_MS;
+            }
+            if (ms >= 0) {
+                ts.tv_sec = ms / 1000;
+                ts.tv_nsec = (ms % 1000) * 1000000L;
+                uring_prep_timeout(next_sqe__(&l->ring), &ts, URING_TIMEOUT);
+                timeout_queued = true;
+            }
+            if (!wake_queued) {
+                uring_prep_poll(next_sqe__(&l->ring), timer_wake_fd(), POLLIN, URING_WAKE);
+                wake_queued = true;
+            }
+        }
+        if (uring_submit(&l->ring, 1) < 0 && errno != EINTR) {
+            log_error("ERROR", "An error in io_uring_enter\n");
+            exit(1);
+        }
+        uint64_t woke_ns = accesslog_now();
+
+        while (uring_cqe(&l->ring, &cqe)) {
+            int fd = cqe.user_data & 0xffffffff;
+            switch (URING_KIND(cqe.user_data)) {
+                case URING_KIND(URING_WAKE):
+                    wake_queued = false;
+                    if (timeout_queued) {
+                        uring_prep_timeout_remove(next_sqe__(&l->ring), URING_TIMEOUT,
+                                                  URING_UNTIMEOUT);
+                    }
+                    break;
+                case URING_KIND(URING_TIMEOUT):
+                    timeout_queued = false;
+                    break;
+                case URING_KIND(URING_UNTIMEOUT):
+                    break;
+                case URING_KIND(URING_ACCEPT):
+                    accept_done__(l, fd, cqe.res, woke_ns);
+                    break;
+                case URING_KIND(URING_RETRY):
+                    l->retry_queued = false;
+                    for (unsigned int i = 0; i < URING_ACCEPTS && !l->stopping; i++) {
+                        if (l->slots[i].idle) {
+                            queue_accept__(l, i);
+                        }
+                    }
+                    break;
+                case URING_KIND(URING_HANDBACK):
+                    handed_back__(l);
+                    break;
+                case URING_KIND(URING_READ):
+                    read_done__(l, (cqe.user_data >> 40) & 0xffff, fd, cqe.res);
+                    break;
+                case URING_KIND(URING_SEND):
+                    send_done__(l, fd, cqe.res);
+                    break;
+                case URING_KIND(URING_WRITABLE):
+                    break;
+                case URING_KIND(URING_STOP):
+                    l->stopping = true;
+                    stop_ns = accesslog_now();
+                    break;
+                default:
+                    if (l->stopping) {
+                        close_conn__(ctx, fd);
+                    } else {
+                        threaded_request(fd, ctx, NULL, 0);
+                    }
+                    break;
+            }
+        }
+        timer_advance();
+    }
+    uring_exit(&l->ring);
+    free(l->bufs);
+    free(l);
 }
 
 // for debugging
@@ -171,16 +1018,49 @@ static void sync_request(int fd, const context_t* ctx) {
     targs_t* args = calloc(1, sizeof(targs_t));
     args->ctx = ctx;
     args->fd = fd;
+    rio_readinitb(&args->rio, fd);
+    atomic_fetch_add(&workers, 1);
     process_request(args);
 }
 
-static void threaded_request(int fd, const context_t* ctx) {
+// starts a worker for the request on fd. the io_uring loop passes the
+// bytes it already read, the worker's reads continue after them
+static void threaded_request(int fd, const context_t* ctx, const char* data, size_t n) {
     pthread_t tid;
     targs_t* thread_args = calloc(1, sizeof(targs_t));
+
+    if (thread_args == NULL) {
+        log_error("ERROR", "Failed to allocate a request\n");
+        close_conn__(ctx, fd);
+        return;
+    }
     thread_args->ctx = ctx;
     thread_args->fd = fd;
+    thread_args->queued_ns = accesslog_now();
+    rio_readinitb(&thread_args->rio, fd);
+    if (n > 0) {
+        memcpy(thread_args->rio.rio_buf, data, n);
+        thread_args->rio.rio_cnt = n;
+    }
+
+    // the event was one shot, the fd stays disarmed until the thread parks
+    // it. a parked connection may have been shut down by its idle deadline
+    // already, the thread then reads the end of the stream
+    if (fd < ctx->max_conns) {
+        conn_t* conn = &ctx->conns[fd];
+        timer_cancel(&conn->idle);
+        if (conn->served > 0) {
+            conn->accept_ns = accesslog_now();
+        }
+    }
+
+    metrics_gauge_add(GAUGE_QUEUE_DEPTH, 1);
+    atomic_fetch_add(&workers, 1);
     if (pthread_create(&tid, NULL, process_request, (void*)thread_args) != 0) {
         log_error("ERROR", "Failed to create new thread\n");
+        atomic_fetch_sub(&workers, 1);
+        metrics_gauge_add(GAUGE_QUEUE_DEPTH, -1);
+        close_conn__(ctx, fd);
         free(thread_args);
         return;
     }
@@ -189,74 +1069,494 @@ static void threaded_request(int fd, const context_t* ctx) {
 static void process_request(void* targs) {
     targs_t* args = (targs_t*)targs;
     bool error = false;
+    metrics_gauge_add(GAUGE_QUEUE_DEPTH, -1);
+    admit_queued(accesslog_now() - args->queued_ns);
+    // a worker starts out on its loop's core
+    if (args->ctx->node >= 0) {
+        numa_pin_node(args->ctx->node);
+        cache_local_node = args->ctx->node;
+    }
     if (pthread_detach(pthread_self()) < 0) {
         error = true;
         goto PTHREAD_DETACH_ERROR;
     }
 
-    handle_request(targs);
+    args->server_fd = -1;
+    do {
+        metrics_gauge_add(GAUGE_WORKERS_BUSY, 1);
+        timer_add(&args->total, REQUEST_TIMEOUT, request_expired__, args);
+        enter_phase__(args, PHASE_HEADER);
+        handle_request(targs);
+        timer_cancel(&args->deadline);
+        timer_cancel(&args->total);
+        metrics_gauge_add(GAUGE_WORKERS_BUSY, -1);
+        // spurious wakeups that read nothing are not requests
+        if (args->log.bytes_in > 0) {
+            metrics_record_request(&args->log);
+            if (accesslog_enabled()) {
+                accesslog_write(&args->log);
+            }
+        }
+    } while (args->keep_alive && !args->body_pending && !args->timed_out &&
+             args->fd < args->ctx->max_conns &&
+             ++args->ctx->conns[args->fd].served < KEEPALIVE_MAX && next_request__(args));
 
 PTHREAD_DETACH_ERROR:
-    if (epoll_ctl(args->ctx->epoll_fd, EPOLL_CTL_DEL, args->fd, NULL) == -1) {
-        log_error("ERROR", "Failed to remove client to epoll\n");
+    // what the client did not take yet still goes out before the close
+    if (!args->tunneled && !args->parked && !args->timed_out &&
+        outbuf_pending(&args->ctx->conns[args->fd].out) > 0) {
+        if (args->ctx->epoll_fd >= 0) {
+            args->parked = hand_off__(args, true);
+        } else if (!(args->parked = hand_back__(args, true))) {
+            client_drain__(args, 0);
+        }
     }
-
-    if (close(args->fd) != 0) {
-        log_error("ERROR", "Failed to close fd %d\n", args->fd);
+    // a tunnel closes the connection when it ends, a parked one belongs to
+    // the event loop again
+    if (!args->tunneled && !args->parked) {
+        close_conn__(args->ctx, args->fd);
     }
 
     free(targs);
+    atomic_fetch_sub(&workers, 1);
 
     if (error) {
         pthread_exit(NULL);
     }
 }
 
-static void handle_request(void* targs) {
-    char buf[MAXLINE];
-    char url_buf[MAXLINE];
-    targs_t* args = (targs_t*)targs;
-    rio_t rio;
-    bool has_connhdr = false, has_hosthdr = false, has_pconnhdr = false, has_useragent = false;
-    size_t host_len, header_len;
-    bool need_update_cache = false;
-    cacheline* found = NULL;
+// resets the per request state when the next request on a kept alive
+// connection is already buffered (pipelined). otherwise the connection is
+// parked, with io_uring by handing it back to the loop thread, the only one
+// that may touch the ring
+static bool next_request__(targs_t* args) {
+    if (args->rio.rio_cnt == 0) {
+        if (args->ctx->epoll_fd >= 0) {
+            args->parked = outbuf_pending(&args->ctx->conns[args->fd].out) > 0
+                               ? hand_off__(args, false)
+                               : park__(args->ctx, args->fd);
+        } else {
+            args->parked = hand_back__(args, false);
+        }
+        return false;
+    }
+    memset(&args->request, 0, sizeof(args->request));
+    memset(&args->log, 0, sizeof(args->log));
+    args->raw_url[0] = '\0';
+    args->keep_alive = false;
+    args->body_pending = false;
+    if (args->fd < args->ctx->max_conns) {
+        args->ctx->conns[args->fd].accept_ns = accesslog_now();
+    }
+    return true;
+}
 
-    rio_readinitb(&rio, args->fd);
-    if (rio_readlineb(&rio, buf, sizeof(buf)) < 0) {
-        log_error("ERROR", "Failed to read data from %d\n", args->fd);
-        return;
+static unsigned int conn_idle__(void* arg) {
+    shutdown((int)(intptr_t)arg, SHUT_RDWR);
+    return 0;
+}
+
+// hands a kept alive connection back to its event loop, which starts a new
+// worker once the next request arrives, so no thread waits while the client
+// thinks. the deadline is armed first: once the fd is re-armed another
+// worker may already own it. the fd is level triggered, a request that came
+// in meanwhile is reported right away
+static bool park__(context_t* ctx, int fd) {
+    conn_t* conn = &ctx->conns[fd];
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = fd};
+
+    timer_add(&conn->idle, KEEPALIVE_TIMEOUT, conn_idle__, (void*)(intptr_t)fd);
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        log_error("ERROR", "Failed to park fd %d\n", fd);
+        timer_cancel(&conn->idle);
+        return false;
     }
+    return true;
+}
 
-    sscanf(buf, "%s %s %s", args->request.method, url_buf, args->request.ver);
-    log_info("REQUEST", "%s %s %s\n", args->request.method, url_buf, args->request.ver);
+// hands the part of a response the client did not take yet to the event
+// loop, which sends it as the socket drains and then parks or closes the
+// connection. the worker and the origin connection are free meanwhile. a
+// client that takes nothing for IDLE_TIMEOUT is shut down
+static bool hand_off__(targs_t* args, bool close_after) {
+    conn_t* conn = &args->ctx->conns[args->fd];
+    struct epoll_event event = {.events = EPOLLOUT | EPOLLONESHOT, .data.fd = args->fd};
+
+    conn->close_after = close_after;
+    timer_add(&conn->idle, IDLE_TIMEOUT, conn_idle__, (void*)(intptr_t)args->fd);
+    if (epoll_ctl(args->ctx->epoll_fd, EPOLL_CTL_MOD, args->fd, &event) == -1) {
+        log_error("ERROR", "Failed to hand off fd %d\n", args->fd);
+        timer_cancel(&conn->idle);
+        return false;
+    }
+    return true;
+}
 
-    result_t parse_result = parse_url(url_buf, &(args->request.url));
-    if (!parse_result.succ || strlen(args->request.ver) == 0) {
-        clienterror(args->fd, "Bad Request", "400", "Proxy Error", "Bad Request");
-        return;
+// the io_uring version of park__() and hand_off__(): the loop sends what is
+// buffered and then waits for the next request or closes the connection.
+// the loop is only woken for the first connection on the list
+static bool hand_back__(targs_t* args, bool close_after) {
+    uint64_t one = 1;
+    bool wake;
+
+    if (handback.wake_fd < 0) {
+        return false;
+    }
+    pthread_mutex_lock(&handback.mutex);
+    if (handback.len == handback.cap) {
+        size_t cap = handback.cap > 0 ? handback.cap * 2 : 64;
+        int* fds = realloc(handback.fds, cap * sizeof(int));
+        if (fds == NULL) {
+            pthread_mutex_unlock(&handback.mutex);
+            log_error("ERROR", "Failed to hand back fd %d\n", args->fd);
+            return false;
+        }
+        handback.fds = fds;
+        handback.cap = cap;
     }
+    args->ctx->conns[args->fd].close_after = close_after;
+    handback.fds[handback.len++] = args->fd;
+    wake = handback.len == 1;
+    pthread_mutex_unlock(&handback.mutex);
 
-    strcpy(args->request.ver, HTTP_VER_STRING);
+    if (wake && write(handback.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        log_error("ERROR", "Failed to wake the io_uring loop\n");
+    }
+    return true;
+}
+
+// the event loop's part of a handed off response
+static void flush_conn__(context_t* ctx, int fd) {
+    conn_t* conn = &ctx->conns[fd];
+    size_t pending = outbuf_pending(&conn->out);
+    struct epoll_event event = {.events = EPOLLOUT | EPOLLONESHOT, .data.fd = fd};
+
+    if (!outbuf_flush(&conn->out, fd)) {
+        close_conn__(ctx, fd);
+        return;
+    }
+    if (outbuf_pending(&conn->out) > 0) {
+        if (outbuf_pending(&conn->out) < pending) {
+            timer_add(&conn->idle, IDLE_TIMEOUT, conn_idle__, (void*)(intptr_t)fd);
+        }
+        if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+            close_conn__(ctx, fd);
+        }
+        return;
+    }
+    timer_cancel(&conn->idle);
+    if (conn->close_after || !park__(ctx, fd)) {
+        close_conn__(ctx, fd);
+    }
+}
+
+// closes a client connection nothing holds any more. the fd may be accepted
+// again as soon as it is closed, so its state goes first
+static void close_conn__(const context_t* ctx, int fd) {
+    conn_t* conn = &ctx->conns[fd];
+
+    timer_cancel(&conn->idle);
+    outbuf_free(&conn->out);
+    admit_release(conn->client_addr);
+    if (close(fd) != 0) {
+        log_error("ERROR", "Failed to close fd %d\n", fd);
+    } else {
+        metrics_gauge_add(GAUGE_ACTIVE_CONNECTIONS, -1);
+    }
+}
+
+// writes to the client through its output buffer. while the buffer holds
+// more than OUTBUF_LIMIT the worker waits for the client, so a slow reader
+// slows the reads from the origin down instead of growing the buffer. with
+// io_uring a cache hit that fits is only buffered, the loop sends it with
+// what pipelined hits after it add
+static bool client_writev__(targs_t* args, const struct iovec* iov, int n) {
+    outbuf_t* out = &args->ctx->conns[args->fd].out;
+    size_t total = 0;
+
+    if (args->batch_writes) {
+        for (int i = 0; i < n; i++) {
+            total += iov[i].iov_len;
+        }
+        if (outbuf_pending(out) + total <= OUTBUF_LIMIT) {
+            return outbuf_append(out, iov, n);
+        }
+    }
+    if (!outbuf_writev(out, args->fd, iov, n)) {
+        return false;
+    }
+    return outbuf_pending(out) <= OUTBUF_LIMIT || args->read_ahead ||
+           client_drain__(args, OUTBUF_LIMIT);
+}
+
+static bool client_send__(targs_t* args, const void* data, size_t n) {
+    struct iovec iov = {.iov_base = (void*)data, .iov_len = n};
+    return client_writev__(args, &iov, 1);
+}
+
+// waits until at most keep bytes are left in the output buffer. false when
+// the client failed or took nothing for IDLE_TIMEOUT
+static bool client_drain__(targs_t* args, size_t keep) {
+    outbuf_t* out = &args->ctx->conns[args->fd].out;
+    struct pollfd pfd = {.fd = args->fd, .events = POLLOUT};
+
+    while (outbuf_pending(out) > keep) {
+        size_t pending = outbuf_pending(out);
+        int ready = poll(&pfd, 1, IDLE_TIMEOUT);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0 || !outbuf_flush(out, args->fd)) {
+            return false;
+        }
+        if (outbuf_pending(out) < pending) {
+            progress__(args);
+        }
+    }
+    return true;
+}
+
+// a line of the request head. the client socket does not block, so a line
+// that arrives in pieces is waited for; the header deadline ends the wait
+static ssize_t read_line__(targs_t* args, char* buf, size_t cap) {
+    rio_t* rio = &args->rio;
+    struct pollfd pfd = {.fd = args->fd, .events = POLLIN};
+    size_t len = 0;
+
+    while (len + 1 < cap) {
+        if (rio->rio_cnt <= 0) {
+            ssize_t n = read(rio->rio_fd, rio->rio_buf, sizeof(rio->rio_buf));
+            if (n < 0 && (errno == EINTR || (errno == EAGAIN && poll(&pfd, 1, -1) >= 0))) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n < 0 && len == 0) {
+                    return -1;
+                }
+                break;
+            }
+            rio->rio_cnt = n;
+            rio->rio_bufptr = rio->rio_buf;
+        }
+
+        size_t take = rio->rio_cnt < cap - 1 - len ? rio->rio_cnt : cap - 1 - len;
+        char* nl = memchr(rio->rio_bufptr, '\n', take);
+        if (nl != NULL) {
+            take = nl - rio->rio_bufptr + 1;
+        }
+        memcpy(buf + len, rio->rio_bufptr, take);
+        rio->rio_bufptr += take;
+        rio->rio_cnt -= take;
+        len += take;
+        if (nl != NULL) {
+            break;
+        }
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static const char* const phase_names[] = {"header", "connect", "first byte", "idle"};
+static const unsigned int phase_timeouts[] = {HEADER_TIMEOUT, CONNECT_TIMEOUT, FIRST_BYTE_TIMEOUT,
+                                              IDLE_TIMEOUT};
+
+// runs with the timer wheel locked. shutting a socket down wakes the worker
+// from whatever read, write or connect it is blocked in. the client still
+// gets an error when only the origin ran out of time
+static void cut_off__(targs_t* args, const char* what, bool client) {
+    log_warn("TIMEOUT", "%s deadline passed on %d\n", what, args->fd);
+    metrics_inc(COUNTER_TIMEOUTS, 1);
+    args->timed_out = true;
+    if (args->server_fd >= 0) {
+        shutdown(args->server_fd, SHUT_RDWR);
+    }
+    if (client) {
+        shutdown(args->fd, SHUT_RDWR);
+    }
+}
+
+static uint64_t now_ms__(void) {
+    return accesslog_now() / 1000000;
+}
+
+// an idle deadline moves with progress instead of being reset on every read
+static unsigned int phase_expired__(void* arg) {
+    targs_t* args = arg;
+
+    if (args->phase == PHASE_IDLE) {
+        uint64_t idle = now_ms__() - atomic_load_explicit(&args->progress_ms, memory_order_relaxed);
+        if (idle < IDLE_TIMEOUT) {
+            return IDLE_TIMEOUT - idle;
+        }
+    }
+    cut_off__(args, phase_names[args->phase], args->phase == PHASE_HEADER);
+    return 0;
+}
+
+static unsigned int request_expired__(void* arg) {
+    cut_off__(arg, "request", true);
+    return 0;
+}
+
+static void enter_phase__(targs_t* args, phase_t phase) {
+    timer_lock();
+    args->phase = phase;
+    timer_unlock();
+    progress__(args);
+    timer_add(&args->deadline, phase_timeouts[phase], phase_expired__, args);
+}
+
+static void progress__(targs_t* args) {
+    atomic_store_explicit(&args->progress_ms, now_ms__(), memory_order_relaxed);
+}
+
+// the origin socket deadlines shut down. it has to be unset before the
+// socket is closed or pooled
+static void watch_origin__(targs_t* args, int fd) {
+    timer_lock();
+    args->server_fd = fd;
+    timer_unlock();
+}
+
+// open_clientfd() with the socket known to the connect deadline while the
+// connect blocks
+static int connect_origin__(targs_t* args, const char* host, const char* port) {
+    struct addrinfo hints, *list, *p;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &list) != 0) {
+        return -1;
+    }
+    for (p = list; p != NULL && !args->timed_out; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
+        }
+        tcpopt_upstream(fd, p->ai_next == NULL);
+        watch_origin__(args, fd);
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        watch_origin__(args, -1);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+static void parse_connection__(targs_t* args, const char* line) {
+    char value[MAXLINE];
+    size_t i;
+
+    for (i = 0; line[i] != '\0' && i < sizeof(value) - 1; i++) {
+        value[i] = tolower((unsigned char)line[i]);
+    }
+    value[i] = '\0';
+    if (strstr(value, "close") != NULL) {
+        args->request.keep_alive = false;
+    } else if (strstr(value, "keep-alive") != NULL) {
+        args->request.keep_alive = true;
+    }
+}
+
+static void handle_request(void* targs) {
+    char buf[MAXLINE];
+    char url_buf[MAXLINE];
+    targs_t* args = (targs_t*)targs;
+    bool has_connhdr = false, has_hosthdr = false, has_pconnhdr = false, has_useragent = false;
+    bool has_ifrange = false, has_length = false, head_done = false;
+    size_t host_len, header_len;
+    ssize_t line_len;
+    bool need_update_cache = false;
+    cacheline* found = NULL;
+
+    if (args->fd < args->ctx->max_conns) {
+        args->log.accept_ns = args->ctx->conns[args->fd].accept_ns;
+        args->log.client_addr = args->ctx->conns[args->fd].client_addr;
+        args->request.rate_key = args->ctx->conns[args->fd].client_key;
+    }
+    if (args->log.accept_ns == 0) {
+        args->log.accept_ns = accesslog_now();
+    }
+
+    if ((line_len = read_line__(args, buf, sizeof(buf))) <= 0) {
+        if (line_len < 0) {
+            log_error("ERROR", "Failed to read data from %d\n", args->fd);
+        }
+        return;
+    }
+    args->log.bytes_in += line_len;
+
+    sscanf(buf, "%s %s %s", args->request.method, url_buf, args->request.ver);
+    log_info("REQUEST", "%s %s %s\n", args->request.method, url_buf, args->request.ver);
+    args->log.method = accesslog_method(args->request.method);
+    strncpy(args->log.url, url_buf, sizeof(args->log.url));
+
+    // a CONNECT names host:port rather than a url
+    result_t parse_result = {.succ = false};
+    if (strcasecmp(args->request.method, "CONNECT") == 0) {
+        parse_result.succ = parse_authority(url_buf, &args->request.url);
+    } else {
+        parse_result = parse_url(url_buf, &(args->request.url));
+    }
+    if (!parse_result.succ || strlen(args->request.ver) == 0) {
+        reply_error__(args, "Bad Request", "400", "Proxy Error", "Bad Request");
+        return;
+    }
+
+    // HTTP/1.1 clients keep the connection unless they say otherwise
+    args->request.chunked_ok = strcasecmp(args->request.ver, "HTTP/1.0") != 0;
+    args->request.keep_alive = args->request.chunked_ok;
+    strcpy(args->request.ver, HTTP_VER_STRING);
     host_len = strnlen(args->request.url.host, sizeof(args->request.url.host));
     header_len = 0;
-    for (size_t n = rio_readlineb(&rio, buf, sizeof(buf)); n > 0;
-         n = rio_readlineb(&rio, buf, sizeof(buf))) {
+    for (ssize_t n = read_line__(args, buf, sizeof(buf)); n > 0;
+         n = read_line__(args, buf, sizeof(buf))) {
         header_len += n;
+        args->log.bytes_in += n;
         if (header_len > MAXLINE) {
             log_error("HEADER", "header is too large %d", header_len);
-            clienterror(args->fd, "Request Header Fields To Large", "431", "Proxy Error",
-                        "Failed to process requests");
+            reply_error__(args, "Request Header Fields To Large", "431", "Proxy Error",
+                          "Failed to process requests");
             return;
         }
 
         if (fast_strstr(buf, "\r\n") == NULL) {
             log_error("HEADER", "there is no \\r\\n\n");
-            clienterror(args->fd, "Internal Server Error", "500", "Proxy Error",
-                        "Failed to process requests");
+            reply_error__(args, "Internal Server Error", "500", "Proxy Error",
+                          "Failed to process requests");
             return;
         }
 
+        if (strncasecmp(buf, "Range:", 6) == 0) {
+            log_info("HEADER", "%s", buf);
+            // a range we understand is cut out of the whole object here,
+            // any other one is the origin's to answer
+            if (parse_range(buf + 6, &args->request.range) && range_fill) {
+                continue;
+            }
+            args->request.range_forwarded = true;
+        }
+
+        if (strncasecmp(buf, "Accept-Encoding:", 16) == 0) {
+            args->request.encoding = parse_accept_encoding(buf + 16);
+        }
+
+        if (strncasecmp(buf, "If-Range:", 9) == 0) {
+            has_ifrange = true;
+        }
+
+        if (rate_key_header != NULL &&
+            strncasecmp(buf, rate_key_header, strlen(rate_key_header)) == 0 &&
+            buf[strlen(rate_key_header)] == ':') {
+            char* value = buf + strlen(rate_key_header) + 1;
+            value += strspn(value, " \t");
+            args->request.rate_key = ratelimit_key(value, strcspn(value, "\r\n"));
+        }
+
         if (!has_useragent && fast_strstr(buf, "User-Agent") != NULL) {
             strncat(args->request.header, user_agent_hdr, sizeof(args->request.header));
             has_useragent = true;
@@ -281,29 +1581,90 @@ static void handle_request(void* targs) {
             continue;
         }
 
+        // connection headers are about the client's connection, the origin
+        // connection gets its own
         if (!has_pconnhdr && fast_strstr(buf, "Proxy-Connection") != NULL) {
-            strncatf(args->request.header, sizeof(args->request.header),
-                     "Proxy-Connection: close\r\n");
             has_pconnhdr = true;
+            parse_connection__(args, buf);
             log_info("HEADER", "%s", buf);
             continue;
         }
 
         if (!has_connhdr && fast_strstr(buf, "Connection") != NULL) {
-            strncatf(args->request.header, sizeof(args->request.header), "Connection: close\r\n");
             has_connhdr = true;
+            parse_connection__(args, buf);
             log_info("HEADER", "%s", buf);
             continue;
         }
 
-        strncatf(args->request.header, sizeof(args->request.header), "%s", buf);
+        if (is_hop_by_hop(buf, strlen(buf))) {
+            if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0 && strstr(buf, "chunked") != NULL) {
+                args->request.body_chunked = true;
+                args->body_pending = true;
+            }
+            continue;
+        }
+
         if (strcmp(buf, "\r\n") == 0) {
             log_info("HEADER", "end of headers\n");
+            head_done = true;
             break;
         }
+        // a length that is not a number or a second one that differs leaves
+        // the end of the body open to interpretation (RFC 9112 6.3). it is
+        // forwarded once below
+        if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+            long long length;
+            if (!parse_length(buf + 15, &length) ||
+                (has_length && length != args->request.body_length)) {
+                reply_error__(args, "Bad Request", "400", "Proxy Error", "Invalid Content-Length");
+                return;
+            }
+            has_length = true;
+            args->request.body_length = length;
+            args->body_pending = length > 0;
+            log_info("HEADER", "%s", buf);
+            continue;
+        }
+        // we answer it ourselves before reading the body
+        if (strncasecmp(buf, "Expect:", 7) == 0 && strstr(buf, "100-continue") != NULL) {
+            args->request.expect_continue = true;
+            continue;
+        }
+        strncatf(args->request.header, sizeof(args->request.header), "%s", buf);
         log_info("HEADER", "%s", buf);
     }
 
+    // the client went away or ran out of time before the blank line
+    if (!head_done) {
+        log_warn("WARN", "incomplete request head from %d\n", args->fd);
+        return;
+    }
+    timer_cancel(&args->deadline);
+    args->log.headers_us = accesslog_since(args->log.accept_ns);
+
+    // we cannot check the validator, the whole object is always a valid answer
+    if (has_ifrange) {
+        args->request.range.set = false;
+    }
+
+    if (strcasecmp(args->request.method, "CONNECT") == 0) {
+        handle_connect__(args);
+        return;
+    }
+
+    if (host_len == 0 && strcmp(args->request.url.path, METRICS_PATH) == 0) {
+        handle_metrics__(args);
+        return;
+    }
+
+    if (host_len == 0 && strncmp(args->request.url.path, CACHE_ADMIN_PATH,
+                                 strlen(CACHE_ADMIN_PATH)) == 0 &&
+        strchr("?", args->request.url.path[strlen(CACHE_ADMIN_PATH)]) != NULL) {
+        handle_cache_admin__(args);
+        return;
+    }
+
     if (!has_useragent) {
         strncat(args->request.header, user_agent_hdr, sizeof(args->request.header));
     }
@@ -313,12 +1674,22 @@ static void handle_request(void* targs) {
                  args->request.url.host);
     }
 
-    if (!has_connhdr) {
-        strncatf(args->request.header, sizeof(args->request.header), "Connection: close\r\n");
-    }
+    strncatf(args->request.header, sizeof(args->request.header), "Connection: keep-alive\r\n");
 
-    if (!has_pconnhdr) {
-        strncatf(args->request.header, sizeof(args->request.header), "Proxy-Connection: close\r\n");
+    // a chunked body is passed on in chunks of our own, it has no length.
+    // a request with both would reach the origin framed one way and be
+    // read here the other
+    if (args->request.body_chunked && has_length) {
+        reply_error__(args, "Bad Request", "400", "Proxy Error",
+                      "Both Content-Length and Transfer-Encoding");
+        return;
+    }
+    if (args->request.body_chunked) {
+        strncatf(args->request.header, sizeof(args->request.header),
+                 "Transfer-Encoding: chunked\r\n");
+    } else if (has_length) {
+        strncatf(args->request.header, sizeof(args->request.header), "Content-Length: %lld\r\n",
+                 args->request.body_length);
     }
 
     if (args->request.url.port == 0) {
@@ -329,230 +1700,1248 @@ static void handle_request(void* targs) {
         strcpy(args->request.url.host, args->ctx->default_host);
     }
 
-    if ((found = find(http_cache, url_buf)) == NULL) {
-        need_update_cache = true;
+    strncpy(args->raw_url, url_buf, sizeof(args->raw_url));
+    // only GET and HEAD are answered from the cache, every other method
+    // goes to the origin with its body
+    need_update_cache = true;
+    if (strcasecmp(args->request.method, "GET") == 0 ||
+        strcasecmp(args->request.method, "HEAD") == 0) {
+        if (handle_request_variant__(args)) {
+            return;
+        }
+        if (shared_cache != NULL && handle_request_shared__(args)) {
+            return;
+        }
+        if ((found = cache_get(http_cache, url_buf)) != NULL) {
+            need_update_cache = false;
+        } else if ((disk_enabled() && handle_request_disk__(args)) ||
+                   handle_request_snapshot__(args)) {
+            return;
+        }
     }
+    args->log.lookup_us = accesslog_since(args->log.accept_ns);
+    args->log.cache = need_update_cache ? CACHE_MISS : CACHE_HIT;
 
-    strncpy(args->raw_url, url_buf, sizeof(args->raw_url));
     if (need_update_cache) {
-        handle_request__(args);
+        // cache hits are cheap, clients over their rate and a proxy that has
+        // to shed turn away only what needs the origin
+        unsigned int wait_ms = ratelimit_check(args->request.rate_key);
+        if (wait_ms > 0) {
+            rate_limited__(args, wait_ms);
+            return;
+        }
+        if (!admit_fetch()) {
+            shed__(args);
+            return;
+        }
+        args->fetching = true;
+        // only GETs are collapsed and cached, other methods may change the
+        // origin or get no body. whatever the origin answers to a Range
+        // header is neither shared nor cached, nor cut again here
+        bool writer;
+        bool cacheable = !args->request.range_forwarded &&
+                         strcasecmp(args->request.method, "GET") == 0;
+        if (args->request.range_forwarded) {
+            args->request.range.set = false;
+        }
+        fill_t* fill = fill_open(url_buf,
+                                 cacheable ? atomic_load(&http_cache->max_object_size) : 0,
+                                 cacheable, &writer);
+        if (!writer) {
+            args->log.cache = CACHE_COLLAPSED;
+            if (handle_request_fill__(args, fill)) {
+                fill_release(fill);
+                fetch_done__(args);
+                return;
+            }
+            // the fetch we waited for failed before sending anything
+            fill_release(fill);
+            args->log.cache = CACHE_MISS;
+            fill = fill_open(url_buf, atomic_load(&http_cache->max_object_size), false, &writer);
+        }
+        handle_request__(args, fill);
+        fill_release(fill);
+        fetch_done__(args);
     } else {
         handle_request_cache__(args, found->content, found->size);
+        release_cacheline(found);
         return;
     }
 }
 
+// the pre-serialized 503, the connection is closed after it
+static void shed__(targs_t* args) {
+    metrics_inc(COUNTER_SHED, 1);
+    args->log.status = 503;
+    args->keep_alive = false;
+    // it must not overtake what earlier responses left buffered
+    client_drain__(args, 0);
+    admit_reject(args->fd);
+}
+
+// a 429 with the time the client has to wait, the connection is closed
+// after it
+static void rate_limited__(targs_t* args, unsigned int wait_ms) {
+    char buf[MAXLINE];
+    int n = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 429 Too Many Requests\r\n"
+                     "Content-Length: 0\r\n"
+                     "Retry-After: %u\r\n"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     (wait_ms + 999) / 1000);
+
+    metrics_inc(COUNTER_RATE_LIMITED, 1);
+    args->log.status = 429;
+    args->keep_alive = false;
+    client_drain__(args, 0);
+    send(args->fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// the origin is not needed any more, the next miss may have its fetch
+static void release_fetch__(targs_t* args) {
+    if (args->fetching) {
+        args->fetching = false;
+        admit_fetch_done();
+    }
+}
+
+static void fetch_done__(targs_t* args) {
+    release_fetch__(args);
+    ratelimit_charge(args->request.rate_key, args->log.bytes_out);
+}
+
 static void handle_request_cache__(targs_t* args, char* data, size_t size) {
+    reply_t reply;
+    char key[MAXLINE];
+    char* variant = NULL;
+
+    // text goes out compressed when the client takes it, the variant is
+    // cached next to the identity object for the next request
+    if (args->request.encoding != ENCODING_IDENTITY && !args->request.range.set &&
+        compressible(data, size)) {
+        size_t variant_size;
+        if ((variant = compress_response(data, size, args->request.encoding, &variant_size)) !=
+            NULL) {
+            metrics_inc(COUNTER_COMPRESSED, 1);
+            variant_key__(key, sizeof(key), args->raw_url, args->request.encoding);
+            cache_store__(key, variant, variant_size);
+            data = variant;
+            size = variant_size;
+        }
+    }
+
     log_info("INFO", "Send cached content\n");
-    if (rio_writen(args->fd, data, size) != size) {
+    args->batch_writes = args->ctx->epoll_fd < 0;
+    args->log.status = parse_status(data);
+    args->log.first_byte_us = accesslog_since(args->log.accept_ns);
+    reply_init__(&reply, args, size);
+    if (!reply_write__(&reply, data, size) || !reply_finish__(&reply, true)) {
         log_error("ERROR", "Failed to response to the client\n");
+        args->batch_writes = false;
+        free(variant);
         return;
     }
+    args->batch_writes = false;
+    free(variant);
+    args->log.last_byte_us = accesslog_since(args->log.accept_ns);
     log_success("SUCCESS", "Send response successfully\n");
 }
 
-static void handle_request__(targs_t* args) {
-    int server_fd, n;
-    char write_buf[MAXLINE], read_buf[MAXLINE], port[SMALL_MAXSIZE];
-    rio_t rio;
-    size_t write_len;
-    char cache_buf[MAX_OBJECT_SIZE];
-    size_t total_len = 0;
+// variants are cached under the url and the coding with a newline in
+// between. a request url is a single word of the request line, it never
+// holds whitespace, so no url is the key of another one's variant
+static void variant_key__(char* key, size_t cap, const char* url, encoding_t encoding) {
+    snprintf(key, cap, "%s\n%s", url, encoding_name(encoding));
+}
 
-    snprintf(port, SMALL_MAXSIZE, "%d", args->request.url.port);
-    if ((server_fd = open_clientfd(args->request.url.host, port)) < 0) {
-        log_error("ERROR", "Failed to connect to server\n", args->request.url.host,
-                  args->request.url.port);
-        log_error("ERROR", "host: %s:%s\n", args->request.url.host, port);
-        clienterror(args->fd, "Internal Server Error", "500", "Proxy Error",
-                    "Failed to connect to server");
-        return;
+// serves a compressed variant made for an earlier request
+static bool handle_request_variant__(targs_t* args) {
+    char key[MAXLINE];
+    shm_ref_t ref;
+    cacheline* found;
+
+    if (args->request.encoding == ENCODING_IDENTITY || args->request.range.set) {
+        return false;
+    }
+    variant_key__(key, sizeof(key), args->raw_url, args->request.encoding);
+
+    args->log.cache = CACHE_HIT;
+    if (shared_cache != NULL && shm_cache_get(shared_cache, key, &ref)) {
+        args->log.lookup_us = accesslog_since(args->log.accept_ns);
+        handle_request_cache__(args, (char*)ref.content, ref.size);
+        shm_cache_release(shared_cache, &ref);
+        return true;
+    }
+    if ((found = cache_get(http_cache, key)) != NULL) {
+        args->log.lookup_us = accesslog_since(args->log.accept_ns);
+        handle_request_cache__(args, found->content, found->size);
+        release_cacheline(found);
+        return true;
     }
-    rio_readinitb(&rio, server_fd);
+    args->log.cache = CACHE_NONE;
+    return false;
+}
 
-    snprintf(write_buf, sizeof(write_buf), "%s %s %s\r\n%s", args->request.method,
-             args->request.url.path, args->request.ver, args->request.header);
+static bool reply_send__(reply_t* r, const char* data, size_t n) {
+    if (n == 0) {
+        return true;
+    }
+    if (!client_send__(r->args, data, n)) {
+        return false;
+    }
+    r->args->log.bytes_out += n;
+    return true;
+}
 
-    write_len = strnlen(write_buf, sizeof(write_buf));
-    if (rio_writen(server_fd, write_buf, write_len) != write_len) {
-        log_error("ERROR", "Failed to request to the server\n");
-        clienterror(args->fd, "Internal Server Error", "500", "Proxy Error",
-                    "Failed to request to server");
-        return;
+// one chunk: size line, data and the closing CRLF in a single write
+static bool reply_chunk__(reply_t* r, const char* data, size_t n) {
+    char size_line[32];
+    struct iovec iov[3];
+    size_t total;
+
+    if (n == 0) {
+        return true;
+    }
+    iov[0].iov_base = size_line;
+    iov[0].iov_len = chunked_head(size_line, sizeof(size_line), n);
+    iov[1].iov_base = (char*)data;
+    iov[1].iov_len = n;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    total = iov[0].iov_len + n + 2;
+
+    if (!client_writev__(r->args, iov, 3)) {
+        return false;
+    }
+    r->args->log.bytes_out += total;
+    return true;
+}
+
+// size is the length of the whole response when it is known up front
+static void reply_init__(reply_t* r, targs_t* args, size_t size) {
+    r->args = args;
+    r->head_len = 0;
+    r->size = size;
+    r->head_done = false;
+    r->bodyless = false;
+    r->sliced = false;
+    r->chunked = false;
+    r->unsatisfiable = false;
+    r->body_off = 0;
+    args->keep_alive = false;
+}
+
+// sends the part of body bytes that falls into the range
+static bool reply_body__(reply_t* r, const char* data, size_t n) {
+    size_t start = r->body_off, end = r->body_off + n;
+
+    r->body_off = end;
+    if (r->bodyless) {
+        return true;
+    }
+    if (!r->sliced) {
+        return r->chunked ? reply_chunk__(r, data, n) : reply_send__(r, data, n);
     }
+    if (r->unsatisfiable || end <= r->from || start > r->to) {
+        return true;
+    }
+    size_t from = start < r->from ? r->from : start;
+    size_t to = end - 1 > r->to ? r->to : end - 1;
+    return reply_send__(r, data + (from - start), to - from + 1);
+}
 
-    while ((n = rio_readlineb(&rio, read_buf, sizeof(read_buf))) != 0) {
-        if (rio_writen(args->fd, read_buf, n) != n) {
+// writes the head the client gets: the origin's headers without the
+// hop-by-hop ones, then our own framing. a range is cut out of a 200 whose
+// length is known, a body of unknown length goes out in chunks to HTTP/1.1
+// clients and is ended by closing the connection for the others
+static bool reply_head__(reply_t* r, size_t body) {
+    static const char* const range_drop[] = {"Content-Length", "Content-Range", NULL};
+    static const char* const length_drop[] = {"Content-Length", NULL};
+    char out[MAXLINE];
+    request_t* request = &r->args->request;
+    int status = parse_status(r->head);
+    long long total = parse_content_length(r->head, body);
+    bool bodyless = strcasecmp(request->method, "HEAD") == 0 || status / 100 == 1 ||
+                    status == 204 || status == 304;
+    bool framed = true;
+    size_t len = 0;
+
+    if (total < 0 && r->size > 0) {
+        total = r->size - body;
+    }
+    r->head_done = true;
+    r->bodyless = bodyless;
+    // the head and the body share segments until reply_finish__()
+    tcpopt_cork(r->args->fd, true);
+
+    if (request->range.set && status == 200 && total >= 0 && !bodyless) {
+        r->sliced = true;
+        if (!resolve_range(&request->range, total, &r->from, &r->to)) {
+            r->unsatisfiable = true;
+            r->args->log.status = 416;
+            r->args->keep_alive = request->keep_alive;
+            len = snprintf(out, sizeof(out),
+                           "%s 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\n"
+                           "Content-Length: 0\r\nConnection: %s\r\n\r\n",
+                           HTTP_VER_STRING, total, r->args->keep_alive ? "keep-alive" : "close");
+            return reply_send__(r, out, len);
+        }
+        r->args->log.status = 206;
+        len = snprintf(out, sizeof(out), "%s 206 Partial Content\r\n", HTTP_VER_STRING);
+        if (!copy_headers(out, sizeof(out), &len, r->head, body, range_drop)) {
+            goto TOO_LARGE;
+        }
+        len += snprintf(out + len, sizeof(out) - len,
+                        "Content-Range: bytes %zu-%zu/%lld\r\nContent-Length: %zu\r\n", r->from,
+                        r->to, total, r->to - r->from + 1);
+    } else {
+        const char* eol = memchr(r->head, '\n', body);
+        len = eol - r->head + 1;
+        memcpy(out, r->head, len);
+        if (!copy_headers(out, sizeof(out), &len, r->head, body, bodyless ? NULL : length_drop)) {
+            goto TOO_LARGE;
+        }
+        if (!bodyless && total >= 0) {
+            len += snprintf(out + len, sizeof(out) - len, "Content-Length: %lld\r\n", total);
+        } else if (!bodyless && request->chunked_ok) {
+            r->chunked = true;
+            len += snprintf(out + len, sizeof(out) - len, "Transfer-Encoding: chunked\r\n");
+        } else if (!bodyless) {
+            framed = false;
+        }
+    }
+    // other clients may get this url compressed. objects stored since the
+    // cache adds the header carry it already
+    if (needs_vary(r->head, body, total)) {
+        len += snprintf(out + len, sizeof(out) - len, "Vary: Accept-Encoding\r\n");
+    }
+
+    r->args->keep_alive = request->keep_alive && framed;
+    len += snprintf(out + len, sizeof(out) - len, "Connection: %s\r\n\r\n",
+                    r->args->keep_alive ? "keep-alive" : "close");
+    if (len >= sizeof(out)) {
+        goto TOO_LARGE;
+    }
+    return reply_send__(r, out, len) && reply_body__(r, r->head + body, r->head_len - body);
+
+TOO_LARGE:
+    // pass it on untouched and let the connection end it
+    r->sliced = false;
+    r->chunked = false;
+    r->args->keep_alive = false;
+    return reply_send__(r, r->head, r->head_len);
+}
+
+static bool reply_write__(reply_t* r, const char* data, size_t n) {
+    if (r->head_done) {
+        return reply_body__(r, data, n);
+    }
+
+    // still collecting the head
+    size_t take = sizeof(r->head) - r->head_len;
+    take = take < n ? take : n;
+    memcpy(r->head + r->head_len, data, take);
+    r->head_len += take;
+
+    size_t body = find_body(r->head, r->head_len);
+    if (body == 0) {
+        if (r->head_len < sizeof(r->head)) {
+            return true;
+        }
+        r->head_done = true;
+        r->args->keep_alive = false;
+        return reply_send__(r, r->head, r->head_len) && reply_send__(r, data + take, n - take);
+    }
+    return reply_head__(r, body) && reply_write__(r, data + take, n - take);
+}
+
+// ends the response. one that is not complete can only be ended by closing
+// the connection
+static bool reply_finish__(reply_t* r, bool complete) {
+    bool sent = true;
+
+    if (!r->head_done) {
+        r->head_done = true;
+        r->args->keep_alive = false;
+        sent = reply_send__(r, r->head, r->head_len);
+    } else if (!complete) {
+        r->args->keep_alive = false;
+    } else if (r->chunked) {
+        sent = reply_send__(r, CHUNKED_END, strlen(CHUNKED_END));
+    }
+    tcpopt_cork(r->args->fd, false);
+    return sent;
+}
+
+// follows a response another request is fetching. returns false if that
+// fetch failed before any byte arrived
+static bool handle_request_fill__(targs_t* args, fill_t* fill) {
+    fill_reader_t reader;
+    reply_t reply;
+    const char* data;
+    size_t n;
+
+    fill_reader_init(&reader, fill);
+    reply_init__(&reply, args, 0);
+    while ((n = fill_wait(fill, &reader, &data)) > 0) {
+        if (args->log.first_byte_us == 0) {
+            log_info("INFO", "Follow a response in flight\n");
+            args->log.first_byte_us = accesslog_since(args->log.accept_ns);
+            args->log.status = parse_status(data);
+        }
+        if (!reply_write__(&reply, data, n)) {
             log_error("ERROR", "Failed to response to the client\n");
-            if (close(server_fd) != 0) {
-                log_error("ERROR", "Failed to close server_fd %d\n", server_fd);
-                return;
+            fill_reader_done(&reader, fill);
+            return true;
+        }
+    }
+    fill_reader_done(&reader, fill);
+    if (reader.offset == 0 && fill_state(fill) == FILL_ABORTED) {
+        return false;
+    }
+    if (!reply_finish__(&reply, fill_state(fill) == FILL_DONE)) {
+        log_error("ERROR", "Failed to response to the client\n");
+        return true;
+    }
+    args->log.last_byte_us = accesslog_since(args->log.accept_ns);
+    log_success("SUCCESS", "Send response successfully\n");
+    return true;
+}
+
+// the object is written to the client straight from the shared region while
+// it is pinned
+static bool handle_request_shared__(targs_t* args) {
+    shm_ref_t ref;
+
+    if (!shm_cache_get(shared_cache, args->raw_url, &ref)) {
+        return false;
+    }
+    args->log.lookup_us = accesslog_since(args->log.accept_ns);
+    args->log.cache = CACHE_HIT;
+    handle_request_cache__(args, (char*)ref.content, ref.size);
+    shm_cache_release(shared_cache, &ref);
+    return true;
+}
+
+// an object another process stored first is not kept a second time here,
+// only one that does not fit the shared cache
+static void cache_store__(const char* url, const char* data, size_t size) {
+    if (shared_cache == NULL || shm_cache_put(shared_cache, url, data, size) == SHM_PUT_NO_ROOM) {
+        cache_put(http_cache, url, data, size);
+    }
+}
+
+// serves a miss in memory from the disk tier. objects hit repeatedly are
+// copied back to memory, the rest are sent with sendfile()
+static bool handle_request_disk__(targs_t* args) {
+    disk_entry_t* entry = disk_get(args->raw_url);
+    if (entry == NULL) {
+        return false;
+    }
+    args->log.lookup_us = accesslog_since(args->log.accept_ns);
+    args->log.cache = CACHE_DISK;
+
+    // a range is cut from a copy in memory. without the memory for one the
+    // whole object goes out, which answers a range request too. a HEAD is
+    // answered from a copy too, sendfile() would send the body
+    bool head = strcasecmp(args->request.method, "HEAD") == 0;
+    bool promote = disk_promote(entry);
+    if (promote || args->request.range.set || head) {
+        char* data = malloc(entry->size);
+        if (data == NULL) {
+            log_warn("WARN", "No memory to read %zu bytes from disk\n", entry->size);
+        } else if (disk_read(entry, data)) {
+            size_t size = entry->size;
+            disk_release(entry);
+            if (promote) {
+                cache_store__(args->raw_url, data, size);
             }
-            return;
+            handle_request_cache__(args, data, size);
+            free(data);
+            return true;
+        }
+        free(data);
+    }
+    if (head) {
+        disk_release(entry);
+        return false;
+    }
+
+    log_info("INFO", "Send content from disk\n");
+    args->log.status = entry->status;
+    args->log.first_byte_us = accesslog_since(args->log.accept_ns);
+    // sendfile() must not overtake what an earlier response left buffered
+    ssize_t n = client_drain__(args, 0) ? disk_send(entry, args->fd) : -1;
+    disk_release(entry);
+    if (n < 0) {
+        log_error("ERROR", "Failed to response to the client\n");
+        return true;
+    }
+    args->log.bytes_out += n;
+    args->log.last_byte_us = accesslog_since(args->log.accept_ns);
+    log_success("SUCCESS", "Send response successfully\n");
+    return true;
+}
+
+// pages an object in from the snapshot loaded at startup
+static bool handle_request_snapshot__(targs_t* args) {
+    const char* data;
+    size_t size;
+
+    if (!snapshot_find(args->raw_url, &data, &size)) {
+        return false;
+    }
+    args->log.lookup_us = accesslog_since(args->log.accept_ns);
+    args->log.cache = CACHE_HIT;
+    cache_store__(args->raw_url, data, size);
+    handle_request_cache__(args, (char*)data, size);
+    return true;
+}
+
+// bytes buffered by rio first, then whatever one read() returns
+static ssize_t read_some__(rio_t* rio, char* buf, size_t n) {
+    ssize_t len;
+
+    if (rio->rio_cnt > 0) {
+        return rio_readnb(rio, buf, n < rio->rio_cnt ? n : rio->rio_cnt);
+    }
+    while ((len = read(rio->rio_fd, buf, n)) < 0 && errno == EINTR) {
+    }
+    return len;
+}
+
+// reads a response head up to the blank line, skipping interim 1xx heads.
+// returns its length, 0 if the connection ended or the head is too large
+static size_t read_head__(rio_t* rio, char* head, size_t cap) {
+    size_t len = 0;
+    ssize_t n;
+
+    while ((n = rio_readlineb(rio, head + len, cap - len)) > 0) {
+        if (head[len + n - 1] != '\n') {
+            return 0;
+        }
+        len += n;
+        if (n > 2) {
+            continue;
         }
-        total_len += n;
-        if (total_len < sizeof(cache_buf)) {
-            strcat(cache_buf, read_buf);
+        int status = parse_status(head);
+        if (status / 100 != 1 || status == 101) {
+            return len;
         }
+        len = 0;
     }
+    return 0;
+}
 
-    if (total_len < MAX_OBJECT_SIZE) {
-        pthread_mutex_lock(&mutex);
-        add_head(http_cache, create_cacheline(args->raw_url, cache_buf));
-        pthread_mutex_unlock(&mutex);
+// whether the origin closes the connection after this response
+static bool origin_closes__(const char* head, size_t head_len) {
+    char value[SMALL_MAXSIZE];
+    size_t len;
+    const char* conn = find_header(head, head_len, "Connection", &len);
+
+    len = len < sizeof(value) - 1 ? len : sizeof(value) - 1;
+    for (size_t i = 0; conn != NULL && i < len; i++) {
+        value[i] = tolower((unsigned char)conn[i]);
+    }
+    value[conn != NULL ? len : 0] = '\0';
+    if (strstr(value, "close") != NULL) {
+        return true;
     }
+    return strncmp(head, "HTTP/1.0", 8) == 0 && strstr(value, "keep-alive") == NULL;
+}
 
-    if (close(server_fd) != 0) {
-        log_error("ERROR", "Failed to close server_fd %d\n", server_fd);
-        return;
+// the part of a request body rio already read from the client
+static bool send_buffered_body__(targs_t* args, int server_fd, size_t* left) {
+    char buf[MAXLINE];
+
+    while (*left > 0 && args->rio.rio_cnt > 0) {
+        size_t len = *left < sizeof(buf) ? *left : sizeof(buf);
+        ssize_t n = read_some__(&args->rio, buf, len);
+        if (n <= 0 || rio_writen(server_fd, buf, n) != n) {
+            return false;
+        }
+        args->log.bytes_in += n;
+        progress__(args);
+        *left -= n;
     }
-    log_success("SUCCESS", "Send response successfully\n");
+    return true;
 }
 
-static result_t parse_url(const char* url, URL* parsedURL) {
-    char *token, *rest;
-    bool no_proto = false;
-    char* url_copy = strdup(url);
-    result_t result;
+// waits until the client sent more of the body
+static bool wait_body__(targs_t* args) {
+    struct pollfd pfd = {.fd = args->fd, .events = POLLIN};
+    return poll(&pfd, 1, BODY_READ_TIMEOUT) > 0;
+}
 
-    memset(parsedURL, 0x00, sizeof(*parsedURL));
-    result.succ = true;
-    result.data = NULL;
+// a body of known length goes from the client socket to the origin through
+// a pipe, at most a pipe full at a time. the origin socket blocks, so a slow
+// origin slows down reading from the client
+static bool send_length_body__(targs_t* args, int server_fd) {
+    size_t left = args->request.body_length;
+    pump_t pump;
+    ssize_t n;
 
-    // Parse proto
-    if (fast_strstr(url_copy, "://") != NULL) {
-        token = strtok_r(url_copy, ":", &rest);
-        if (token != NULL && rest != NULL && *rest != '\0') {
-            size_t len = MIN(strlen(token), sizeof(parsedURL->proto) - 1);
-            strncpy(parsedURL->proto, token, len);
+    if (!send_buffered_body__(args, server_fd, &left)) {
+        return false;
+    }
+    if (left == 0) {
+        return true;
+    }
+    if (!pump_init(&pump)) {
+        return false;
+    }
+    while (left > 0) {
+        if ((n = pump_fill(&pump, args->fd, left)) < 0 && errno == EAGAIN && wait_body__(args)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        args->log.bytes_in += n;
+        progress__(args);
+        left -= n;
+        while (pump.buffered > 0 && pump_drain(&pump, server_fd) > 0) {
+        }
+        if (pump.buffered > 0) {
+            break;
         }
-    } else {
-        rest = url_copy;
-        no_proto = true;
     }
+    pump_close(&pump);
+    return left == 0;
+}
 
-    // parse relative path
-    if (no_proto && rest != NULL && rest[0] == '/') {
-        size_t len = MIN(strlen(rest), sizeof(parsedURL->path) - 1);
-        strncpy(parsedURL->path, rest, len);
-    } else {
-        // Parse host
-        token = strtok_r(rest, "/", &rest);
-        if (token != NULL) {
-            size_t len = MIN(strlen(token), sizeof(parsedURL->host) - 1);
-            strncpy(parsedURL->host, token, len);
-        }
-
-        // Parse path
-        if (rest != NULL) {
-            size_t len = MIN(strlen(rest), sizeof(parsedURL->path) - 1);
-            if (rest[0] != '/') {
-                strncpy(parsedURL->path, "/", 2);
-            }
-            strncat(parsedURL->path, rest, len);
-        } else {
-            strncpy(parsedURL->path, "/", 2);
+// a chunked body is decoded as it arrives and sent on as one chunk per read
+static bool send_chunked_body__(targs_t* args, int server_fd) {
+    char buf[MAXLINE], size_line[32];
+    chunked_t decoder;
+    ssize_t n;
+
+    chunked_init(&decoder);
+    while (!chunked_done(&decoder)) {
+        if ((n = read_some__(&args->rio, buf, sizeof(buf))) < 0 && errno == EAGAIN &&
+            wait_body__(args)) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        args->log.bytes_in += n;
+        progress__(args);
+
+        size_t used, len = chunked_decode(&decoder, buf, n, &used);
+        if (chunked_failed(&decoder)) {
+            return false;
         }
+        if (used < (size_t)n) {
+            // a request pipelined behind the body is not worth putting back
+            args->request.keep_alive = false;
+        }
+        if (len == 0) {
+            continue;
+        }
+        size_t head = chunked_head(size_line, sizeof(size_line), len);
+        if (rio_writen(server_fd, size_line, head) != head || rio_writen(server_fd, buf, len) != len ||
+            rio_writen(server_fd, "\r\n", 2) != 2) {
+            return false;
+        }
+    }
+    return rio_writen(server_fd, CHUNKED_END, strlen(CHUNKED_END)) == strlen(CHUNKED_END);
+}
+
+// streams the request body to the origin. a client waiting for 100 Continue
+// gets it first, the proxy does not wait for the origin to send one
+static bool send_body__(targs_t* args, int server_fd) {
+    static char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    bool sent;
+
+    if (args->request.expect_continue &&
+        (!client_send__(args, continue_line, strlen(continue_line)) || !client_drain__(args, 0))) {
+        return false;
     }
+    sent = args->request.body_chunked ? send_chunked_body__(args, server_fd)
+                                      : send_length_body__(args, server_fd);
+    if (sent) {
+        args->body_pending = false;
+    }
+    return sent;
+}
 
-    // Parse port
-    // Remove invalid port
-    size_t host_len = strlen(parsedURL->host);
-    if (host_len > 0 && parsedURL->host[host_len - 1] == ':') {
-        parsedURL->host[host_len - 1] = '\0';
+// passes body bytes to the fill and the client. returns false once nobody
+// needs more of them
+static bool relay__(relay_t* r, const char* data, size_t n) {
+    progress__(r->args);
+    // the fill carries the bytes to the cache and to any followers
+    if (r->filling) {
+        r->filling = fill_append(r->fill, data, n);
     }
+    // reading ahead, what a slow client cannot take yet is spooled instead
+    // of waiting for it
+    if (r->spool != NULL && !r->client_gone &&
+        (spool_size(r->spool) > 0 ||
+         outbuf_pending(&r->args->ctx->conns[r->args->fd].out) >= OUTBUF_LIMIT)) {
+        if (spool_append(r->spool, data, n)) {
+            return true;
+        }
+        // too large to read ahead, the rest goes at the client's pace
+        unspool__(r);
+    }
+    if (!r->client_gone && !reply_write__(&r->reply, data, n)) {
+        log_error("ERROR", "Failed to response to the client\n");
+        r->client_gone = true;
+    }
+    return !r->client_gone || fill_has_followers(r->fill);
+}
+
+static bool unspool_write__(void* reply, const char* data, size_t n) {
+    return reply_write__(reply, data, n);
+}
 
-    unsigned int cnt = 0;
-    for (size_t i = 0; i < host_len; i++) {
-        if (parsedURL->host[i] == ':') {
-            cnt += 1;
-            if (cnt > 1) {
+// stops reading ahead: the client gets what was spooled, from here on
+// writes wait for it again
+static void unspool__(relay_t* r) {
+    r->args->read_ahead = false;
+    if (!r->client_gone && !spool_replay(r->spool, unspool_write__, &r->reply)) {
+        log_error("ERROR", "Failed to response to the client\n");
+        r->client_gone = true;
+    }
+    spool_free(r->spool);
+    r->spool = NULL;
+}
+
+// sends the request over a kept alive origin connection when there is one
+// and relays the response. the body ends at its length, at the last chunk
+// or when the origin closes; the first two leave the connection reusable
+static void handle_request__(targs_t* args, fill_t* fill) {
+    static const char* const chunked_drop[] = {"Content-Length", NULL};
+    int server_fd;
+    char write_buf[MAXLINE], read_buf[MAXLINE], head[MAXLINE], port[SMALL_MAXSIZE];
+    char* norm = read_buf;
+    rio_t rio;
+    relay_t relay = {.args = args, .fill = fill, .filling = true, .client_gone = false};
+    spool_t spool;
+    size_t write_len, head_len = 0, norm_len;
+    ssize_t n = 0;
+    bool reused, complete = false, reusable, body_sent = false;
+
+    snprintf(port, SMALL_MAXSIZE, "%d", args->request.url.port);
+    snprintf(write_buf, sizeof(write_buf), "%s %s %s\r\n%s\r\n", args->request.method,
+             args->request.url.path, args->request.ver, args->request.header);
+    write_len = strnlen(write_buf, sizeof(write_buf));
+
+    // an idle connection may have been closed by the origin in the meantime,
+    // a request that fails on one is sent again over a new connection
+    for (int attempt = 0;; attempt++) {
+        server_fd = attempt == 0 ? pool_get(args->request.url.host, args->request.url.port) : -1;
+        reused = server_fd >= 0;
+        if (!reused) {
+            enter_phase__(args, PHASE_CONNECT);
+        }
+        if (!reused && (server_fd = connect_origin__(args, args->request.url.host, port)) < 0) {
+            log_error("ERROR", "Failed to connect to server\n");
+            log_error("ERROR", "host: %s:%s\n", args->request.url.host, port);
+            metrics_inc(COUNTER_UPSTREAM_ERRORS, 1);
+            fill_finish(fill, false);
+            reply_upstream_error__(args, "Internal Server Error", "500",
+                                   "Failed to connect to server");
+            return;
+        }
+        if (reused) {
+            metrics_inc(COUNTER_UPSTREAM_REUSED, 1);
+            watch_origin__(args, server_fd);
+        }
+        // a slow upload is fine as long as it moves
+        enter_phase__(args, args->body_pending ? PHASE_IDLE : PHASE_FIRST_BYTE);
+        args->log.connect_us = accesslog_since(args->log.accept_ns);
+        rio_readinitb(&rio, server_fd);
+
+        // the body cannot be read from the client twice, so a request is not
+        // retried once its body was sent. the head and the start of a body
+        // share segments while corked
+        if (args->body_pending) {
+            tcpopt_cork(server_fd, true);
+        }
+        bool sent = rio_writen(server_fd, write_buf, write_len) == write_len;
+        body_sent = sent && args->body_pending;
+        if (sent && (!args->body_pending || send_body__(args, server_fd))) {
+            if (body_sent) {
+                tcpopt_cork(server_fd, false);
+                enter_phase__(args, PHASE_FIRST_BYTE);
+            }
+            tcpopt_quickack(server_fd);
+            if ((head_len = read_head__(&rio, head, sizeof(head))) > 0) {
                 break;
             }
         }
+        watch_origin__(args, -1);
+        close(server_fd);
+        if (!reused || body_sent || args->timed_out) {
+            log_error("ERROR", "Failed to request to the server\n");
+            metrics_inc(COUNTER_UPSTREAM_ERRORS, 1);
+            fill_finish(fill, false);
+            reply_upstream_error__(args, "Internal Server Error", "500",
+                                   "Failed to request to server");
+            return;
+        }
     }
-
-    // Can't parse ipv6
-    if (cnt > 1) {
-        result.succ = false;
+    enter_phase__(args, PHASE_IDLE);
+    args->log.first_byte_us = accesslog_since(args->log.accept_ns);
+    args->log.status = parse_status(head);
+
+    size_t te_len;
+    const char* te = find_header(head, head_len, "Transfer-Encoding", &te_len);
+    bool chunked = te != NULL && te_len >= 7 && strncasecmp(te + te_len - 7, "chunked", 7) == 0;
+    long long length = chunked ? -1 : parse_content_length(head, head_len);
+    bool bodyless = strcasecmp(args->request.method, "HEAD") == 0 ||
+                    args->log.status / 100 == 1 || args->log.status == 204 ||
+                    args->log.status == 304;
+    reusable = !origin_closes__(head, head_len);
+
+    // what the fill and the client get: no hop-by-hop headers and a plain
+    // body, the client side adds its own framing
+    norm_len = (const char*)memchr(head, '\n', head_len) - head + 1;
+    memcpy(norm, head, norm_len);
+    copy_headers(norm, sizeof(read_buf) - 2, &norm_len, head, head_len,
+                 chunked ? chunked_drop : NULL);
+    memcpy(norm + norm_len, "\r\n", 2);
+    reply_init__(&relay.reply, args, 0);
+    if (spool_enabled()) {
+        spool_init(&spool);
+        relay.spool = &spool;
+        args->read_ahead = true;
+    }
+    relay__(&relay, norm, norm_len + 2);
+
+    if (bodyless) {
+        complete = true;
+    } else if (chunked) {
+        chunked_t decoder;
+        chunked_init(&decoder);
+        while (!chunked_done(&decoder) && (n = read_some__(&rio, read_buf, sizeof(read_buf))) > 0) {
+            size_t used, len = chunked_decode(&decoder, read_buf, n, &used);
+            // anything after the last chunk is not ours
+            reusable = reusable && used == n;
+            if (chunked_failed(&decoder) || !relay__(&relay, read_buf, len)) {
+                break;
+            }
+        }
+        complete = chunked_done(&decoder);
+    } else if (length >= 0) {
+        size_t left = length;
+        while (left > 0 &&
+               (n = read_some__(&rio, read_buf, left < sizeof(read_buf) ? left : sizeof(read_buf))) >
+                   0) {
+            left -= n;
+            if (!relay__(&relay, read_buf, n)) {
+                break;
+            }
+        }
+        complete = left == 0;
     } else {
-        char* saveptr;
-        char* host_copy = strdup(parsedURL->host);
-        strtok_r(host_copy, ":", &saveptr);
-
-        if (saveptr != NULL) {
-            parsedURL->port = atoi(saveptr);
+        reusable = false;
+        while ((n = read_some__(&rio, read_buf, sizeof(read_buf))) > 0 &&
+               relay__(&relay, read_buf, n)) {
         }
+        complete = n == 0;
+    }
 
-        char* pos = strchr(parsedURL->host, ':');
-        if (pos != NULL) {
-            *pos = '\0';
+    // a 200 is the whole object, anything else is not stored under its url
+    if (complete && parse_status(head) == 200) {
+        size_t size, out_size;
+        char* data = fill_copy(fill, &size);
+        char* out;
+        // stored with the headers every later copy needs, sendfile() sends
+        // it as it is
+        if (data != NULL && (out = add_content_length(data, size, &out_size)) != NULL) {
+            free(data);
+            data = out;
+            size = out_size;
         }
-        free(host_copy);
+        if (data != NULL && (out = add_vary(data, size, &out_size)) != NULL) {
+            free(data);
+            data = out;
+            size = out_size;
+        }
+        if (data != NULL) {
+            cache_store__(args->raw_url, data, size);
+        }
+        free(data);
     }
+    fill_finish(fill, complete);
 
-    // prevent directory traversal
-    if (fast_strstr(parsedURL->path, "../") != NULL || fast_strstr(parsedURL->path, "//") != NULL) {
-        result.succ = false;
+    timer_cancel(&args->deadline);
+    watch_origin__(args, -1);
+    if (complete && reusable && rio.rio_cnt == 0) {
+        pool_put(args->request.url.host, args->request.url.port, server_fd);
+    } else if (close(server_fd) != 0) {
+        log_error("ERROR", "Failed to close server_fd %d\n", server_fd);
     }
 
-    if (!no_proto) {
-        result.has_data = (result.data != NULL);
-        free(url_copy);
-        return result;
+    // the origin is free already, the client takes the rest at its pace
+    if (relay.spool != NULL) {
+        release_fetch__(args);
+        unspool__(&relay);
     }
+    if (!relay.client_gone && !reply_finish__(&relay.reply, complete)) {
+        log_error("ERROR", "Failed to response to the client\n");
+        relay.client_gone = true;
+    }
+    args->log.last_byte_us = accesslog_since(args->log.accept_ns);
+    if (!relay.client_gone && complete) {
+        log_success("SUCCESS", "Send response successfully\n");
+    }
+}
 
-    // if there is no proto, determine proto using known port number
-    switch (parsedURL->port) {
-        case 0:
-        case 80:
-            strcpy(parsedURL->proto, "http");
-            break;
-        case 443:
-            strcpy(parsedURL->proto, "https");
-            break;
-        default:
-            result.succ = false;
-            break;
+// CONNECT host:port. once the origin is connected the client gets a 200 and
+// both sockets go to the tunnel loop, the worker is free again
+static void handle_connect__(targs_t* args) {
+    static char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    char port[SMALL_MAXSIZE], target[MAXLINE];
+    size_t left = args->rio.rio_cnt;
+    int server_fd;
+
+    if (args->request.url.port == 0 || strlen(args->request.url.host) == 0) {
+        reply_error__(args, "Bad Request", "400", "Proxy Error", "CONNECT needs host:port");
+        return;
+    }
+    if (!tunnel_port_allowed(args->request.url.port)) {
+        reply_error__(args, "Forbidden", "403", "Proxy Error",
+                      "CONNECT to this port is not allowed");
+        return;
+    }
+    // a tunnel holds an origin connection like a miss does
+    unsigned int wait_ms = ratelimit_check(args->request.rate_key);
+    if (wait_ms > 0) {
+        rate_limited__(args, wait_ms);
+        return;
+    }
+    if (!admit_fetch()) {
+        shed__(args);
+        return;
+    }
+    args->fetching = true;
+    snprintf(port, sizeof(port), "%d", args->request.url.port);
+    snprintf(target, sizeof(target), "%s:%s", args->request.url.host, port);
+    enter_phase__(args, PHASE_CONNECT);
+    if ((server_fd = connect_origin__(args, args->request.url.host, port)) < 0) {
+        log_error("ERROR", "Failed to connect to %s\n", target);
+        metrics_inc(COUNTER_UPSTREAM_ERRORS, 1);
+        reply_upstream_error__(args, "Bad Gateway", "502", "Failed to connect to server");
+        fetch_done__(args);
+        return;
     }
+    // from here on the tunnel has deadlines of its own
+    timer_cancel(&args->deadline);
+    timer_cancel(&args->total);
+    watch_origin__(args, -1);
+    args->log.connect_us = accesslog_since(args->log.accept_ns);
+
+    // whatever the client sent right behind the request is the tunnel's. the
+    // tunnel writes to the client directly, nothing may be left buffered
+    if (!send_buffered_body__(args, server_fd, &left) ||
+        !client_send__(args, established, strlen(established)) || !client_drain__(args, 0)) {
+        close(server_fd);
+        fetch_done__(args);
+        return;
+    }
+    args->log.status = 200;
+    args->log.bytes_out += strlen(established);
+    args->log.first_byte_us = args->log.last_byte_us = accesslog_since(args->log.accept_ns);
+    args->keep_alive = false;
+    // the tunnel loop has limits of its own, the fetch slot goes back
+    fetch_done__(args);
+    if (!tunnel_add(args->fd, server_fd, target, args->log.client_addr)) {
+        close(server_fd);
+        return;
+    }
+    args->tunneled = true;
+    log_info("TUNNEL", "%s opened\n", target);
+}
 
-    return result;
+static void handle_metrics__(targs_t* args) {
+    char* body = NULL;
+    size_t body_len = 0;
+    char header[MAXLINE];
+    cache_stats stats;
+    disk_stats_t dstats;
+
+    FILE* out = open_memstream(&body, &body_len);
+    if (out == NULL) {
+        reply_error__(args, "Internal Server Error", "500", "Proxy Error",
+                      "Failed to collect metrics");
+        return;
+    }
+
+    cache_get_stats(http_cache, &stats);
+
+    metrics_write(out);
+    metrics_write_value(out, "proxy_cache_bytes", "gauge", "Bytes held by the cache",
+                        stats.total_size);
+    metrics_write_value(out, "proxy_cache_capacity_bytes", "gauge",
+                        "Configured capacity of the cache", stats.max_size);
+    metrics_write_value(out, "proxy_cache_entries", "gauge", "Objects held by the cache",
+                        stats.len);
+    metrics_write_value(out, "proxy_cache_evictions_total", "counter",
+                        "Objects evicted by kill_victim()", stats.evictions);
+    metrics_write_value(out, "proxy_upstream_idle_connections", "gauge",
+                        "Idle origin connections kept for reuse", pool_idle());
+    metrics_write_value(out, "proxy_tunnels_active", "gauge", "Open CONNECT tunnels",
+                        tunnel_active());
+    // the connections the kernel completed that no acceptor took yet
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if (getsockopt(args->ctx->listen_fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+        metrics_write_value(out, "proxy_accept_backlog", "gauge",
+                            "Connections waiting in the listen backlog", info.tcpi_unacked);
+    }
+    metrics_write_value(out, "proxy_upstream_fetches_active", "gauge",
+                        "Requests waiting on the origin", admit_fetches());
+    metrics_write_value(out, "proxy_shedding", "gauge",
+                        "1 while requests that need the origin are shed", admit_overloaded());
+    metrics_write_value(out, "proxy_rate_limited_clients", "gauge",
+                        "Clients with a partly used rate limit at the last sweep",
+                        ratelimit_clients());
+    metrics_write_value(out, "proxy_timers_pending", "gauge", "Deadlines armed on the timer wheel",
+                        timer_pending());
+    metrics_write_value(out, "proxy_fills_active", "gauge",
+                        "Responses being fetched that other requests can follow", fill_active());
+    if (shared_cache != NULL) {
+        shm_cache_get_stats(shared_cache, &stats);
+        metrics_write_value(out, "proxy_shared_cache_bytes", "gauge",
+                            "Bytes held by the shared cache", stats.total_size);
+        metrics_write_value(out, "proxy_shared_cache_capacity_bytes", "gauge",
+                            "Slab space of the shared cache", stats.max_size);
+        metrics_write_value(out, "proxy_shared_cache_entries", "gauge",
+                            "Objects held by the shared cache", stats.len);
+        metrics_write_value(out, "proxy_shared_cache_evictions_total", "counter",
+                            "Objects evicted from the shared cache", stats.evictions);
+    }
+    if (disk_enabled()) {
+        disk_get_stats(&dstats);
+        metrics_write_value(out, "proxy_disk_bytes", "gauge", "Bytes held by the disk tier",
+                            dstats.used);
+        metrics_write_value(out, "proxy_disk_capacity_bytes", "gauge",
+                            "Configured capacity of the disk tier", dstats.max_size);
+        metrics_write_value(out, "proxy_disk_entries", "gauge", "Objects held by the disk tier",
+                            dstats.entries);
+        metrics_write_value(out, "proxy_disk_writes_total", "counter",
+                            "Evicted objects written to the disk tier", dstats.writes);
+        metrics_write_value(out, "proxy_disk_dropped_total", "counter",
+                            "Evicted objects not written to the disk tier", dstats.dropped);
+    }
+    fclose(out);
+
+    snprintf(header, sizeof(header),
+             "%s 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+             HTTP_VER_STRING, body_len);
+    args->log.status = 200;
+    args->log.first_byte_us = accesslog_since(args->log.accept_ns);
+    client_send__(args, header, strlen(header));
+    client_send__(args, body, body_len);
+    args->log.bytes_out += strlen(header) + body_len;
+    args->log.last_byte_us = accesslog_since(args->log.accept_ns);
+    free(body);
+}
+
+// whether the client connected from this host
+static bool loopback_peer__(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getpeername(fd, (struct sockaddr*)&addr, &len) != 0) {
+        return false;
+    }
+    if (addr.ss_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in*)&addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        struct in6_addr* a = &((struct sockaddr_in6*)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) ||
+               (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return false;
+}
+
+// GET reports the cache limits, PUT or POST with ?size=&object= (or shard=)
+// changes them. A shrink is applied gradually by later inserts. Only clients
+// on this host may change them, anyone else could flush the cache
+static void handle_cache_admin__(targs_t* args) {
+    char header[MAXLINE], body[MAXLINE];
+    char* query = strchr(args->request.url.path, '?');
+    cache_stats stats;
+
+    if (strcasecmp(args->request.method, "PUT") == 0 ||
+        strcasecmp(args->request.method, "POST") == 0) {
+        if (!loopback_peer__(args->fd)) {
+            reply_error__(args, args->request.method, "403", "Forbidden",
+                          "The cache can only be resized from localhost");
+            return;
+        }
+        size_t n_shards = http_cache->n_shards;
+        size_t size = 0, shard_size = 0, object = http_cache->max_object_size;
+        char* pos;
+
+        cache_get_stats(http_cache, &stats);
+        shard_size = stats.max_size / n_shards;
+        for (pos = query; pos != NULL; pos = strchr(pos + 1, '&')) {
+            bool ok = true;
+            if (strncmp(pos + 1, "size=", 5) == 0) {
+                ok = parse_size(pos + 6, &size);
+                shard_size = size / n_shards;
+            } else if (strncmp(pos + 1, "shard=", 6) == 0) {
+                ok = parse_size(pos + 7, &shard_size);
+            } else if (strncmp(pos + 1, "object=", 7) == 0) {
+                ok = parse_size(pos + 8, &object);
+            }
+            if (!ok) {
+                reply_error__(args, pos + 1, "400", "Bad Request", "Invalid cache size");
+                return;
+            }
+        }
+
+        cache_resize(http_cache, shard_size, object);
+        log_info("CACHE", "resized to %zu shard(s) of %zu bytes, objects up to %zu bytes\n",
+                 n_shards, shard_size, object);
+    } else if (strcasecmp(args->request.method, "GET") != 0) {
+        reply_error__(args, args->request.method, "405", "Method Not Allowed",
+                      "Use GET, PUT or POST");
+        return;
+    }
+
+    cache_get_stats(http_cache, &stats);
+    snprintf(body, sizeof(body),
+             "shards %zu\nsize %zu\nshard_size %zu\nmax_object_size %zu\nused %zu\n"
+             "entries %zu\n",
+             http_cache->n_shards, stats.max_size, stats.max_size / http_cache->n_shards,
+             stats.max_object_size, stats.total_size, stats.len);
+    snprintf(header, sizeof(header),
+             "%s 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+             "Connection: close\r\n\r\n",
+             HTTP_VER_STRING, strlen(body));
+    args->log.status = 200;
+    args->log.first_byte_us = accesslog_since(args->log.accept_ns);
+    client_send__(args, header, strlen(header));
+    client_send__(args, body, strlen(body));
+    args->log.bytes_out += strlen(header) + strlen(body);
+    args->log.last_byte_us = accesslog_since(args->log.accept_ns);
 }
 
-static void clienterror(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg) {
+static void clienterror(targs_t* args, char* cause, char* errnum, char* shortmsg,
+                        char* longmsg) {
     char buf[MAXLINE], body[MAXBUF];
 
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    rio_writen__(fd, buf, strlen(buf));
+    client_send__(args, buf, strlen(buf));
     sprintf(buf, "Content-type: text/html\r\n");
-    rio_writen__(fd, buf, strlen(buf));
+    client_send__(args, buf, strlen(buf));
     sprintf(body, "<html><title>Proxy Error</title>");
     sprintf(body, "%s<body bgcolor=ffffff>\r\n", body);
     sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
     sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
     sprintf(body, "%s<hr><em>Proxy</em>\r\n", body);
     sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    rio_writen__(fd, buf, strlen(buf));
-    rio_writen__(fd, body, strlen(body));
+    client_send__(args, buf, strlen(buf));
+    client_send__(args, body, strlen(body));
 }
 
-void rio_writen__(int fd, char* buf, size_t n) {
-    if (rio_writen(fd, buf, n) == n) {
-        return;
-    }
-
-    if (errno == EPIPE) {
-        return;
+// an origin that ran out of time is a 504, other failures keep their code
+static void reply_upstream_error__(targs_t* args, char* cause, char* errnum, char* longmsg) {
+    if (args->timed_out) {
+        cause = "Gateway Timeout";
+        errnum = "504";
     }
+    reply_error__(args, cause, errnum, "Proxy Error", longmsg);
+}
 
-    unix_error("rio_writen error");
+static void reply_error__(targs_t* args, char* cause, char* errnum, char* shortmsg,
+                          char* longmsg) {
+    args->log.status = atoi(errnum);
+    clienterror(args, cause, errnum, shortmsg, longmsg);
 }
 
 void sigpipe_handler(int signal) { log_warn("WARN", "Broken pipe\n"); }
+// only stops the event loops, which may be anywhere in their work.
+// shutdown__() does the rest once main() is back
 void sigint_handler(int signal) {
+    uint64_t one = 1;
+    ssize_t written = write(stop_fd, &one, sizeof(one));
+    (void)written;
+}
+
+// runs once the event loops returned. the workers finish what they serve,
+// the timers keep firing for them meanwhile, then the cache is saved and
+// everything is freed
+static void shutdown__(context_t* ctx) {
+    long waited = 0;
+
     log_info("INFO", "Closing server...\n");
-    free_cache(http_cache);
-    pthread_mutex_destroy(&mutex);
+    while (atomic_load(&workers) > 0 && waited < SHUTDOWN_TIMEOUT) {
+        usleep(10 * 1000);
+        waited += 10;
+        timer_advance();
+    }
+    // what they still use is left alone, the process ends anyway
+    if (atomic_load(&workers) > 0) {
+        log_warn("WARN", "%ld workers still running, exiting without cleanup\n",
+                 atomic_load(&workers));
+        accesslog_close();
+        if (snapshot_path != NULL) {
+            snapshot_write(snapshot_path, http_cache);
+        }
+        exit(0);
+    }
+    drain_conns__(ctx, SHUTDOWN_TIMEOUT - waited);
+    accesslog_close();
+    disk_close();
+    if (snapshot_path != NULL) {
+        snapshot_write(snapshot_path, http_cache);
+        snapshot_unload();
+    }
+    free_sharded_cache(http_cache);
+    pool_close();
+    if (shared_cache != NULL) {
+        shm_cache_close(shared_cache);
+    }
     log_info("INFO", "Bye\n");
     exit(0);
+}
+
+// sends what workers handed to the event loops and the loops did not send
+// before they returned, for at most ms. a send still in flight in the ring
+// may have taken part of its buffer already, that connection is left alone
+static void drain_conns__(context_t* ctx, long ms) {
+    struct pollfd* pfds = malloc(ctx->max_conns * sizeof(struct pollfd));
+    nfds_t n = 0;
+    uint64_t deadline_ns = accesslog_now() + (ms > 0 ? ms : 0) * 1000000ULL;
+
+    if (pfds == NULL) {
+        return;
+    }
+    for (size_t fd = 0; fd < ctx->max_conns; fd++) {
+        if (outbuf_pending(&ctx->conns[fd].out) > 0 && !ctx->conns[fd].sending) {
+            pfds[n].fd = fd;
+            pfds[n].events = POLLOUT;
+            n++;
+        }
+    }
+    while (n > 0 && accesslog_now() < deadline_ns) {
+        int ready = poll(pfds, n, (deadline_ns - accesslog_now()) / 1000000 + 1);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            break;
+        }
+        for (nfds_t i = 0; i < n;) {
+            outbuf_t* out = &ctx->conns[pfds[i].fd].out;
+            if (pfds[i].revents != 0 &&
+                (!outbuf_flush(out, pfds[i].fd) || outbuf_pending(out) == 0)) {
+                pfds[i] = pfds[--n];
+            } else {
+                i++;
+            }
+        }
+    }
+    free(pfds);
 }
\ No newline at end of file
@@ -1,55 +1,261 @@
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
 
+#include "accesslog.h"
+#include "compress.h"
 #include "csapp.h"
+#include "fill.h"
+#include "http.h"
+#include "outbuf.h"
+#include "spool.h"
+#include "timer.h"
+#include "uring.h"
 
-#define SMALL_MAXSIZE 255
-
-typedef struct {
-    char proto[SMALL_MAXSIZE];
-    char host[SMALL_MAXSIZE];
-    char path[SMALL_MAXSIZE];
-    int port;
-} URL;
+#define CACHE_ADMIN_PATH   "/__proxy/cache"
+#define KEEPALIVE_TIMEOUT  5000 /* ms */
+#define KEEPALIVE_MAX      100
+#define BODY_READ_TIMEOUT  30000 /* ms */
+#define HEADER_TIMEOUT     10000 /* ms */
+#define CONNECT_TIMEOUT    10000 /* ms */
+#define FIRST_BYTE_TIMEOUT 30000 /* ms */
+#define IDLE_TIMEOUT       30000 /* ms */
+#define REQUEST_TIMEOUT    300000 /* ms */
+#define SHUTDOWN_TIMEOUT   10000 /* ms */
+// the connection table is indexed by fd, RLIMIT_NOFILE may be far larger
+#define MAX_CONNS          (1 << 20)
+#define URING_ACCEPTS      16
+#define URING_BUFFERS      128
+#define ACCEPT_RETRY_MS    100
 
 typedef struct {
     URL url;
     char method[SMALL_MAXSIZE];
     char ver[SMALL_MAXSIZE];
     char header[MAXLINE];
+    range_t range;
+    // the client's Range header went on to the origin as it was
+    bool range_forwarded;
+    encoding_t encoding;
+    bool keep_alive;
+    bool chunked_ok;
+    long long body_length;
+    bool body_chunked;
+    bool expect_continue;
+    // the client whose rate limit the request counts towards
+    uint64_t rate_key;
 } request_t;
 
+// an accept the io_uring backend has in flight, the kernel fills the address
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    // failed, queued again by the next retry
+    bool idle;
+} accept_slot_t;
+
+// per connection state, indexed by fd. it outlives the workers of a kept
+// alive connection
 typedef struct {
-    bool succ;
-    bool has_data;
-    void* data;
-} result_t;
+    uint64_t accept_ns;
+    uint32_t client_addr;
+    uint64_t client_key;
+    unsigned int served;
+    // closes the connection while it waits for its next request or for the
+    // client to take the rest of a response
+    timer_entry_t idle;
+    outbuf_t out;
+    bool close_after;
+    // the io_uring loop has a send of out in flight
+    bool sending;
+} conn_t;
+
+// connections workers hand back to the io_uring loop, which wakes up when
+// wake_fd is written
+typedef struct {
+    pthread_mutex_t mutex;
+    int* fds;
+    size_t len;
+    size_t cap;
+    int wake_fd;
+} handback_t;
 
 typedef struct {
     char default_host[MAXLINE];
     char default_port[MAXLINE];
+    int listen_fd;
     int epoll_fd;
     struct epoll_event* events;
+    conn_t* conns;
+    size_t max_conns;
+    // the event loop's index and the NUMA node it is pinned to, -1 when
+    // it is not
+    unsigned int loop;
+    int node;
 } context_t;
 
+// the io_uring loop. requests are read into registered buffers, a
+// connection waits with a poll when none is free
+typedef struct {
+    uring_t ring;
+    context_t* ctx;
+    int listen_fd;
+    bool fixed;
+    accept_slot_t slots[URING_ACCEPTS];
+    bool retry_queued;
+    char* bufs;
+    unsigned int free_bufs[URING_BUFFERS];
+    unsigned int n_free;
+    // after a stop the loop only waits for the sends in flight
+    bool stopping;
+    unsigned int sends;
+} uring_loop_t;
+
+// what a request waits for, each with its own deadline
+typedef enum {
+    PHASE_HEADER = 0,
+    PHASE_CONNECT,
+    PHASE_FIRST_BYTE,
+    PHASE_IDLE,
+} phase_t;
+
 typedef struct {
     int fd;
     request_t request;
     context_t* ctx;
     char raw_url[MAXLINE];
+    access_record_t log;
+    rio_t rio;
+    bool keep_alive;
+    bool body_pending;
+    bool tunneled;
+    bool parked;
+    // holds one of the origin fetches admission allows
+    bool fetching;
+    // writes to the client do not wait while a response is read ahead
+    bool read_ahead;
+    // writes to the client are only buffered, the io_uring loop sends them
+    // once the worker is done
+    bool batch_writes;
+    // when the request was handed to a worker
+    uint64_t queued_ns;
+    // the origin socket a deadline shuts down, -1 when there is none
+    int server_fd;
+    phase_t phase;
+    _Atomic uint64_t progress_ms;
+    bool timed_out;
+    timer_entry_t deadline;
+    timer_entry_t total;
 } targs_t;
 
+// what the client gets of a response: all of it, or only the part its Range
+// header asked for once the head shows the response can be cut
+typedef struct {
+    targs_t* args;
+    char head[MAXLINE];
+    size_t head_len;
+    size_t size;
+    bool head_done;
+    // a HEAD, 1xx, 204 or 304: whatever body bytes come are dropped
+    bool bodyless;
+    bool sliced;
+    bool chunked;
+    bool unsatisfiable;
+    size_t body_off;
+    size_t from;
+    size_t to;
+} reply_t;
+
+// a response on its way from the origin to the fill and the client
+typedef struct {
+    targs_t* args;
+    fill_t* fill;
+    reply_t reply;
+    // what the client could not take yet while reading ahead, NULL when
+    // the response is relayed at the client's pace
+    spool_t* spool;
+    bool filling;
+    bool client_gone;
+} relay_t;
+
 void print_usage(char* program);
 static void process_request(void* targs);
 static void sync_request(int fd, const context_t* ctx);
-static void threaded_request(int fd, const context_t* ctx);
+static void threaded_request(int fd, const context_t* ctx, const char* data, size_t n);
 static void start_proxy(char* port, context_t* ctx);
+static void* acceptor__(void* ctx);
+static void pin_loop__(context_t* ctx);
+static void localize_shards__(void* node);
+static void serve_epoll__(context_t* ctx, bool timers);
+static void accept_batch__(context_t* ctx, uint64_t woke_ns);
+static void serve_uring__(int listen_fd, context_t* ctx);
+static void queue_accept__(uring_loop_t* l, unsigned int i);
+static void accept_done__(uring_loop_t* l, unsigned int i, int res, uint64_t woke_ns);
+static void queue_read__(uring_loop_t* l, int fd);
+static void read_done__(uring_loop_t* l, unsigned int buf, int fd, int res);
+static void resume__(uring_loop_t* l, int fd);
+static void send_done__(uring_loop_t* l, int fd, int res);
+static void handed_back__(uring_loop_t* l);
+static bool hand_back__(targs_t* args, bool close_after);
+static bool accepted__(context_t* ctx, int client_fd, struct sockaddr_storage* addr,
+                       socklen_t len);
 static void handle_request(void* targs);
+static bool next_request__(targs_t* args);
+static unsigned int conn_idle__(void* arg);
+static bool park__(context_t* ctx, int fd);
+static bool hand_off__(targs_t* args, bool close_after);
+static void flush_conn__(context_t* ctx, int fd);
+static void close_conn__(const context_t* ctx, int fd);
+static bool client_writev__(targs_t* args, const struct iovec* iov, int n);
+static bool client_send__(targs_t* args, const void* data, size_t n);
+static bool client_drain__(targs_t* args, size_t keep);
+static ssize_t read_line__(targs_t* args, char* buf, size_t cap);
+static unsigned int phase_expired__(void* arg);
+static unsigned int request_expired__(void* arg);
+static void enter_phase__(targs_t* args, phase_t phase);
+static void progress__(targs_t* args);
+static void watch_origin__(targs_t* args, int fd);
+static int connect_origin__(targs_t* args, const char* host, const char* port);
+static void parse_connection__(targs_t* args, const char* line);
+static void shed__(targs_t* args);
+static void rate_limited__(targs_t* args, unsigned int wait_ms);
+static void release_fetch__(targs_t* args);
+static void fetch_done__(targs_t* args);
 static void handle_request_cache__(targs_t* args, char* data, size_t size);
-static void handle_request__(targs_t* args);
-static result_t parse_url(const char* urlstr, URL* url);
-static void clienterror(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg);
-void rio_writen__(int fd, char* buf, size_t n);
+static void handle_request__(targs_t* args, fill_t* fill);
+static ssize_t read_some__(rio_t* rio, char* buf, size_t n);
+static size_t read_head__(rio_t* rio, char* head, size_t cap);
+static bool origin_closes__(const char* head, size_t head_len);
+static bool relay__(relay_t* r, const char* data, size_t n);
+static bool unspool_write__(void* reply, const char* data, size_t n);
+static void unspool__(relay_t* r);
+static bool send_buffered_body__(targs_t* args, int server_fd, size_t* left);
+static bool wait_body__(targs_t* args);
+static bool send_length_body__(targs_t* args, int server_fd);
+static bool send_chunked_body__(targs_t* args, int server_fd);
+static bool send_body__(targs_t* args, int server_fd);
+static bool handle_request_fill__(targs_t* args, fill_t* fill);
+static bool handle_request_disk__(targs_t* args);
+static bool handle_request_snapshot__(targs_t* args);
+static bool handle_request_shared__(targs_t* args);
+static bool handle_request_variant__(targs_t* args);
+static void variant_key__(char* key, size_t cap, const char* url, encoding_t encoding);
+static void reply_init__(reply_t* r, targs_t* args, size_t size);
+static bool reply_write__(reply_t* r, const char* data, size_t n);
+static bool reply_finish__(reply_t* r, bool complete);
+static void cache_store__(const char* url, const char* data, size_t size);
+static void handle_connect__(targs_t* args);
+static void handle_metrics__(targs_t* args);
+static bool loopback_peer__(int fd);
+static void handle_cache_admin__(targs_t* args);
+static void clienterror(targs_t* args, char* cause, char* errnum, char* shortmsg,
+                        char* longmsg);
+static void reply_error__(targs_t* args, char* cause, char* errnum, char* shortmsg,
+                          char* longmsg);
+static void reply_upstream_error__(targs_t* args, char* cause, char* errnum, char* longmsg);
 void sigpipe_handler(int signal);
-void sigint_handler(int signal);
\ No newline at end of file
+void sigint_handler(int signal);
+static void shutdown__(context_t* ctx);
+static void drain_conns__(context_t* ctx, long ms);
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include "pump.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// splice() and its flags are only declared with _GNU_SOURCE, which csapp.h
+// conflicts with
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE     1
+#define SPLICE_F_NONBLOCK 2
+#endif
+
+static ssize_t splice__(int in, int out, size_t len) {
+    return syscall(SYS_splice, in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+bool pump_init(pump_t* p) {
+    p->buffered = 0;
+    return pipe(p->pipe) == 0;
+}
+
+void pump_close(pump_t* p) {
+    close(p->pipe[0]);
+    close(p->pipe[1]);
+}
+
+// moves up to len bytes from the socket in into the pipe. returns 0 at the
+// end of the stream, -1 with errno EAGAIN when in has nothing to read or
+// the pipe is full
+ssize_t pump_fill(pump_t* p, int in, size_t len) {
+    if (p->buffered >= PUMP_PIPE_SIZE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (len > PUMP_PIPE_SIZE - p->buffered) {
+        len = PUMP_PIPE_SIZE - p->buffered;
+    }
+    ssize_t n = splice__(in, p->pipe[1], len);
+    if (n > 0) {
+        p->buffered += n;
+    }
+    return n;
+}
+
+// moves what the pipe holds to the socket out. returns the bytes moved, -1
+// with errno EAGAIN when out cannot take more
+ssize_t pump_drain(pump_t* p, int out) {
+    if (p->buffered == 0) {
+        return 0;
+    }
+    ssize_t n = splice__(p->pipe[0], out, p->buffered);
+    if (n > 0) {
+        p->buffered -= n;
+    }
+    return n;
+}
@@ -0,0 +1,22 @@
+#ifndef __PUMP_H__
+#define __PUMP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PUMP_PIPE_SIZE (64 * 1024)
+
+// moves bytes between two sockets through a pipe with splice(), so they
+// never enter user space. the pipe bounds what is in flight
+typedef struct {
+    int pipe[2];
+    size_t buffered;
+} pump_t;
+
+bool pump_init(pump_t* p);
+void pump_close(pump_t* p);
+ssize_t pump_fill(pump_t* p, int in, size_t len);
+ssize_t pump_drain(pump_t* p, int out);
+
+#endif
@@ -0,0 +1,152 @@
+#include "ratelimit.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+#include "logger.h"
+#include "timer.h"
+
+// Token buckets per client, as the generic cell rate algorithm: a bucket
+// is kept as the time it will be empty until (TAT). A request conforms
+// while that is at most a burst ahead of now, and pushes it one interval
+// further. Bytes are only known once the response went out, so they are
+// charged afterwards and the next request waits until the debt is under a
+// second's worth.
+//
+// The table is open addressed and lock free. An entry whose buckets are
+// full again is as good as empty: lookups take it over for another client,
+// and a sweep on the timer wheel clears those left behind so probes stay
+// short. Racing lookups may briefly give a client two entries, which only
+// makes the limit looser for a moment.
+
+static rate_entry_t table[RATE_SLOTS];
+static uint64_t request_interval;
+static uint64_t request_burst;
+static size_t byte_rate;
+static _Atomic size_t n_clients;
+static timer_entry_t sweep_timer;
+
+static uint64_t now__(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool idle__(rate_entry_t* e, uint64_t now) {
+    return atomic_load_explicit(&e->requests_tat, memory_order_relaxed) <= now &&
+           atomic_load_explicit(&e->bytes_tat, memory_order_relaxed) <= now;
+}
+
+// NULL when the probed slots are all held by busy clients, the request is
+// let through then
+static rate_entry_t* find__(uint64_t key, uint64_t now) {
+    for (unsigned int i = 0; i < RATE_PROBES; i++) {
+        rate_entry_t* e = &table[(key + i) & (RATE_SLOTS - 1)];
+        if (atomic_load(&e->key) == key) {
+            return e;
+        }
+    }
+    for (unsigned int i = 0; i < RATE_PROBES; i++) {
+        rate_entry_t* e = &table[(key + i) & (RATE_SLOTS - 1)];
+        uint64_t old = atomic_load(&e->key);
+        if (old != 0 && !idle__(e, now)) {
+            continue;
+        }
+        // whoever loses the race for the slot finds the winner's key in it
+        if (atomic_compare_exchange_strong(&e->key, &old, key) || old == key) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static unsigned int sweep__(void* unused) {
+    uint64_t now = now__();
+    size_t live = 0;
+
+    for (size_t i = 0; i < RATE_SLOTS; i++) {
+        uint64_t key = atomic_load(&table[i].key);
+        if (key == 0) {
+            continue;
+        }
+        if (!idle__(&table[i], now) || !atomic_compare_exchange_strong(&table[i].key, &key, 0)) {
+            live += 1;
+        }
+    }
+    atomic_store(&n_clients, live);
+    return RATE_SWEEP;
+}
+
+// 0 leaves a limit off. a client may burst a second's worth of requests
+void ratelimit_init(unsigned int requests_per_sec, size_t bytes_per_sec) {
+    if (requests_per_sec > 0) {
+        request_interval = 1000000000ULL / requests_per_sec;
+        request_burst = request_interval * (requests_per_sec - 1);
+    }
+    byte_rate = bytes_per_sec;
+    if (ratelimit_enabled()) {
+        timer_add(&sweep_timer, RATE_SWEEP, sweep__, NULL);
+    }
+}
+
+bool ratelimit_enabled(void) {
+    return request_interval > 0 || byte_rate > 0;
+}
+
+// FNV-1a, never 0 since that marks a free slot
+uint64_t ratelimit_key(const void* data, size_t n) {
+    const unsigned char* p = data;
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h != 0 ? h : 1;
+}
+
+// takes a request from the client's bucket. 0 when it may go on, otherwise
+// the ms until it may
+unsigned int ratelimit_check(uint64_t key) {
+    uint64_t now = now__();
+    rate_entry_t* e;
+    uint64_t tat, from;
+
+    if (!ratelimit_enabled() || (e = find__(key, now)) == NULL) {
+        return 0;
+    }
+    if (byte_rate > 0 && (tat = atomic_load(&e->bytes_tat)) > now + 1000000000ULL) {
+        return (tat - now - 1000000000ULL) / 1000000 + 1;
+    }
+    if (request_interval == 0) {
+        return 0;
+    }
+    tat = atomic_load(&e->requests_tat);
+    do {
+        from = tat > now ? tat : now;
+        if (from - now > request_burst) {
+            return (from - now - request_burst) / 1000000 + 1;
+        }
+    } while (!atomic_compare_exchange_weak(&e->requests_tat, &tat, from + request_interval));
+    return 0;
+}
+
+// puts the bytes a response took on the client's account
+void ratelimit_charge(uint64_t key, size_t bytes) {
+    uint64_t now = now__();
+    uint64_t cost, tat, from;
+    rate_entry_t* e;
+
+    if (byte_rate == 0 || bytes == 0 || (e = find__(key, now)) == NULL) {
+        return;
+    }
+    cost = (uint64_t)bytes * 1000000000ULL / byte_rate;
+    tat = atomic_load(&e->bytes_tat);
+    do {
+        from = tat > now ? tat : now;
+    } while (!atomic_compare_exchange_weak(&e->bytes_tat, &tat, from + cost));
+}
+
+// clients with a bucket that was not full at the last sweep
+size_t ratelimit_clients(void) {
+    return atomic_load(&n_clients);
+}
@@ -0,0 +1,28 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RATE_BITS   14
+#define RATE_SLOTS  (1 << RATE_BITS)
+#define RATE_PROBES 8
+#define RATE_SWEEP  10000 /* ms */
+
+// the buckets of one client. a bucket is the time it is empty until, so it
+// refills by itself and one compare and swap takes from it
+typedef struct {
+    _Atomic uint64_t key;
+    _Atomic uint64_t requests_tat;
+    _Atomic uint64_t bytes_tat;
+} rate_entry_t;
+
+void ratelimit_init(unsigned int requests_per_sec, size_t bytes_per_sec);
+bool ratelimit_enabled(void);
+uint64_t ratelimit_key(const void* data, size_t n);
+unsigned int ratelimit_check(uint64_t key);
+void ratelimit_charge(uint64_t key, size_t bytes);
+size_t ratelimit_clients(void);
+
+#endif
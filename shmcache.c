@@ -0,0 +1,357 @@
+#include "shmcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+// A cache shared by every proxy process that opens the same region.
+//
+// Writers (insert, evict) serialize on a process shared robust mutex in the
+// region header. Readers take no lock: every hash bucket carries a sequence
+// number that a writer makes odd while it changes the chain. A reader pins
+// the entry it found and then checks that the sequence did not move; an
+// evicting writer checks the pin count while the sequence is odd, so either
+// the reader retries or the writer leaves the entry alone. A pinned entry is
+// written to the client straight out of the region.
+//
+// Memory is carved into SHM_SLAB_SIZE slabs, each split into chunks of one
+// size class (classes grow by 1.25x). When a class runs out, a CLOCK hand
+// over the entry table evicts an unpinned, recently unused entry of that
+// class. Slabs are never moved between classes.
+
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((uint64_t)(a)-1))
+
+static void lock__(shm_header_t* h) {
+    // a process died holding the lock; its update may be half done, but the
+    // structure stays bounded and the next reader validates what it uses
+    if (pthread_mutex_lock(&h->mutex) == EOWNERDEAD) {
+        log_warn("SHMCACHE", "Recovering the lock of a dead process\n");
+        pthread_mutex_consistent(&h->mutex);
+    }
+}
+
+static void unlock__(shm_header_t* h) { pthread_mutex_unlock(&h->mutex); }
+
+static void init__(shm_header_t* h, size_t size) {
+    pthread_mutexattr_t attr;
+    uint64_t chunk = SHM_MIN_CHUNK;
+
+    h->version = SHM_VERSION;
+    h->size = size;
+    h->n_entries = size / SHM_BYTES_PER_ENTRY;
+    h->n_buckets = 1;
+    while (h->n_buckets < h->n_entries) {
+        h->n_buckets *= 2;
+    }
+    h->buckets_offset = ALIGN_UP(sizeof(shm_header_t), 64);
+    h->entries_offset = ALIGN_UP(h->buckets_offset + h->n_buckets * sizeof(shm_bucket_t), 64);
+    h->slabs_offset =
+        ALIGN_UP(h->entries_offset + h->n_entries * sizeof(shm_entry_t), SHM_SLAB_SIZE);
+    h->n_slabs = h->slabs_offset < size ? (size - h->slabs_offset) / SHM_SLAB_SIZE : 0;
+    h->next_slab = 0;
+
+    // every entry starts on the free list, linked through next
+    shm_entry_t* entries = (shm_entry_t*)((char*)h + h->entries_offset);
+    for (uint64_t i = 0; i < h->n_entries; i++) {
+        entries[i].next = i + 2 <= h->n_entries ? i + 2 : 0;
+    }
+    h->free_entry = h->n_entries > 0 ? 1 : 0;
+
+    for (h->n_classes = 0; h->n_classes < SHM_MAX_CLASSES && chunk < SHM_SLAB_SIZE;
+         h->n_classes++) {
+        h->classes[h->n_classes].chunk_size = chunk;
+        chunk = ALIGN_UP(chunk + chunk / 4, 8);
+    }
+    h->classes[h->n_classes - 1].chunk_size = SHM_SLAB_SIZE;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&h->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// creates the region or attaches to one another process created. a region
+// that already exists keeps its size
+shm_cache* shm_cache_open(const char* name, size_t size) {
+    char path[NAME_MAX];
+    struct stat st;
+    bool created = true;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    if ((fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(path, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        log_error("SHMCACHE", "Failed to open %s\n", path);
+        return NULL;
+    }
+
+    if (created && ftruncate(fd, size) != 0) {
+        log_error("SHMCACHE", "Failed to size %s\n", path);
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+
+    // the creator may still be sizing it
+    for (int i = 0; !created && i < 100; i++) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = st.st_size;
+            break;
+        }
+        usleep(10000);
+    }
+
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        log_error("SHMCACHE", "Failed to map %s\n", path);
+        return NULL;
+    }
+
+    shm_header_t* h = base;
+    if (created) {
+        init__(h, size);
+        atomic_store(&h->magic, SHM_MAGIC);
+    } else {
+        for (int i = 0; atomic_load(&h->magic) != SHM_MAGIC && i < 100; i++) {
+            usleep(10000);
+        }
+        if (atomic_load(&h->magic) != SHM_MAGIC || h->version != SHM_VERSION || h->size != size) {
+            log_error("SHMCACHE", "%s is not a version %d cache\n", path, SHM_VERSION);
+            munmap(base, size);
+            return NULL;
+        }
+    }
+
+    if (h->n_slabs == 0) {
+        log_error("SHMCACHE", "%s is too small for a single slab\n", path);
+        munmap(base, size);
+        return NULL;
+    }
+
+    shm_cache* sc = malloc(sizeof(shm_cache));
+    sc->header = h;
+    sc->base = base;
+    sc->buckets = (shm_bucket_t*)(sc->base + h->buckets_offset);
+    sc->entries = (shm_entry_t*)(sc->base + h->entries_offset);
+    log_info("SHMCACHE", "%s %s: %llu slabs, %llu entries\n", created ? "Created" : "Attached to",
+             path, (unsigned long long)h->n_slabs, (unsigned long long)h->n_entries);
+    return sc;
+}
+
+void shm_cache_close(shm_cache* sc) {
+    munmap(sc->base, sc->header->size);
+    free(sc);
+}
+
+bool shm_cache_get(shm_cache* sc, const char* url, shm_ref_t* ref) {
+    shm_header_t* h = sc->header;
+    uint64_t hash = cache_hash(url);
+    size_t url_len = strlen(url);
+    shm_bucket_t* b = &sc->buckets[hash & (h->n_buckets - 1)];
+
+    for (int retry = 0; retry < SHM_READ_RETRIES; retry++) {
+        uint32_t seq = atomic_load(&b->seq);
+        if (seq & 1) {
+            continue;
+        }
+
+        uint32_t idx = atomic_load(&b->head);
+        for (uint64_t steps = 0; idx != 0 && idx <= h->n_entries && steps < h->n_entries;
+             steps++) {
+            shm_entry_t* e = &sc->entries[idx - 1];
+            if (e->hash == hash && e->url_len == url_len) {
+                atomic_fetch_add(&e->pins, 1);
+                if (atomic_load(&b->seq) != seq) {
+                    atomic_fetch_sub(&e->pins, 1);
+                    break;
+                }
+
+                // the entry can no longer change under us
+                const char* chunk = sc->base + e->offset;
+                if (memcmp(chunk, url, url_len + 1) == 0) {
+                    atomic_store_explicit(&e->accessed, 1, memory_order_relaxed);
+                    ref->entry = idx;
+                    ref->content = chunk + url_len + 1;
+                    ref->size = e->size;
+                    return true;
+                }
+                atomic_fetch_sub(&e->pins, 1);
+            }
+            idx = e->next;
+        }
+
+        if (atomic_load(&b->seq) == seq) {
+            return false;
+        }
+    }
+    return false;
+}
+
+void shm_cache_release(shm_cache* sc, shm_ref_t* ref) {
+    atomic_fetch_sub(&sc->entries[ref->entry - 1].pins, 1);
+}
+
+// unlinks an unpinned entry and frees its chunk. called with the lock held
+static bool evict__(shm_cache* sc, uint32_t idx) {
+    shm_header_t* h = sc->header;
+    shm_entry_t* e = &sc->entries[idx - 1];
+    shm_bucket_t* b = &sc->buckets[e->hash & (h->n_buckets - 1)];
+    bool evicted = false;
+
+    atomic_fetch_add(&b->seq, 1);
+    if (atomic_load(&e->pins) == 0) {
+        _Atomic uint32_t* pos = &b->head;
+        while (atomic_load(pos) != 0 && atomic_load(pos) != idx) {
+            pos = &sc->entries[atomic_load(pos) - 1].next;
+        }
+        if (atomic_load(pos) == idx) {
+            atomic_store(pos, e->next);
+        }
+        evicted = true;
+    }
+    atomic_fetch_add(&b->seq, 1);
+
+    if (evicted) {
+        shm_class_t* c = &h->classes[e->cls];
+        *(uint64_t*)(sc->base + e->offset) = c->free_chunk;
+        c->free_chunk = e->offset;
+        e->in_use = 0;
+        e->next = h->free_entry;
+        h->free_entry = idx;
+        atomic_fetch_sub(&h->used, e->size + e->url_len + 1);
+        atomic_fetch_sub(&h->len, 1);
+        atomic_fetch_add(&h->evictions, 1);
+    }
+    return evicted;
+}
+
+// CLOCK over the entry table: a recently read entry gets a second chance.
+// cls < 0 evicts from any class
+static bool evict_one__(shm_cache* sc, int cls) {
+    shm_header_t* h = sc->header;
+    shm_class_t* c = &h->classes[cls < 0 ? 0 : cls];
+
+    for (int i = 0; i < SHM_EVICT_SCAN; i++) {
+        uint32_t idx = c->hand % h->n_entries + 1;
+        c->hand += 1;
+
+        shm_entry_t* e = &sc->entries[idx - 1];
+        if (!e->in_use || (cls >= 0 && e->cls != cls)) {
+            continue;
+        }
+        if (atomic_exchange_explicit(&e->accessed, 0, memory_order_relaxed)) {
+            continue;
+        }
+        if (evict__(sc, idx)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t alloc_chunk__(shm_cache* sc, int cls) {
+    shm_header_t* h = sc->header;
+    shm_class_t* c = &h->classes[cls];
+
+    if (c->free_chunk == 0 && h->next_slab < h->n_slabs) {
+        // carve a fresh slab into chunks of this class
+        uint64_t slab = h->slabs_offset + h->next_slab * SHM_SLAB_SIZE;
+        h->next_slab += 1;
+        c->slabs += 1;
+        for (uint64_t off = 0; off + c->chunk_size <= SHM_SLAB_SIZE; off += c->chunk_size) {
+            *(uint64_t*)(sc->base + slab + off) = c->free_chunk;
+            c->free_chunk = slab + off;
+        }
+    }
+    if (c->free_chunk == 0 && !evict_one__(sc, cls)) {
+        return 0;
+    }
+
+    uint64_t chunk = c->free_chunk;
+    c->free_chunk = *(uint64_t*)(sc->base + chunk);
+    return chunk;
+}
+
+shm_put_t shm_cache_put(shm_cache* sc, const char* url, const char* content, size_t size) {
+    shm_header_t* h = sc->header;
+    uint64_t hash = cache_hash(url);
+    size_t url_len = strlen(url);
+    size_t need = url_len + 1 + size;
+    int cls = 0;
+
+    while (cls < h->n_classes && h->classes[cls].chunk_size < need) {
+        cls++;
+    }
+    if (cls == h->n_classes) {
+        return SHM_PUT_NO_ROOM;
+    }
+
+    lock__(h);
+    shm_bucket_t* b = &sc->buckets[hash & (h->n_buckets - 1)];
+    for (uint32_t idx = atomic_load(&b->head); idx != 0; idx = sc->entries[idx - 1].next) {
+        shm_entry_t* e = &sc->entries[idx - 1];
+        if (e->hash == hash && e->url_len == url_len &&
+            memcmp(sc->base + e->offset, url, url_len) == 0) {
+            // another process filled it first
+            unlock__(h);
+            return SHM_PUT_PRESENT;
+        }
+    }
+
+    if (h->free_entry == 0 && !evict_one__(sc, -1)) {
+        unlock__(h);
+        return SHM_PUT_NO_ROOM;
+    }
+    uint64_t chunk = alloc_chunk__(sc, cls);
+    if (chunk == 0) {
+        unlock__(h);
+        return SHM_PUT_NO_ROOM;
+    }
+    uint32_t idx = h->free_entry;
+    shm_entry_t* e = &sc->entries[idx - 1];
+    h->free_entry = e->next;
+
+    // fill the chunk before the entry becomes reachable
+    memcpy(sc->base + chunk, url, url_len + 1);
+    memcpy(sc->base + chunk + url_len + 1, content, size);
+    e->hash = hash;
+    e->offset = chunk;
+    e->size = size;
+    e->url_len = url_len;
+    e->cls = cls;
+    e->in_use = 1;
+    atomic_store(&e->pins, 0);
+    atomic_store(&e->accessed, 0);
+
+    atomic_fetch_add(&b->seq, 1);
+    e->next = atomic_load(&b->head);
+    atomic_store(&b->head, idx);
+    atomic_fetch_add(&b->seq, 1);
+
+    atomic_fetch_add(&h->used, need);
+    atomic_fetch_add(&h->len, 1);
+    unlock__(h);
+    return SHM_PUT_STORED;
+}
+
+void shm_cache_get_stats(shm_cache* sc, cache_stats* stats) {
+    shm_header_t* h = sc->header;
+    stats->total_size = atomic_load(&h->used);
+    stats->len = atomic_load(&h->len);
+    stats->evictions = atomic_load(&h->evictions);
+    stats->max_size = h->n_slabs * SHM_SLAB_SIZE;
+    stats->max_object_size = SHM_SLAB_SIZE - SHM_MIN_CHUNK;
+}
@@ -0,0 +1,98 @@
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache.h"
+
+#define SHM_MAGIC           0x48535850 /* "PXSH" */
+#define SHM_VERSION         1
+#define SHM_SLAB_SIZE       (1UL << 20)
+#define SHM_MIN_CHUNK       64
+#define SHM_MAX_CLASSES     64
+#define SHM_BYTES_PER_ENTRY 512
+#define SHM_EVICT_SCAN      1024
+#define SHM_READ_RETRIES    64
+#define SHM_DEFAULT_SIZE    (64UL << 20)
+
+// one object: the url (NUL terminated) and the content share a chunk
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t size;
+    _Atomic uint32_t pins;
+    _Atomic uint32_t next;
+    uint32_t url_len;
+    uint8_t cls;
+    uint8_t in_use;
+    _Atomic uint8_t accessed;
+} shm_entry_t;
+
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t head;
+} shm_bucket_t;
+
+typedef struct {
+    uint64_t chunk_size;
+    uint64_t free_chunk;
+    uint64_t slabs;
+    uint32_t hand;
+} shm_class_t;
+
+// everything below lives in the shared region, so it holds offsets and entry
+// numbers (1 based, 0 is none) rather than pointers
+typedef struct {
+    _Atomic uint32_t magic;
+    uint16_t version;
+    uint16_t n_classes;
+    uint64_t size;
+    uint64_t n_buckets;
+    uint64_t n_entries;
+    uint64_t buckets_offset;
+    uint64_t entries_offset;
+    uint64_t slabs_offset;
+    uint64_t n_slabs;
+    uint64_t next_slab;
+    uint32_t free_entry;
+    pthread_mutex_t mutex;
+    shm_class_t classes[SHM_MAX_CLASSES];
+    _Atomic uint64_t used;
+    _Atomic uint64_t len;
+    _Atomic uint64_t evictions;
+} shm_header_t;
+
+typedef struct {
+    shm_header_t* header;
+    char* base;
+    shm_bucket_t* buckets;
+    shm_entry_t* entries;
+} shm_cache;
+
+// a pinned object, content points into the shared region
+typedef struct {
+    uint32_t entry;
+    const char* content;
+    size_t size;
+} shm_ref_t;
+
+typedef enum {
+    SHM_PUT_STORED = 0,
+    // another process stored the url first
+    SHM_PUT_PRESENT,
+    // too large for any class, or no room could be made
+    SHM_PUT_NO_ROOM,
+} shm_put_t;
+
+shm_cache* shm_cache_open(const char* name, size_t size);
+void shm_cache_close(shm_cache* sc);
+bool shm_cache_get(shm_cache* sc, const char* url, shm_ref_t* ref);
+void shm_cache_release(shm_cache* sc, shm_ref_t* ref);
+shm_put_t shm_cache_put(shm_cache* sc, const char* url, const char* content, size_t size);
+void shm_cache_get_stats(shm_cache* sc, cache_stats* stats);
+
+#endif
@@ -0,0 +1,395 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+// The snapshot loaded at startup stays mapped read only. Only its index is
+// validated up front; an entry's payload is paged in and checked against its
+// crc the first time it is asked for, so the proxy serves right away and a
+// cold entry costs nothing until it is used.
+
+_Static_assert(sizeof(snapshot_header_t) == 64, "snapshot_header_t must be 64 bytes");
+_Static_assert(sizeof(snapshot_data_header_t) == 64, "snapshot_data_header_t must be 64 bytes");
+
+enum { ENTRY_UNCHECKED = 0, ENTRY_GOOD, ENTRY_BAD };
+
+static const snapshot_header_t* header = NULL;
+static const uint32_t* buckets = NULL;
+static const snapshot_entry_t* entries = NULL;
+static const char* data = NULL;
+static size_t index_len = 0, data_len = 0;
+static _Atomic uint8_t* checked = NULL;
+
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+// set by snapshot_unload(), the writes of the schedule thread stop then
+static bool stopped = false;
+
+typedef struct {
+    char* path;
+    sharded_cache* sc;
+    unsigned int interval;
+} schedule_t;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init__(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+// CRC-32 (IEEE), chainable by passing the previous result as crc
+static uint32_t crc32__(uint32_t crc, const void* buf, size_t len) {
+    const unsigned char* p = buf;
+
+    pthread_once(&crc_once, crc_init__);
+    crc = ~crc;
+    while (len-- > 0) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static const void* map__(const char* path, size_t* len) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    *len = st.st_size;
+    return p;
+}
+
+static char* data_path__(const char* path, const char* suffix) {
+    size_t len = strlen(path) + strlen(suffix) + 1;
+    char* p = malloc(len);
+    snprintf(p, len, "%s%s", path, suffix);
+    return p;
+}
+
+static bool valid__(const snapshot_header_t* h, size_t len) {
+    if (len < sizeof(*h) || h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+        h->entry_size != sizeof(snapshot_entry_t)) {
+        return false;
+    }
+    if (crc32__(0, h, offsetof(snapshot_header_t, header_crc)) != h->header_crc) {
+        return false;
+    }
+    if ((h->n_buckets & (h->n_buckets - 1)) != 0 || h->n_entries > h->n_buckets ||
+        len != sizeof(*h) + h->n_buckets * sizeof(uint32_t) +
+                   h->n_entries * sizeof(snapshot_entry_t)) {
+        return false;
+    }
+    return crc32__(0, h + 1, len - sizeof(*h)) == h->index_crc;
+}
+
+bool snapshot_load(const char* path) {
+    char* dpath = data_path__(path, ".data");
+    const snapshot_header_t* h = map__(path, &index_len);
+    const snapshot_data_header_t* dh = map__(dpath, &data_len);
+    free(dpath);
+
+    if (h == NULL || dh == NULL || !valid__(h, index_len) || data_len < sizeof(*dh) ||
+        dh->magic != SNAPSHOT_DATA_MAGIC || dh->created_ns != h->created_ns ||
+        data_len - sizeof(*dh) != h->data_size) {
+        if (h != NULL || dh != NULL) {
+            log_warn("SNAPSHOT", "Ignoring missing or corrupt snapshot %s\n", path);
+        }
+        if (h != NULL) {
+            munmap((void*)h, index_len);
+        }
+        if (dh != NULL) {
+            munmap((void*)dh, data_len);
+        }
+        return false;
+    }
+
+    // payloads are touched in lookup order, not sequentially
+    madvise((void*)dh, data_len, MADV_RANDOM);
+
+    header = h;
+    buckets = (const uint32_t*)(h + 1);
+    entries = (const snapshot_entry_t*)(buckets + h->n_buckets);
+    data = (const char*)(dh + 1);
+    checked = calloc(h->n_entries ? h->n_entries : 1, sizeof(uint8_t));
+    log_info("SNAPSHOT", "Loaded %llu objects (%llu bytes) from %s\n",
+             (unsigned long long)h->n_entries, (unsigned long long)h->data_size, path);
+    return true;
+}
+
+// waits for a write in progress, which may still read the loaded snapshot
+void snapshot_unload(void) {
+    pthread_mutex_lock(&write_mutex);
+    stopped = true;
+    if (header != NULL) {
+        munmap((void*)header, index_len);
+        munmap((void*)(data - sizeof(snapshot_data_header_t)), data_len);
+        free((void*)checked);
+        header = NULL;
+    }
+    pthread_mutex_unlock(&write_mutex);
+}
+
+static bool check__(uint64_t i) {
+    const snapshot_entry_t* e = &entries[i];
+    uint8_t state = atomic_load_explicit(&checked[i], memory_order_relaxed);
+
+    if (state == ENTRY_UNCHECKED) {
+        bool ok = e->url_offset + e->url_len <= header->data_size &&
+                  e->offset + e->size <= header->data_size &&
+                  crc32__(crc32__(0, data + e->url_offset, e->url_len), data + e->offset,
+                          e->size) == e->crc;
+        state = ok ? ENTRY_GOOD : ENTRY_BAD;
+        atomic_store_explicit(&checked[i], state, memory_order_relaxed);
+        if (!ok) {
+            log_warn("SNAPSHOT", "Checksum mismatch, dropping entry %llu\n",
+                     (unsigned long long)i);
+        }
+    }
+    return state == ENTRY_GOOD;
+}
+
+// returns a pointer into the mapping, valid until snapshot_unload()
+bool snapshot_find(const char* url, const char** content, size_t* size) {
+    if (header == NULL) {
+        return false;
+    }
+
+    uint64_t hash = cache_hash(url);
+    size_t url_len = strlen(url);
+    for (uint64_t b = hash & (header->n_buckets - 1);; b = (b + 1) & (header->n_buckets - 1)) {
+        uint32_t slot = buckets[b];
+        if (slot == 0 || slot > header->n_entries) {
+            return false;
+        }
+
+        const snapshot_entry_t* e = &entries[slot - 1];
+        if (e->hash == hash && e->url_len == url_len &&
+            e->url_offset + url_len <= header->data_size &&
+            memcmp(data + e->url_offset, url, url_len) == 0) {
+            if (!check__(slot - 1)) {
+                return false;
+            }
+            *content = data + e->offset;
+            *size = e->size;
+            return true;
+        }
+    }
+}
+
+typedef struct {
+    FILE* out;
+    uint32_t* buckets;
+    snapshot_entry_t* entries;
+    const char** urls;
+    uint64_t n_buckets;
+    uint64_t n_entries;
+    uint64_t offset;
+    uint64_t budget;
+} builder_t;
+
+// url is not NUL terminated when it comes from the loaded snapshot
+static void add__(builder_t* b, uint64_t hash, const char* url, size_t url_len,
+                  const char* content, size_t size) {
+    uint64_t slot = hash & (b->n_buckets - 1);
+
+    if (b->offset + url_len + size > b->budget) {
+        return;
+    }
+
+    // concurrent misses can insert the same url twice, keep the newest
+    for (; b->buckets[slot] != 0; slot = (slot + 1) & (b->n_buckets - 1)) {
+        snapshot_entry_t* e = &b->entries[b->buckets[slot] - 1];
+        if (e->hash == hash && e->url_len == url_len &&
+            memcmp(b->urls[b->buckets[slot] - 1], url, url_len) == 0) {
+            return;
+        }
+    }
+
+    snapshot_entry_t* e = &b->entries[b->n_entries];
+    e->hash = hash;
+    e->url_offset = b->offset;
+    e->url_len = url_len;
+    e->offset = b->offset + url_len;
+    e->size = size;
+    e->crc = crc32__(crc32__(0, url, url_len), content, size);
+    fwrite(url, 1, url_len, b->out);
+    fwrite(content, 1, size, b->out);
+
+    b->urls[b->n_entries] = url;
+    b->n_entries += 1;
+    b->buckets[slot] = b->n_entries;
+    b->offset += url_len + size;
+}
+
+static bool flush__(FILE* out) {
+    bool ok = fflush(out) == 0 && fsync(fileno(out)) == 0;
+    return fclose(out) == 0 && ok;
+}
+
+// writes the memory tier, then entries of the loaded snapshot that were never
+// paged in, up to the cache capacity. files are replaced atomically
+bool snapshot_write(const char* path, sharded_cache* sc) {
+    cacheline** lines;
+    cache_stats stats;
+    snapshot_header_t h;
+    snapshot_data_header_t dh;
+    builder_t b;
+    bool ok;
+
+    pthread_mutex_lock(&write_mutex);
+    if (stopped) {
+        pthread_mutex_unlock(&write_mutex);
+        return false;
+    }
+    char* tmp = data_path__(path, ".tmp");
+    char* dpath = data_path__(path, ".data");
+    char* dtmp = data_path__(path, ".data.tmp");
+
+    cache_get_stats(sc, &stats);
+    size_t n_lines = cache_collect(sc, &lines);
+    uint64_t n_max = n_lines + (header != NULL ? header->n_entries : 0);
+
+    memset(&b, 0x00, sizeof(b));
+    b.budget = stats.max_size;
+    b.n_buckets = 16;
+    while (b.n_buckets < n_max * 2) {
+        b.n_buckets *= 2;
+    }
+    b.buckets = calloc(b.n_buckets, sizeof(uint32_t));
+    b.entries = calloc(n_max ? n_max : 1, sizeof(snapshot_entry_t));
+    b.urls = calloc(n_max ? n_max : 1, sizeof(char*));
+
+    memset(&dh, 0x00, sizeof(dh));
+    dh.magic = SNAPSHOT_DATA_MAGIC;
+    dh.version = SNAPSHOT_VERSION;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    dh.created_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    if ((b.out = fopen(dtmp, "w")) == NULL) {
+        log_error("SNAPSHOT", "Failed to create %s\n", dtmp);
+        ok = false;
+        goto DONE;
+    }
+    fwrite(&dh, sizeof(dh), 1, b.out);
+
+    for (size_t i = 0; i < n_lines; i++) {
+        add__(&b, cache_hash(lines[i]->url), lines[i]->url, strlen(lines[i]->url),
+              lines[i]->content, lines[i]->size);
+    }
+    for (uint64_t i = 0; header != NULL && i < header->n_entries; i++) {
+        if (check__(i)) {
+            add__(&b, entries[i].hash, data + entries[i].url_offset, entries[i].url_len,
+                  data + entries[i].offset, entries[i].size);
+        }
+    }
+
+    ok = !ferror(b.out);
+    ok = flush__(b.out) && ok;
+
+    memset(&h, 0x00, sizeof(h));
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.entry_size = sizeof(snapshot_entry_t);
+    h.created_ns = dh.created_ns;
+    h.n_entries = b.n_entries;
+    h.n_buckets = b.n_buckets;
+    h.data_size = b.offset;
+    h.index_crc = crc32__(crc32__(0, b.buckets, b.n_buckets * sizeof(uint32_t)), b.entries,
+                          b.n_entries * sizeof(snapshot_entry_t));
+    h.header_crc = crc32__(0, &h, offsetof(snapshot_header_t, header_crc));
+
+    FILE* out = ok ? fopen(tmp, "w") : NULL;
+    if (out != NULL) {
+        fwrite(&h, sizeof(h), 1, out);
+        fwrite(b.buckets, sizeof(uint32_t), b.n_buckets, out);
+        fwrite(b.entries, sizeof(snapshot_entry_t), b.n_entries, out);
+        ok = !ferror(out);
+        ok = flush__(out) && ok;
+    } else {
+        ok = false;
+    }
+
+    // the data file goes first: a new data file with the old index fails the
+    // created_ns check on load instead of serving mismatched objects
+    ok = ok && rename(dtmp, dpath) == 0 && rename(tmp, path) == 0;
+    if (ok) {
+        log_info("SNAPSHOT", "Wrote %llu objects (%llu bytes) to %s\n",
+                 (unsigned long long)b.n_entries, (unsigned long long)b.offset, path);
+    } else {
+        log_error("SNAPSHOT", "Failed to write %s\n", path);
+        unlink(tmp);
+        unlink(dtmp);
+    }
+
+DONE:
+    for (size_t i = 0; i < n_lines; i++) {
+        release_cacheline(lines[i]);
+    }
+    free(lines);
+    free(b.buckets);
+    free(b.entries);
+    free(b.urls);
+    free(tmp);
+    free(dpath);
+    free(dtmp);
+    pthread_mutex_unlock(&write_mutex);
+    return ok;
+}
+
+static void* schedule__(void* arg) {
+    schedule_t* s = arg;
+    sigset_t mask;
+
+    // the stop is for the event loops, this thread keeps sleeping through it
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    pthread_detach(pthread_self());
+    while (true) {
+        sleep(s->interval);
+        snapshot_write(s->path, s->sc);
+    }
+    return NULL;
+}
+
+void snapshot_schedule(const char* path, sharded_cache* sc, unsigned int interval) {
+    pthread_t tid;
+    schedule_t* s = malloc(sizeof(schedule_t));
+    s->path = strdup(path);
+    s->sc = sc;
+    s->interval = interval;
+    if (pthread_create(&tid, NULL, schedule__, s) != 0) {
+        log_error("SNAPSHOT", "Failed to start the snapshot thread\n");
+        free(s->path);
+        free(s);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache.h"
+
+#define SNAPSHOT_MAGIC      0x4e535850 /* "PXSN" */
+#define SNAPSHOT_DATA_MAGIC 0x44535850 /* "PXSD" */
+#define SNAPSHOT_VERSION    1
+
+// <path> holds the index: this header, an open addressing table of
+// n_buckets entry numbers (0 is empty, otherwise index + 1) and n_entries
+// entries. <path>.data holds a data header followed by urls and contents.
+// Both files are used in place through mmap().
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint64_t created_ns;
+    uint64_t n_entries;
+    uint64_t n_buckets;
+    uint64_t data_size;
+    uint32_t index_crc;
+    uint32_t header_crc;
+    char reserved[16];
+} snapshot_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved0;
+    uint64_t created_ns;
+    char reserved[48];
+} snapshot_data_header_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t url_offset;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t url_len;
+    uint32_t crc;
+} snapshot_entry_t;
+
+bool snapshot_load(const char* path);
+void snapshot_unload(void);
+bool snapshot_find(const char* url, const char** data, size_t* size);
+bool snapshot_write(const char* path, sharded_cache* sc);
+void snapshot_schedule(const char* path, sharded_cache* sc, unsigned int interval);
+
+#endif
@@ -0,0 +1,145 @@
+#include "spool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+// Responses read ahead of slow clients. The origin is read as fast as it
+// sends and its connection goes back to the pool before the client got
+// everything. Up to the memory budget a response is held in memory, the
+// rest goes to a temp file that is unlinked right away, so it is gone with
+// its fd whatever happens to the request.
+
+static bool enabled = false;
+static const char* spool_dir = SPOOL_DEFAULT_DIR;
+static size_t spool_memory = SPOOL_DEFAULT_MEMORY;
+
+void spool_enable(const char* dir, size_t memory) {
+    enabled = true;
+    spool_dir = dir != NULL ? dir : SPOOL_DEFAULT_DIR;
+    spool_memory = memory;
+}
+
+bool spool_enabled(void) {
+    return enabled;
+}
+
+void spool_init(spool_t* s) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+// all of data or none of it: what a failed write left in the file is cut
+// off again, replay would hand it out twice otherwise
+static bool spill__(spool_t* s, const char* data, size_t n) {
+    char path[4096];
+    size_t start = s->file_len;
+
+    if (s->file_len + n > SPOOL_FILE_MAX) {
+        return false;
+    }
+    if (s->fd < 0) {
+        snprintf(path, sizeof(path), "%s/proxy-spool-XXXXXX", spool_dir);
+        if ((s->fd = mkstemp(path)) < 0) {
+            log_error("ERROR", "Failed to create a spool file in %s\n", spool_dir);
+            return false;
+        }
+        unlink(path);
+        metrics_inc(COUNTER_SPOOL_SPILLS, 1);
+    }
+    // pwrite() at file_len, so a rollback needs no seek
+    while (n > 0) {
+        ssize_t written = pwrite(s->fd, data, n, s->file_len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            metrics_gauge_add(GAUGE_SPOOLED, -(int64_t)(s->file_len - start));
+            s->file_len = start;
+            if (ftruncate(s->fd, start) != 0) {
+                log_warn("WARN", "Failed to truncate a spool file\n");
+            }
+            return false;
+        }
+        data += written;
+        n -= written;
+        s->file_len += written;
+        metrics_gauge_add(GAUGE_SPOOLED, written);
+    }
+    return true;
+}
+
+// false when the response does not fit, the caller then relays it
+bool spool_append(spool_t* s, const char* data, size_t n) {
+    size_t take = 0;
+
+    // once spilling, everything goes to the file to stay in order
+    if (s->fd < 0 && s->len < spool_memory) {
+        take = spool_memory - s->len < n ? spool_memory - s->len : n;
+        if (s->len + take > s->cap) {
+            size_t cap = s->cap * 2 > s->len + take ? s->cap * 2 : s->len + take;
+            cap = cap < spool_memory ? cap : spool_memory;
+            char* data_new = realloc(s->data, cap);
+            if (data_new == NULL) {
+                return false;
+            }
+            s->data = data_new;
+            s->cap = cap;
+        }
+        memcpy(s->data + s->len, data, take);
+        s->len += take;
+        metrics_gauge_add(GAUGE_SPOOLED, take);
+    }
+    if (take == n || spill__(s, data + take, n - take)) {
+        return true;
+    }
+    // the caller relays all of data, so none of it may stay here
+    s->len -= take;
+    metrics_gauge_add(GAUGE_SPOOLED, -(int64_t)take);
+    return false;
+}
+
+// hands everything spooled to fn in pieces of at most SPOOL_CHUNK, the
+// memory part first
+bool spool_replay(spool_t* s, spool_fn fn, void* arg) {
+    for (size_t off = 0; off < s->len; off += SPOOL_CHUNK) {
+        size_t n = s->len - off < SPOOL_CHUNK ? s->len - off : SPOOL_CHUNK;
+        if (!fn(arg, s->data + off, n)) {
+            return false;
+        }
+    }
+    if (s->fd < 0) {
+        return true;
+    }
+
+    char* buf = malloc(SPOOL_CHUNK);
+    bool ok = buf != NULL;
+    for (size_t off = 0; ok && off < s->file_len;) {
+        ssize_t n = pread(s->fd, buf, SPOOL_CHUNK, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = n > 0 && fn(arg, buf, n);
+        off += n > 0 ? n : 0;
+    }
+    free(buf);
+    return ok;
+}
+
+size_t spool_size(const spool_t* s) {
+    return s->len + s->file_len;
+}
+
+void spool_free(spool_t* s) {
+    metrics_gauge_add(GAUGE_SPOOLED, -(int64_t)spool_size(s));
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    free(s->data);
+    spool_init(s);
+}
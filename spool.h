@@ -0,0 +1,35 @@
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SPOOL_DEFAULT_MEMORY (1024 * 1024)
+#define SPOOL_DEFAULT_DIR    "/tmp"
+// a response larger than this is relayed at the client's pace instead
+#define SPOOL_FILE_MAX       (1024L * 1024 * 1024)
+#define SPOOL_CHUNK          (64 * 1024)
+
+// a response read ahead of a slow client: the first bytes in memory, the
+// rest in an unlinked temp file once memory ran out
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    // the spill file, -1 until there is one
+    int fd;
+    size_t file_len;
+} spool_t;
+
+// gets the spooled bytes in order, false stops the replay
+typedef bool (*spool_fn)(void* arg, const char* data, size_t n);
+
+void spool_enable(const char* dir, size_t memory);
+bool spool_enabled(void);
+void spool_init(spool_t* s);
+bool spool_append(spool_t* s, const char* data, size_t n);
+bool spool_replay(spool_t* s, spool_fn fn, void* arg);
+size_t spool_size(const spool_t* s);
+void spool_free(spool_t* s);
+
+#endif
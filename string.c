@@ -1,6 +1,8 @@
 #include "string.h"
 
+#include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -80,4 +82,49 @@ char* fast_strstr(const char* haystack, const char* needle) {
 
     free(lps);
     return NULL;
+}
+
+// parses a byte count with an optional K, M or G suffix (powers of 1024).
+// a count that does not fit in a size_t is invalid
+bool parse_size(const char* str, size_t* size) {
+    char* end = NULL;
+    unsigned long long value;
+    unsigned int shift = 0;
+
+    if (str == NULL || *str < '0' || *str > '9') {
+        return false;
+    }
+
+    errno = 0;
+    value = strtoull(str, &end, 10);
+    if (errno == ERANGE || value > SIZE_MAX) {
+        return false;
+    }
+    switch (*end) {
+        case 'g':
+        case 'G':
+            shift += 10;
+        case 'm':
+        case 'M':
+            shift += 10;
+        case 'k':
+        case 'K':
+            shift += 10;
+            end++;
+        default:
+            break;
+    }
+    if (value > SIZE_MAX >> shift) {
+        return false;
+    }
+    value <<= shift;
+
+    if (*end == 'b' || *end == 'B') {
+        end++;
+    }
+    if (*end != '\0' && *end != '&') {
+        return false;
+    }
+    *size = value;
+    return true;
 }
\ No newline at end of file
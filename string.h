@@ -1,5 +1,7 @@
+#include <stdbool.h>
 #include <stdlib.h>
 
 int endsWith(const char* str, const char* suffix);
 char* strncatf(char* c, size_t n, char* format, ...);
-char* fast_strstr(const char* haystack, const char* needle);
\ No newline at end of file
+char* fast_strstr(const char* haystack, const char* needle);
+bool parse_size(const char* str, size_t* size);
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "tcpopt.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "string.h"
+
+// The TCP profile of the proxy, set once from the command line. Options
+// set on the listener carry over to the sockets accept() returns, so
+// clients cost no extra system calls; origin sockets get theirs before they
+// connect. The profile is a comma separated list, e.g.
+// "nodelay,cork,fastopen=256,rcvbuf=256K,backlog=4096", or "none".
+
+// what TCPOPT_DEFAULT spells out
+static tcpopt_t profile = {.nodelay = true, .quickack = true};
+
+static bool parse_int__(const char* value, int* out) {
+    size_t n;
+
+    if (value == NULL || !parse_size(value, &n) || n > 1 << 30) {
+        return false;
+    }
+    *out = n;
+    return true;
+}
+
+static bool parse_token__(tcpopt_t* p, char* token) {
+    char* value = strchr(token, '=');
+
+    if (value != NULL) {
+        *value++ = '\0';
+    }
+    if (strcmp(token, "none") == 0 && value == NULL) {
+        memset(p, 0, sizeof(*p));
+    } else if (strcmp(token, "nodelay") == 0 && value == NULL) {
+        p->nodelay = true;
+    } else if (strcmp(token, "quickack") == 0 && value == NULL) {
+        p->quickack = true;
+    } else if (strcmp(token, "cork") == 0 && value == NULL) {
+        p->cork = true;
+    } else if (strcmp(token, "fastopen") == 0) {
+        p->fastopen = TCPOPT_FASTOPEN_QLEN;
+        return value == NULL || parse_int__(value, &p->fastopen);
+    } else if (strcmp(token, "defer") == 0) {
+        p->defer_accept = TCPOPT_DEFER_SECS;
+        return value == NULL || parse_int__(value, &p->defer_accept);
+    } else if (strcmp(token, "rcvbuf") == 0) {
+        return parse_int__(value, &p->rcvbuf);
+    } else if (strcmp(token, "sndbuf") == 0) {
+        return parse_int__(value, &p->sndbuf);
+    } else if (strcmp(token, "backlog") == 0) {
+        return parse_int__(value, &p->backlog);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// replaces the profile, which is left alone when spec does not parse
+bool tcpopt_parse(const char* spec) {
+    tcpopt_t p = {0};
+    char* copy = strdup(spec);
+    char* save = NULL;
+    bool ok = true;
+
+    for (char* token = strtok_r(copy, ",", &save); ok && token != NULL;
+         token = strtok_r(NULL, ",", &save)) {
+        ok = parse_token__(&p, token);
+    }
+    free(copy);
+    if (ok) {
+        profile = p;
+    }
+    return ok;
+}
+
+void tcpopt_describe(char* buf, size_t cap) {
+    size_t len = snprintf(buf, cap, "%s%s%s", profile.nodelay ? ",nodelay" : "",
+                          profile.quickack ? ",quickack" : "", profile.cork ? ",cork" : "");
+
+    if (profile.fastopen > 0 && len < cap) {
+        len += snprintf(buf + len, cap - len, ",fastopen=%d", profile.fastopen);
+    }
+    if (profile.defer_accept > 0 && len < cap) {
+        len += snprintf(buf + len, cap - len, ",defer=%d", profile.defer_accept);
+    }
+    if (profile.rcvbuf > 0 && len < cap) {
+        len += snprintf(buf + len, cap - len, ",rcvbuf=%d", profile.rcvbuf);
+    }
+    if (profile.sndbuf > 0 && len < cap) {
+        len += snprintf(buf + len, cap - len, ",sndbuf=%d", profile.sndbuf);
+    }
+    if (profile.backlog > 0 && len < cap) {
+        len += snprintf(buf + len, cap - len, ",backlog=%d", profile.backlog);
+    }
+    // drop the leading comma
+    if (len == 0 || len >= cap) {
+        snprintf(buf, cap, "none");
+    } else {
+        memmove(buf, buf + 1, len);
+    }
+}
+
+static void set__(int fd, int level, int name, int value, const char* what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) {
+        log_warn("WARN", "Failed to set %s on fd %d\n", what, fd);
+    }
+}
+
+// the buffer sizes also bound the window scale, which is fixed by the
+// handshake, so they are set before anything connects
+static void buffers__(int fd) {
+    if (profile.rcvbuf > 0) {
+        set__(fd, SOL_SOCKET, SO_RCVBUF, profile.rcvbuf, "SO_RCVBUF");
+    }
+    if (profile.sndbuf > 0) {
+        set__(fd, SOL_SOCKET, SO_SNDBUF, profile.sndbuf, "SO_SNDBUF");
+    }
+}
+
+// a listening socket only takes the new backlog with another listen()
+bool tcpopt_listener(int fd) {
+    buffers__(fd);
+    if (profile.nodelay) {
+        set__(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    // accept() returns once the request arrived, not after the handshake
+    if (profile.defer_accept > 0) {
+        set__(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile.defer_accept, "TCP_DEFER_ACCEPT");
+    }
+    if (profile.fastopen > 0) {
+        set__(fd, IPPROTO_TCP, TCP_FASTOPEN, profile.fastopen, "TCP_FASTOPEN");
+    }
+    if (profile.backlog > 0 && listen(fd, profile.backlog) != 0) {
+        log_error("ERROR", "Failed to listen with a backlog of %d\n", profile.backlog);
+        return false;
+    }
+    return true;
+}
+
+// called before connect(). with fastopen the request goes out in the SYN,
+// and connect() returns before the handshake, so a refused connection only
+// shows on the first write. the caller asks for it only where there is no
+// other address to fall back to
+void tcpopt_upstream(int fd, bool fastopen) {
+    buffers__(fd);
+    if (profile.nodelay) {
+        set__(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (profile.fastopen > 0 && fastopen) {
+        set__(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+    }
+}
+
+// the kernel falls back to delayed ACKs by itself, so this is set again
+// each time a reply is expected
+void tcpopt_quickack(int fd) {
+    if (profile.quickack) {
+        set__(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+}
+
+// holds partial segments back while corked, uncorking sends them
+void tcpopt_cork(int fd, bool on) {
+    if (profile.cork) {
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &(int){on}, sizeof(int));
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef __TCPOPT_H__
+#define __TCPOPT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TCPOPT_DEFAULT       "nodelay,quickack"
+#define TCPOPT_FASTOPEN_QLEN 256
+#define TCPOPT_DEFER_SECS    1
+
+// socket options applied to the listener, and so to accepted clients, and
+// to origin connections. 0 leaves the kernel's default
+typedef struct {
+    bool nodelay;
+    bool quickack;
+    bool cork;
+    int fastopen;
+    int defer_accept;
+    int rcvbuf;
+    int sndbuf;
+    int backlog;
+} tcpopt_t;
+
+bool tcpopt_parse(const char* spec);
+void tcpopt_describe(char* buf, size_t cap);
+bool tcpopt_listener(int fd);
+void tcpopt_upstream(int fd, bool fastopen);
+void tcpopt_quickack(int fd);
+void tcpopt_cork(int fd, bool on);
+
+#endif
@@ -0,0 +1,219 @@
+#include "timer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+// Deadlines on a hierarchical timing wheel. Level 0 has a slot per tick,
+// every level above covers TIMER_SLOTS times the span of the one below, so
+// adding and cancelling are O(1) whatever the number of timers. A slot of a
+// higher level is spread over the level below when the wheel reaches it.
+//
+// The event loop drives the wheel: it sleeps until timer_next_ms() and
+// calls timer_advance() when it wakes. Timers are added from the workers, a
+// timer due before the loop would wake up wakes it through timer_wake_fd().
+
+static timer_entry_t* wheel[TIMER_LEVELS][TIMER_SLOTS];
+static size_t n_level[TIMER_LEVELS];
+static size_t n_pending;
+// the next tick to run
+static uint64_t base;
+// the tick the loop sleeps until
+static uint64_t wake_tick = UINT64_MAX;
+static int wake_fd = -1;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_tick__(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK;
+}
+
+static void insert__(timer_entry_t* t) {
+    uint64_t expires = t->expires < base ? base : t->expires;
+    uint64_t delta = expires - base;
+    unsigned int level = 0;
+
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_BITS * (level + 1)))) {
+        level++;
+    }
+    // beyond the top level a timer waits in its last slot and is put back
+    // when the wheel gets there
+    if (delta >= (1ULL << (TIMER_BITS * TIMER_LEVELS))) {
+        expires = base + (1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    t->level = level;
+    t->slot = (expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+    t->prev = NULL;
+    t->next = wheel[level][t->slot];
+    if (t->next != NULL) {
+        t->next->prev = t;
+    }
+    wheel[level][t->slot] = t;
+    t->armed = true;
+    n_level[level] += 1;
+    n_pending += 1;
+}
+
+static void unlink__(timer_entry_t* t) {
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        wheel[t->level][t->slot] = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    t->prev = t->next = NULL;
+    t->armed = false;
+    n_level[t->level] -= 1;
+    n_pending -= 1;
+}
+
+bool timer_init(void) {
+    base = now_tick__();
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        log_error("ERROR", "Failed to create the timer wakeup\n");
+        return false;
+    }
+    return true;
+}
+
+int timer_wake_fd(void) {
+    return wake_fd;
+}
+
+// arms t to call fn(arg) in ms, moving it if it was armed already
+void timer_add(timer_entry_t* t, unsigned int ms, timer_fn fn, void* arg) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&mutex);
+    if (t->armed) {
+        unlink__(t);
+    }
+    // an empty wheel may not have been advanced for a while
+    if (n_pending == 0) {
+        base = now_tick__();
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->expires = now_tick__() + (ms + TIMER_TICK - 1) / TIMER_TICK;
+    insert__(t);
+    if (t->expires < wake_tick) {
+        wake_tick = t->expires;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            log_error("ERROR", "Failed to wake the event loop\n");
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// after this returns the callback of t does not run, so whatever it
+// touches can go
+void timer_cancel(timer_entry_t* t) {
+    pthread_mutex_lock(&mutex);
+    if (t->armed) {
+        unlink__(t);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// how long the event loop may sleep: until the first due slot of level 0,
+// or until the next slot of level 1 has to be spread out. -1 when no timer
+// is armed
+int timer_next_ms(void) {
+    uint64_t next = UINT64_MAX;
+    uint64_t eventfd_value;
+    int ms = -1;
+
+    pthread_mutex_lock(&mutex);
+    // the wakeup is for this call, whatever is due now is seen below
+    while (read(wake_fd, &eventfd_value, sizeof(eventfd_value)) > 0) {
+    }
+    if (n_pending > 0) {
+        next = (base | (TIMER_SLOTS - 1)) + 1;
+        for (uint64_t tick = base; n_level[0] > 0 && tick < next; tick++) {
+            if (wheel[0][tick & (TIMER_SLOTS - 1)] != NULL) {
+                next = tick;
+                break;
+            }
+        }
+        uint64_t now = now_tick__();
+        ms = next <= now ? 0 : (next - now) * TIMER_TICK;
+    }
+    wake_tick = next;
+    pthread_mutex_unlock(&mutex);
+    return ms;
+}
+
+// runs the timers that are due
+void timer_advance(void) {
+    uint64_t now = now_tick__();
+
+    pthread_mutex_lock(&mutex);
+    while (base <= now) {
+        unsigned int idx = base & (TIMER_SLOTS - 1);
+
+        // spread the slots of the upper levels the wheel reached
+        for (unsigned int level = 1; idx == 0 && level < TIMER_LEVELS; level++) {
+            unsigned int up = (base >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+            timer_entry_t* t = wheel[level][up];
+            wheel[level][up] = NULL;
+            while (t != NULL) {
+                timer_entry_t* next = t->next;
+                n_level[level] -= 1;
+                n_pending -= 1;
+                insert__(t);
+                t = next;
+            }
+            if (up != 0) {
+                break;
+            }
+        }
+
+        timer_entry_t* t = wheel[0][idx];
+        wheel[0][idx] = NULL;
+        while (t != NULL) {
+            timer_entry_t* next = t->next;
+            n_level[0] -= 1;
+            n_pending -= 1;
+            t->armed = false;
+            t->prev = t->next = NULL;
+            unsigned int again = t->fn(t->arg);
+            if (again > 0) {
+                t->expires = now + (again + TIMER_TICK - 1) / TIMER_TICK;
+                insert__(t);
+            }
+            t = next;
+        }
+        base += 1;
+
+        // nothing on level 0, skip to where the next slot above is spread
+        if (n_level[0] == 0 && (base & (TIMER_SLOTS - 1)) != 0) {
+            uint64_t skip = (base | (TIMER_SLOTS - 1)) + 1;
+            base = skip <= now ? skip : now + 1;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// for state a timer callback reads and its owner changes
+void timer_lock(void) {
+    pthread_mutex_lock(&mutex);
+}
+
+void timer_unlock(void) {
+    pthread_mutex_unlock(&mutex);
+}
+
+size_t timer_pending(void) {
+    pthread_mutex_lock(&mutex);
+    size_t n = n_pending;
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
@@ -0,0 +1,39 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK   100 /* ms */
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+// called with the wheel locked once a timer is due. returns 0 when it is
+// done, or the ms after which it is due again
+typedef unsigned int (*timer_fn)(void* arg);
+
+// a deadline, embedded in whatever it guards
+typedef struct timer_entry {
+    uint64_t expires;
+    timer_fn fn;
+    void* arg;
+    bool armed;
+    uint8_t level;
+    uint8_t slot;
+    struct timer_entry* prev;
+    struct timer_entry* next;
+} timer_entry_t;
+
+bool timer_init(void);
+int timer_wake_fd(void);
+void timer_add(timer_entry_t* t, unsigned int ms, timer_fn fn, void* arg);
+void timer_cancel(timer_entry_t* t);
+int timer_next_ms(void);
+void timer_advance(void);
+void timer_lock(void);
+void timer_unlock(void);
+size_t timer_pending(void);
+
+#endif
@@ -0,0 +1,304 @@
+#include "tunnel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admit.h"
+#include "logger.h"
+#include "metrics.h"
+
+// CONNECT tunnels. One thread moves the bytes of all of them: the sockets of
+// a tunnel are non-blocking and watched by an edge triggered epoll, and each
+// direction is spliced through a pipe of its own. Workers hand a tunnel over
+// through the pending list and wake the loop with an eventfd; from then on
+// only the loop thread touches it.
+
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static unsigned int idle_timeout = TUNNEL_IDLE_TIMEOUT;
+static tunnel_t* pending;
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic size_t n_active;
+
+// the ports CONNECT may reach, one bit each. what TUNNEL_DEFAULT_PORTS
+// spells out, anything else would make the proxy an open relay
+static uint64_t allowed_ports[65536 / 64] = {[443 / 64] = 1ULL << (443 % 64)};
+
+// least recently active first, so idle tunnels are found at the front
+static tunnel_t* oldest;
+static tunnel_t* newest;
+// closed during the current batch of events, freed after it
+static tunnel_t* dead;
+
+static void unlink__(tunnel_t* t) {
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else if (oldest == t) {
+        oldest = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    } else if (newest == t) {
+        newest = t->prev;
+    }
+    t->prev = t->next = NULL;
+}
+
+static void append__(tunnel_t* t) {
+    t->last_active = time(NULL);
+    t->prev = newest;
+    t->next = NULL;
+    if (newest != NULL) {
+        newest->next = t;
+    } else {
+        oldest = t;
+    }
+    newest = t;
+}
+
+static void close__(tunnel_t* t, const char* why) {
+    if (t->closed) {
+        return;
+    }
+    t->closed = true;
+    unlink__(t);
+
+    // closing the sockets also takes them out of the epoll set
+    close(t->up.in);
+    close(t->down.in);
+    pump_close(&t->up.pump);
+    pump_close(&t->down.pump);
+    log_info("TUNNEL", "%s %s after %llu bytes up, %llu bytes down\n", t->target, why,
+             (unsigned long long)t->up.bytes, (unsigned long long)t->down.bytes);
+    metrics_gauge_add(GAUGE_ACTIVE_CONNECTIONS, -1);
+    admit_release(t->client_addr);
+    atomic_fetch_sub(&n_active, 1);
+
+    t->next = dead;
+    dead = t;
+}
+
+// moves whatever one direction has ready until a socket would block. the
+// end of the stream is passed on once the pipe is empty. returns false when
+// a socket failed
+static bool pump__(tunnel_dir_t* d, metric_counter_t counter, bool* moved) {
+    ssize_t n;
+
+    for (bool progress = true; progress;) {
+        progress = false;
+        if (d->pump.buffered > 0) {
+            if ((n = pump_drain(&d->pump, d->out)) > 0) {
+                d->bytes += n;
+                metrics_inc(counter, n);
+                progress = true;
+            } else if (n < 0 && errno != EAGAIN) {
+                return false;
+            }
+        }
+        if (!d->eof) {
+            if ((n = pump_fill(&d->pump, d->in, PUMP_PIPE_SIZE)) > 0) {
+                progress = true;
+            } else if (n == 0) {
+                d->eof = true;
+            } else if (errno != EAGAIN) {
+                return false;
+            }
+        }
+        *moved = *moved || progress;
+    }
+
+    if (d->eof && d->pump.buffered == 0 && !d->shut) {
+        shutdown(d->out, SHUT_WR);
+        d->shut = true;
+    }
+    return true;
+}
+
+static void run__(tunnel_t* t) {
+    bool moved = false;
+
+    if (!pump__(&t->up, COUNTER_TUNNEL_BYTES_UP, &moved) ||
+        !pump__(&t->down, COUNTER_TUNNEL_BYTES_DOWN, &moved)) {
+        close__(t, "failed");
+        return;
+    }
+    if (t->up.shut && t->down.shut) {
+        close__(t, "closed");
+        return;
+    }
+    if (moved) {
+        unlink__(t);
+        append__(t);
+    }
+}
+
+// takes over the tunnels workers added since the last wakeup
+static void adopt__(void) {
+    uint64_t count;
+    tunnel_t* t;
+
+    if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_error("ERROR", "Failed to read the tunnel wakeup\n");
+    }
+    pthread_mutex_lock(&pending_mutex);
+    t = pending;
+    pending = NULL;
+    pthread_mutex_unlock(&pending_mutex);
+
+    while (t != NULL) {
+        tunnel_t* next = t->next;
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                                    .data.ptr = t};
+        append__(t);
+        // adding a ready socket reports it right away, nothing is missed
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->up.in, &event) == -1 ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->down.in, &event) == -1) {
+            log_error("ERROR", "Failed to add tunnel to epoll\n");
+            close__(t, "failed");
+        }
+        t = next;
+    }
+}
+
+static void expire__(void) {
+    time_t now = time(NULL);
+
+    while (oldest != NULL && now - oldest->last_active >= idle_timeout) {
+        metrics_inc(COUNTER_TUNNEL_TIMEOUTS, 1);
+        close__(oldest, "timed out");
+    }
+}
+
+static void* loop__(void* unused) {
+    struct epoll_event events[TUNNEL_MAX_EVENTS];
+
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, TUNNEL_MAX_EVENTS, TUNNEL_TICK);
+        if (n < 0 && errno != EINTR) {
+            log_error("ERROR", "An error in the tunnel epoll_wait\n");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            tunnel_t* t = events[i].data.ptr;
+            if (t == NULL) {
+                adopt__();
+            } else if (!t->closed) {
+                run__(t);
+            }
+        }
+        expire__();
+
+        while (dead != NULL) {
+            tunnel_t* next = dead->next;
+            free(dead);
+            dead = next;
+        }
+    }
+    return NULL;
+}
+
+bool tunnel_start(unsigned int timeout) {
+    pthread_t tid;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+
+    idle_timeout = timeout;
+    if ((epoll_fd = epoll_create1(0)) == -1 || (wake_fd = eventfd(0, EFD_NONBLOCK)) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1) {
+        log_error("ERROR", "Failed to set up the tunnel loop\n");
+        return false;
+    }
+    if (pthread_create(&tid, NULL, loop__, NULL) != 0) {
+        log_error("ERROR", "Failed to start the tunnel loop\n");
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+// hands a connected client and origin to the loop. both sockets belong to
+// the tunnel once this returned true, as does the client's admission
+bool tunnel_add(int client_fd, int server_fd, const char* target, uint32_t client_addr) {
+    uint64_t one = 1;
+    tunnel_t* t = calloc(1, sizeof(tunnel_t));
+
+    if (!pump_init(&t->up.pump)) {
+        free(t);
+        return false;
+    }
+    if (!pump_init(&t->down.pump)) {
+        pump_close(&t->up.pump);
+        free(t);
+        return false;
+    }
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+    t->up.in = t->down.out = client_fd;
+    t->up.out = t->down.in = server_fd;
+    strncpy(t->target, target, sizeof(t->target) - 1);
+    t->client_addr = client_addr;
+    atomic_fetch_add(&n_active, 1);
+
+    pthread_mutex_lock(&pending_mutex);
+    t->next = pending;
+    pending = t;
+    pthread_mutex_unlock(&pending_mutex);
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        log_error("ERROR", "Failed to wake the tunnel loop\n");
+    }
+    return true;
+}
+
+size_t tunnel_active(void) {
+    return atomic_load(&n_active);
+}
+
+// replaces the allowed ports, which are left alone when list does not parse
+bool tunnel_ports(const char* list) {
+    uint64_t ports[65536 / 64] = {0};
+    char* copy = strdup(list);
+    char* save = NULL;
+    bool ok = true;
+
+    for (char* token = strtok_r(copy, ",", &save); ok && token != NULL;
+         token = strtok_r(NULL, ",", &save)) {
+        char* end;
+        unsigned long port = strtoul(token, &end, 10);
+
+        ok = *token >= '0' && *token <= '9' && *end == '\0' && port > 0 && port < 65536;
+        if (ok) {
+            ports[port / 64] |= 1ULL << (port % 64);
+        }
+    }
+    free(copy);
+    if (ok) {
+        memcpy(allowed_ports, ports, sizeof(ports));
+    }
+    return ok;
+}
+
+bool tunnel_port_allowed(int port) {
+    return port > 0 && port < 65536 && (allowed_ports[port / 64] & (1ULL << (port % 64))) != 0;
+}
+
+void tunnel_describe_ports(char* buf, size_t cap) {
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int port = 1; port < 65536 && len < cap; port++) {
+        if (tunnel_port_allowed(port)) {
+            len += snprintf(buf + len, cap - len, "%s%d", len > 0 ? "," : "", port);
+        }
+    }
+    if (len == 0) {
+        snprintf(buf, cap, "none");
+    }
+}
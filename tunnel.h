@@ -0,0 +1,48 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "pump.h"
+
+#define TUNNEL_IDLE_TIMEOUT 300 /* s */
+#define TUNNEL_MAX_EVENTS   256
+#define TUNNEL_TICK         1000 /* ms */
+#define TUNNEL_DEFAULT_PORTS "443"
+
+typedef struct tunnel tunnel_t;
+
+// one direction of a tunnel, bytes read from in are written to out
+typedef struct {
+    int in;
+    int out;
+    pump_t pump;
+    uint64_t bytes;
+    bool eof;
+    bool shut;
+} tunnel_dir_t;
+
+// a CONNECT tunnel between a client and an origin. the loop thread owns it
+// once it was added, and keeps tunnels in the order they were last active
+struct tunnel {
+    tunnel_dir_t up;
+    tunnel_dir_t down;
+    time_t last_active;
+    char target[256];
+    uint32_t client_addr;
+    bool closed;
+    tunnel_t* prev;
+    tunnel_t* next;
+};
+
+bool tunnel_start(unsigned int idle_timeout);
+bool tunnel_add(int client_fd, int server_fd, const char* target, uint32_t client_addr);
+size_t tunnel_active(void);
+bool tunnel_ports(const char* list);
+bool tunnel_port_allowed(int port);
+void tunnel_describe_ports(char* buf, size_t cap);
+
+#endif
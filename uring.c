@@ -0,0 +1,192 @@
+#include "uring.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// liburing is not assumed, the three io_uring system calls are used
+// directly. sqes are queued with uring_sqe() and handed to the kernel in
+// one io_uring_enter() by uring_submit(), which also waits for completions.
+
+static int setup__(unsigned int entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int enter__(int fd, unsigned int submit, unsigned int wait, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+bool uring_init(uring_t* ring, unsigned int entries) {
+    struct io_uring_params params;
+    char* sq;
+    char* cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    if ((ring->fd = setup__(entries, &params)) < 0) {
+        return false;
+    }
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels map both rings with one mmap
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_size > 0) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return false;
+        }
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return false;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void uring_exit(uring_t* ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring_size > 0) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// fds registered here are named by their index with IOSQE_FIXED_FILE, which
+// saves the kernel looking them up for every sqe
+bool uring_register_files(uring_t* ring, const int* fds, unsigned int n) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, n) == 0;
+}
+
+// buffers registered here are pinned once, reads into them with
+// IORING_OP_READ_FIXED skip mapping the pages for every sqe
+bool uring_register_buffers(uring_t* ring, const struct iovec* iov, unsigned int n) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+}
+
+// the next free sqe, zeroed. NULL when the ring is full, uring_submit()
+// makes room
+struct io_uring_sqe* uring_sqe(uring_t* ring) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail;
+
+    if (tail - head >= ring->entries) {
+        return NULL;
+    }
+    unsigned int idx = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    // the kernel only looks at the tail in io_uring_enter(), by then the
+    // caller filled the sqe in
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// submits the queued sqes and blocks until at least wait completions are
+// there. returns -1 with errno set on failure
+int uring_submit(uring_t* ring, unsigned int wait) {
+    unsigned int queued = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return enter__(ring->fd, queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+}
+
+// copies the oldest completion into cqe. false when there is none
+bool uring_cqe(uring_t* ring, struct io_uring_cqe* cqe) {
+    unsigned int head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void uring_prep_accept(struct io_uring_sqe* sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+}
+
+// reads into buf, which has to lie in registered buffer buf_index
+void uring_prep_read_fixed(struct io_uring_sqe* sqe, int fd, void* buf, unsigned int len,
+                          unsigned int buf_index, uint64_t user_data) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+}
+
+// buf has to stay as it is until the send completes
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf, size_t len,
+                     uint64_t user_data) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+// a one shot poll, it completes once fd has one of events
+void uring_prep_poll(struct io_uring_sqe* sqe, int fd, unsigned int events, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+// completes with -ETIME once ts passed. ts is read when the sqe is submitted
+void uring_prep_timeout(struct io_uring_sqe* sqe, struct __kernel_timespec* ts, uint64_t user_data) {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+// cancels the timeout queued with user_data target, it completes with
+// -ECANCELED
+void uring_prep_timeout_remove(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
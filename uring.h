@@ -0,0 +1,50 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 256
+
+// an io_uring set up with the raw system calls. the rings are shared with
+// the kernel: we produce sqes and consume cqes, the kernel does the reverse
+typedef struct {
+    int fd;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int entries;
+} uring_t;
+
+bool uring_init(uring_t* ring, unsigned int entries);
+void uring_exit(uring_t* ring);
+bool uring_register_files(uring_t* ring, const int* fds, unsigned int n);
+bool uring_register_buffers(uring_t* ring, const struct iovec* iov, unsigned int n);
+struct io_uring_sqe* uring_sqe(uring_t* ring);
+int uring_submit(uring_t* ring, unsigned int wait);
+bool uring_cqe(uring_t* ring, struct io_uring_cqe* cqe);
+
+void uring_prep_accept(struct io_uring_sqe* sqe, int fd, uint64_t user_data);
+void uring_prep_read_fixed(struct io_uring_sqe* sqe, int fd, void* buf, unsigned int len,
+                          unsigned int buf_index, uint64_t user_data);
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf, size_t len,
+                     uint64_t user_data);
+void uring_prep_poll(struct io_uring_sqe* sqe, int fd, unsigned int events, uint64_t user_data);
+void uring_prep_timeout(struct io_uring_sqe* sqe, struct __kernel_timespec* ts, uint64_t user_data);
+void uring_prep_timeout_remove(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data);
+
+#endif